@@ -0,0 +1,120 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "disk-cache.h"
+#include "segment-store.h"
+
+/**
+ * Measures insert and lookup throughput of our two cache stores: DiskCache
+ * (a file per entry) and SegmentStore (mmapped segments). Lookups run in
+ * several processes at once, as converters do.
+ *
+ * Run it on the disk the cache will live on: tmpfs numbers flatter both.
+ */
+
+static const int NLookupsPerProcess = 100000;
+
+static double
+secondsSince(std::chrono::steady_clock::time_point start)
+{
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static std::string
+keyForIndex(int i)
+{
+  // Like our page-cache keys: a hex digest and a suffix.
+  char buf[96];
+  std::snprintf(buf, sizeof(buf), "%064x-thumbnail-v1-balanced", i);
+  return buf;
+}
+
+/**
+ * Runs NLookupsPerProcess random lookups in each of nProcesses forked
+ * processes. Returns the total lookups per second.
+ */
+template<typename Store> static double
+benchmarkLookups(Store& store, int nEntries, int nProcesses)
+{
+  const auto start = std::chrono::steady_clock::now();
+  for (int p = 0; p < nProcesses; p++) {
+    if (fork() == 0) {
+      std::mt19937 random(p);
+      std::uniform_int_distribution<int> index(0, nEntries - 1);
+      std::vector<uint8_t> value;
+      int nMisses = 0;
+      for (int i = 0; i < NLookupsPerProcess; i++) {
+        if (!store.get(keyForIndex(index(random)), &value)) nMisses++;
+      }
+      _exit(nMisses == NLookupsPerProcess ? 1 : 0);
+    }
+  }
+  for (int p = 0; p < nProcesses; p++) {
+    int status;
+    wait(&status);
+  }
+  return static_cast<double>(nProcesses) * NLookupsPerProcess / secondsSince(start);
+}
+
+template<typename Store> static void
+benchmarkStore(const char* name, Store& store, int nEntries, size_t valueBytes, int nProcesses)
+{
+  const std::vector<uint8_t> value(valueBytes, 0x42);
+
+  const auto insertStart = std::chrono::steady_clock::now();
+  for (int i = 0; i < nEntries; i++) {
+    store.put(keyForIndex(i), value);
+  }
+  const double insertsPerSecond = nEntries / secondsSince(insertStart);
+
+  const double lookupsPerSecond = benchmarkLookups(store, nEntries, nProcesses);
+
+  std::printf("%-10s %12.0f %12.0f\n", name, insertsPerSecond, lookupsPerSecond);
+}
+
+int
+main(int argc, char** argv)
+{
+  if (argc < 2 || argc > 5) {
+    std::fprintf(stderr, "Usage: %s DIRECTORY [N-ENTRIES] [VALUE-BYTES] [N-PROCESSES]\n", argv[0]);
+    std::fprintf(stderr, "\nDIRECTORY must not exist: we create and fill it.\n");
+    return 1;
+  }
+
+  const std::string directory(argv[1]);
+  const int nEntries = argc > 2 ? std::atoi(argv[2]) : 20000;
+  const size_t valueBytes = argc > 3 ? std::atoi(argv[3]) : 20000;
+  const int nProcesses = argc > 4 ? std::atoi(argv[4]) : 4;
+  if (nEntries <= 0 || nProcesses <= 0) {
+    std::fprintf(stderr, "N-ENTRIES and N-PROCESSES must be positive\n");
+    return 1;
+  }
+
+  // Room for everything: we're measuring lookups, not eviction.
+  const uint64_t maxBytes = 4 * static_cast<uint64_t>(nEntries) * (valueBytes + 100);
+
+  std::printf("%d entries of %zu bytes; lookups in %d processes\n", nEntries, valueBytes, nProcesses);
+  std::printf("%-10s %12s %12s\n", "store", "inserts/s", "lookups/s");
+
+  {
+    DiskCache files(directory + "-files", maxBytes);
+    benchmarkStore("files", files, nEntries, valueBytes, nProcesses);
+  }
+  {
+    SegmentStore segments(directory + "-segments", maxBytes);
+    benchmarkStore("segments", segments, nEntries, valueBytes, nProcesses);
+
+    const auto start = std::chrono::steady_clock::now();
+    segments.compact();
+    std::printf("segments: compacted to the most recent half in %.0fms\n", 1000.0 * secondsSince(start));
+  }
+
+  return 0;
+}
@@ -0,0 +1,171 @@
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "public/cpp/fpdf_deleters.h"
+#include "public/fpdfview.h"
+
+#include "options.h"
+#include "pdf-file.h"
+#include "util.h"
+
+/**
+ * Renders every page of every given PDF with each render tier, then at each
+ * of a range of thumbnail sizes, then at each of a range of PNG compression
+ * levels, then in each thumbnail format. Prints each run's time and output
+ * size relative to the default.
+ *
+ * Run it on a realistic corpus -- say, a few hundred PDFs from a real import.
+ * Numbers from one synthetic document are meaningless.
+ */
+
+static const int BenchmarkThumbnailSizes[] = { 100, 200, 350, 500, DefaultThumbnailSize, 1000, 1400 };
+static const int BenchmarkPngCompressionLevels[] = { DefaultPngCompressionLevel, 3, 6, 9 };
+
+struct Result {
+  std::string label;
+  int nPages;
+  double seconds;
+  size_t nBytes;
+};
+
+static Result
+benchmarkOptions(const std::vector<std::string>& filenames, const std::string& label, const Options& options)
+{
+  Result result = { label, 0, 0.0, 0 };
+
+  for (const auto& filename : filenames) {
+    std::unique_ptr<void, FPDFDocumentDeleter> fDocument(FPDF_LoadDocument(filename.c_str(), nullptr));
+    if (!fDocument) {
+      std::fprintf(stderr, "Skipping %s: %s\n", filename.c_str(), formatLastPdfiumError().c_str());
+      continue;
+    }
+    pdfFile().open(filename.c_str(), fDocument.get());
+
+    const int nPages = FPDF_GetPageCount(fDocument.get());
+    for (int pageIndex = 0; pageIndex < nPages; pageIndex++) {
+      std::unique_ptr<void, FPDFPageDeleter> fPage(FPDF_LoadPage(fDocument.get(), pageIndex));
+      if (!fPage) continue;
+
+      // Count the bytes as they're encoded, as we'd output them.
+      size_t nBytes = 0;
+      const ByteSink sink([&nBytes](const uint8_t*, size_t n) { nBytes += n; });
+
+      const auto start = std::chrono::steady_clock::now();
+      const Thumbnail thumbnail(renderPageThumbnailOrOutputErrorAndExit(fPage.get(), options, sink, "BENCHMARK"));
+      const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+      result.nPages++;
+      result.seconds += elapsed.count();
+      result.nBytes += thumbnail.streamed ? nBytes : thumbnail.bytes->size();
+    }
+  }
+
+  return result;
+}
+
+static double
+percentChange(double value, double baseline)
+{
+  return baseline == 0.0 ? 0.0 : 100.0 * (value - baseline) / baseline;
+}
+
+/**
+ * Prints a table of results. `baseline` is the run with default options.
+ */
+static void
+printResults(const char* heading, const std::vector<Result>& results, const Result& baseline)
+{
+  std::printf("%-10s %7s %10s %10s %8s %12s %8s\n", heading, "pages", "ms/page", "total ms", "time", "bytes/page", "size");
+  for (const auto& result : results) {
+    const int nPages = result.nPages ? result.nPages : 1;
+    std::printf(
+      "%-10s %7d %10.2f %10.0f %+7.1f%% %12zu %+7.1f%%\n",
+      result.label.c_str(),
+      result.nPages,
+      1000.0 * result.seconds / nPages,
+      1000.0 * result.seconds,
+      percentChange(result.seconds, baseline.seconds),
+      result.nBytes / nPages,
+      percentChange(result.nBytes, baseline.nBytes)
+    );
+  }
+}
+
+int
+main(int argc, char** argv)
+{
+  if (argc < 2) {
+    std::fprintf(stderr, "Usage: %s FILE.pdf [FILE.pdf...]\n", argv[0]);
+    return 1;
+  }
+
+  const std::vector<std::string> filenames(argv + 1, argv + argc);
+
+  FPDF_InitLibrary();
+
+  // Warm up, and throw the result away: the first run pays for reading the
+  // files, loading fonts and growing the render arena. Otherwise the
+  // baseline, which runs first, looks slower than it is.
+  benchmarkOptions(filenames, "warm-up", Options());
+
+  std::vector<Result> tierResults;
+  for (RenderTier tier : { RenderTier::Balanced, RenderTier::Fast, RenderTier::Best }) {
+    Options options;
+    options.renderTier = tier;
+    tierResults.push_back(benchmarkOptions(filenames, renderTierName(tier), options));
+  }
+  const Result& baseline = tierResults[0];
+  printResults("tier", tierResults, baseline);
+
+  // The cost curve: what each thumbnailSize saves or costs, at the default
+  // tier. We reuse the default tier's run for the default size.
+  std::printf("\n");
+  std::vector<Result> sizeResults;
+  for (int size : BenchmarkThumbnailSizes) {
+    if (size == DefaultThumbnailSize) {
+      sizeResults.push_back(baseline);
+      sizeResults.back().label = std::to_string(size);
+    } else {
+      Options options;
+      options.thumbnailSize = size;
+      sizeResults.push_back(benchmarkOptions(filenames, std::to_string(size), options));
+    }
+  }
+  printResults("size", sizeResults, baseline);
+
+  // The same for pngCompressionLevel.
+  std::printf("\n");
+  std::vector<Result> levelResults;
+  for (int level : BenchmarkPngCompressionLevels) {
+    if (level == DefaultPngCompressionLevel) {
+      levelResults.push_back(baseline);
+      levelResults.back().label = std::to_string(level);
+    } else {
+      Options options;
+      options.pngCompressionLevel = level;
+      levelResults.push_back(benchmarkOptions(filenames, std::to_string(level), options));
+    }
+  }
+  printResults("level", levelResults, baseline);
+
+  // And thumbnailFormat.
+  std::printf("\n");
+  std::vector<Result> formatResults;
+  for (ThumbnailFormat format : { ThumbnailFormat::Auto, ThumbnailFormat::Png, ThumbnailFormat::Jpeg }) {
+    if (format == ThumbnailFormat::Auto) {
+      formatResults.push_back(baseline);
+      formatResults.back().label = thumbnailFormatName(format);
+    } else {
+      Options options;
+      options.thumbnailFormat = format;
+      formatResults.push_back(benchmarkOptions(filenames, thumbnailFormatName(format), options));
+    }
+  }
+  printResults("format", formatResults, baseline);
+
+  FPDF_DestroyLibrary();
+  return 0;
+}
@@ -0,0 +1,172 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <ctime>
+#include <map>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "disk-cache.h"
+
+static const uint64_t DefaultMaxBytes = 1024 * 1024 * 1024;
+
+static const uint64_t UnknownSize = static_cast<uint64_t>(-1);
+
+// Temporary files start with this. A temporary file this old belongs to a
+// process that crashed mid-write: eviction deletes it.
+static const char TemporaryPrefix[] = ".tmp-";
+static const time_t StaleTemporarySeconds = 3600;
+
+DiskCache::DiskCache()
+  : maxBytes(0), nBytes(UnknownSize), nTemporaryFiles(0)
+{
+}
+
+DiskCache::DiskCache(const std::string& directory, uint64_t maxBytes)
+  : directory(directory), maxBytes(maxBytes), nBytes(UnknownSize), nTemporaryFiles(0)
+{
+  if (mkdir(directory.c_str(), 0755) != 0 && errno != EEXIST) {
+    this->directory.clear(); // disable
+  }
+}
+
+DiskCache&
+DiskCache::fromEnvironment(const std::string& prefix)
+{
+  static std::map<std::string, DiskCache*> caches;
+  DiskCache*& cache(caches[prefix]);
+  if (!cache) {
+    const char* directory = std::getenv((prefix + "_DIR").c_str());
+    if (!directory || !*directory) {
+      cache = new DiskCache();
+    } else {
+      uint64_t maxBytes = DefaultMaxBytes;
+      const char* maxBytesString = std::getenv((prefix + "_MAX_BYTES").c_str());
+      if (maxBytesString && *maxBytesString) {
+        char* end = nullptr;
+        const unsigned long long value = std::strtoull(maxBytesString, &end, 10);
+        if (*end == '\0') maxBytes = value;
+      }
+      cache = new DiskCache(directory, maxBytes);
+    }
+  }
+  return *cache;
+}
+
+bool
+DiskCache::get(const std::string& key, std::vector<uint8_t>* value)
+{
+  if (!enabled()) return false;
+
+  const int fd = open((directory + "/" + key).c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) return false;
+
+  bool ok = false;
+  struct stat st;
+  if (fstat(fd, &st) == 0) {
+    value->resize(st.st_size);
+    size_t nRead = 0;
+    while (nRead < value->size()) {
+      const ssize_t n = read(fd, &(*value)[nRead], value->size() - nRead);
+      if (n <= 0) break;
+      nRead += n;
+    }
+    ok = nRead == value->size();
+  }
+
+  if (ok) {
+    futimens(fd, nullptr); // mark as recently used
+  }
+  close(fd);
+  return ok;
+}
+
+void
+DiskCache::put(const std::string& key, const std::vector<uint8_t>& value)
+{
+  if (!enabled() || value.size() > maxBytes) return;
+
+  const std::string temporaryPath = directory + "/" + TemporaryPrefix + std::to_string(getpid()) + "-" + std::to_string(nTemporaryFiles++);
+  const int fd = open(temporaryPath.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+  if (fd == -1) return;
+
+  bool ok = true;
+  size_t nWritten = 0;
+  while (ok && nWritten < value.size()) {
+    const ssize_t n = write(fd, &value[nWritten], value.size() - nWritten);
+    if (n <= 0) ok = false;
+    else nWritten += n;
+  }
+  // fsync before rename: otherwise, after a power cut the rename may have
+  // reached the disk while the data hasn't, leaving a truncated entry.
+  ok = ok && fsync(fd) == 0;
+  ok = close(fd) == 0 && ok;
+
+  if (!ok || rename(temporaryPath.c_str(), (directory + "/" + key).c_str()) != 0) {
+    unlink(temporaryPath.c_str());
+    return;
+  }
+
+  // Other processes write here too, so nBytes drifts low. That's fine: each
+  // eviction re-counts.
+  if (nBytes == UnknownSize) {
+    evict();
+  } else {
+    nBytes += value.size();
+    if (nBytes > maxBytes) evict();
+  }
+}
+
+void
+DiskCache::evict()
+{
+  struct Entry {
+    std::string path;
+    struct timespec mtime;
+    uint64_t nBytes;
+  };
+
+  DIR* dir = opendir(directory.c_str());
+  if (!dir) return;
+
+  const time_t now = time(nullptr);
+  std::vector<Entry> entries;
+  uint64_t total = 0;
+  while (struct dirent* dirent = readdir(dir)) {
+    const std::string name(dirent->d_name);
+    if (name == "." || name == "..") continue;
+
+    const std::string path(directory + "/" + name);
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) continue;
+
+    if (name.compare(0, sizeof(TemporaryPrefix) - 1, TemporaryPrefix) == 0) {
+      // Another process's write in progress -- or a crashed one's leftovers.
+      if (now - st.st_mtime > StaleTemporarySeconds) unlink(path.c_str());
+      continue;
+    }
+
+    entries.push_back({ path, st.st_mtim, static_cast<uint64_t>(st.st_size) });
+    total += st.st_size;
+  }
+  closedir(dir);
+
+  const uint64_t target = maxBytes / 10 * 9;
+  if (total > maxBytes) {
+    std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) {
+      if (a.mtime.tv_sec != b.mtime.tv_sec) return a.mtime.tv_sec < b.mtime.tv_sec;
+      return a.mtime.tv_nsec < b.mtime.tv_nsec;
+    });
+    for (const auto& entry : entries) {
+      if (total <= target) break;
+      // If another process deleted it first, it's gone all the same.
+      unlink(entry.path.c_str());
+      total -= entry.nBytes;
+    }
+  }
+
+  nBytes = total;
+}
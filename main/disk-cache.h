@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * A size-bounded directory of files, one per entry, shared by every process
+ * that points at the same directory.
+ *
+ * Each process converts one document and exits, so to skip work we've done
+ * before we need a cache that outlives it. This one suits few, big entries
+ * (the result cache stores a whole document's output per entry). For many
+ * small entries, see SegmentStore.
+ *
+ * The cache is best-effort. Every error (a full disk, a missing directory, a
+ * race with another process's eviction) reads as a miss or a dropped write:
+ * it never fails a conversion.
+ *
+ * Writes are crash-safe: we write a temporary file, fsync() it and rename()
+ * it into place, so a reader sees a whole entry or none. Eviction is
+ * least-recently-used by mtime: a hit touches its file, and when the
+ * directory grows past maxBytes we delete the oldest files.
+ */
+class DiskCache {
+public:
+  /**
+   * Creates a cache that does nothing: get() always misses.
+   */
+  DiskCache();
+
+  /**
+   * Creates a cache in `directory` (creating it if needed) holding at most
+   * about `maxBytes`.
+   */
+  DiskCache(const std::string& directory, uint64_t maxBytes);
+
+  DiskCache(const DiskCache&) = delete;
+  DiskCache& operator=(const DiskCache&) = delete;
+
+  /**
+   * Returns the cache configured by the environment: for `prefix`
+   * "PAGE_CACHE", PAGE_CACHE_DIR (unset or empty means no cache) and
+   * PAGE_CACHE_MAX_BYTES (default 1GB).
+   *
+   * Each prefix's cache is created on first call and lives until exit.
+   */
+  static DiskCache& fromEnvironment(const std::string& prefix);
+
+  bool enabled() const { return !directory.empty(); }
+
+  /**
+   * Reads the entry into `value` and returns true, or returns false on a miss.
+   *
+   * `key` must be a valid filename: we use hex digests and [-a-z0-9].
+   */
+  bool get(const std::string& key, std::vector<uint8_t>* value);
+
+  /**
+   * Writes the entry, replacing any existing one, and evicts old entries if
+   * the cache has grown too big.
+   */
+  void put(const std::string& key, const std::vector<uint8_t>& value);
+
+private:
+  /**
+   * Deletes least-recently-used entries until the cache is under 90% of
+   * maxBytes, and sets nBytes to what remains.
+   */
+  void evict();
+
+  std::string directory;
+  uint64_t maxBytes;
+  uint64_t nBytes; // our estimate of the cache's size, or -1 before evict()
+  unsigned int nTemporaryFiles; // for unique temporary filenames
+};
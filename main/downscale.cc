@@ -0,0 +1,130 @@
+#include <cstring>
+#include <vector>
+
+#if defined(__x86_64__)
+#include <emmintrin.h>
+#endif
+
+#include "downscale.h"
+
+/**
+ * A 16-bit sum can hold this many 8-bit rows without overflowing.
+ */
+static const size_t MaxRowsPer16BitSum = 65535 / 255;
+
+/**
+ * Adds each byte of `row` to the corresponding 16-bit sum.
+ */
+static void
+addRow16(uint16_t* sums, const uint8_t* row, size_t nBytes)
+{
+  size_t i = 0;
+
+#if defined(__x86_64__)
+  const __m128i zero = _mm_setzero_si128();
+  for (; i + 16 <= nBytes; i += 16) {
+    const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i));
+    __m128i* s = reinterpret_cast<__m128i*>(sums + i);
+    _mm_storeu_si128(s, _mm_add_epi16(_mm_loadu_si128(s), _mm_unpacklo_epi8(v, zero)));
+    _mm_storeu_si128(s + 1, _mm_add_epi16(_mm_loadu_si128(s + 1), _mm_unpackhi_epi8(v, zero)));
+  }
+#endif
+
+  for (; i < nBytes; i++) {
+    sums[i] += row[i];
+  }
+}
+
+/**
+ * Adds each byte of `row` to the corresponding 32-bit sum.
+ *
+ * Only for absurdly tall sources, where a band has too many rows for addRow16.
+ */
+static void
+addRow32(uint32_t* sums, const uint8_t* row, size_t nBytes)
+{
+  for (size_t i = 0; i < nBytes; i++) {
+    sums[i] += row[i];
+  }
+}
+
+/**
+ * Writes one destination row: the average of each destination pixel's
+ * columns of `sums`, a band of `nRows` source rows.
+ */
+template<typename Sum>
+static void
+outputRow(const Sum* sums, size_t nRows, const std::vector<size_t>& columnStarts, int bytesPerPixel, uint8_t* dst)
+{
+  const size_t dstWidth = columnStarts.size() - 1;
+  for (size_t x = 0; x < dstWidth; x++) {
+    const size_t x0 = columnStarts[x];
+    const size_t x1 = columnStarts[x + 1];
+    const uint64_t n = (x1 - x0) * nRows;
+
+    for (int c = 0; c < bytesPerPixel; c++) {
+      uint64_t total = 0;
+      for (size_t sx = x0; sx < x1; sx++) {
+        total += sums[sx * bytesPerPixel + c];
+      }
+      *dst++ = static_cast<uint8_t>((total + n / 2) / n);
+    }
+  }
+}
+
+template<typename Sum>
+static void
+downscaleBoxWith(
+  void (*addRow)(Sum*, const uint8_t*, size_t),
+  const uint8_t* src,
+  size_t srcWidth,
+  size_t srcHeight,
+  size_t srcStride,
+  int bytesPerPixel,
+  uint8_t* dst,
+  size_t dstWidth,
+  size_t dstHeight
+)
+{
+  const size_t rowBytes = srcWidth * bytesPerPixel;
+  std::vector<Sum> sums(rowBytes);
+
+  std::vector<size_t> columnStarts(dstWidth + 1);
+  for (size_t x = 0; x <= dstWidth; x++) {
+    columnStarts[x] = x * srcWidth / dstWidth;
+  }
+
+  for (size_t y = 0; y < dstHeight; y++) {
+    const size_t y0 = y * srcHeight / dstHeight;
+    const size_t y1 = (y + 1) * srcHeight / dstHeight;
+
+    std::memset(&sums[0], 0, rowBytes * sizeof(Sum));
+    for (size_t sy = y0; sy < y1; sy++) {
+      addRow(&sums[0], src + sy * srcStride, rowBytes);
+    }
+
+    outputRow(&sums[0], y1 - y0, columnStarts, bytesPerPixel, dst + y * dstWidth * bytesPerPixel);
+  }
+}
+
+void
+downscaleBox(
+  const uint8_t* src,
+  size_t srcWidth,
+  size_t srcHeight,
+  size_t srcStride,
+  int bytesPerPixel,
+  uint8_t* dst,
+  size_t dstWidth,
+  size_t dstHeight
+)
+{
+  // The tallest band is ceil(srcHeight / dstHeight) rows.
+  const size_t maxRowsPerBand = (srcHeight + dstHeight - 1) / dstHeight;
+
+  if (maxRowsPerBand <= MaxRowsPer16BitSum) {
+    downscaleBoxWith<uint16_t>(addRow16, src, srcWidth, srcHeight, srcStride, bytesPerPixel, dst, dstWidth, dstHeight);
+  } else {
+    downscaleBoxWith<uint32_t>(addRow32, src, srcWidth, srcHeight, srcStride, bytesPerPixel, dst, dstWidth, dstHeight);
+  }
+}
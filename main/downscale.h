@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * Shrinks an image with a box filter: each destination pixel is the average
+ * of the source pixels it covers.
+ *
+ * `src` has `srcStride` bytes per row; `dst` is tightly packed. Both have
+ * `bytesPerPixel` 8-bit channels per pixel, which we average independently.
+ * The destination must not be larger than the source in either dimension.
+ *
+ * We sum each band of source rows with SSE2 (on x86-64), then sum each
+ * destination pixel's columns within the band. So we read every source byte
+ * once, in order, which is what matters for a 25MB scanned image.
+ */
+void
+downscaleBox(
+  const uint8_t* src,
+  size_t srcWidth,
+  size_t srcHeight,
+  size_t srcStride,
+  int bytesPerPixel,
+  uint8_t* dst,
+  size_t dstWidth,
+  size_t dstHeight
+);
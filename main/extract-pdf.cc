@@ -5,16 +5,22 @@
 #include <cmath>
 #include <memory>
 #include <string>
+#include <vector>
 
 #include "public/cpp/fpdf_deleters.h"
 #include "public/fpdfview.h"
 #include "public/fpdf_ppo.h"
 #include "json.hpp"
 
+#include "page-fingerprint.h"
+#include "pdf-file.h"
+#include "result-cache.h"
+#include "segment-store.h"
+#include "thumbnail-sprite.h"
 #include "util.h"
 
 static void
-extractPdf(const char* filename, const std::string& inputJson, const std::string& mimeBoundary)
+extractPdf(const char* filename, const std::string& inputJson, const Options& options, const std::string& mimeBoundary)
 {
   FPDF_STRING fFilename(filename);
   std::unique_ptr<void, FPDFDocumentDeleter> fDocument(FPDF_LoadDocument(fFilename, nullptr));
@@ -22,28 +28,51 @@ extractPdf(const char* filename, const std::string& inputJson, const std::string
     outputErrorAndExit(std::string("Failed to open PDF: ") + formatLastPdfiumError(), mimeBoundary);
     return;
   }
+  pdfFile().open(filename, fDocument.get());
 
-  nlohmann::json jsonData = nlohmann::json::parse(inputJson);
-  addDocumentMetadataFromPdf(jsonData["metadata"], fDocument.get());
-  outputFragment("0.json", jsonData.dump(), mimeBoundary);
+  const int nPages = FPDF_GetPageCount(fDocument.get());
+  ThumbnailSprite sprite(fDocument.get(), nPages, options);
+
+  nlohmann::json pdfMetadata = nlohmann::json::object();
+  addDocumentMetadataFromPdf(pdfMetadata, fDocument.get());
+  nlohmann::json patch = nlohmann::json::object();
+  if (!sprite.empty()) {
+    patch["thumbnailSprite"] = sprite.layoutJson();
+  }
+  outputJsonFragment("0.json", nlohmann::json::parse(inputJson), pdfMetadata, patch, mimeBoundary);
   outputFragment("inherit-blob", "", mimeBoundary);
 
-  const int nPages = FPDF_GetPageCount(fDocument.get());
   std::vector<std::string> pageTexts;
   pageTexts.reserve(nPages);
 
-  // Page 1: output thumbnail, collect text
+  // Page 1: output thumbnail, collect text. With a page cache, a cover sheet
+  // or letterhead we've seen in another document needn't be rendered again.
+  // (We only fingerprint page 1: for the rest we only extract text, which
+  // costs about as much as exporting the page to fingerprint it.)
   std::unique_ptr<void, FPDFPageDeleter> fPage(FPDF_LoadPage(fDocument.get(), 0));
-  outputPageThumbnailFragmentOrErrorAndExit(fPage.get(), 0, mimeBoundary);
-  pageTexts.push_back(getPageTextUtf8OrOutputErrorAndExit(fPage.get(), mimeBoundary));
+  if (SegmentStore::fromEnvironment("PAGE_CACHE").enabled()) {
+    const std::string fingerprint(writePageBlobOrOutputErrorAndExit(fDocument.get(), 0, [](const uint8_t*, size_t) {}, mimeBoundary));
+    outputPageThumbnailFragmentOrErrorAndExit(fPage.get(), 0, fingerprint, options, mimeBoundary);
+    pageTexts.push_back(getPageTextUtf8OrOutputErrorAndExit(fPage.get(), fingerprint, mimeBoundary));
+  } else {
+    outputPageThumbnailFragmentOrErrorAndExit(fPage.get(), 0, options, mimeBoundary);
+    pageTexts.push_back(getPageTextUtf8OrOutputErrorAndExit(fPage.get(), mimeBoundary));
+  }
+  sprite.renderPageOrOutputErrorAndExit(fPage.get(), 0, mimeBoundary);
 
-  // Pages 2-n: collect text, reporting progress along the way
+  // Pages 2-n: collect text (and sprite tiles), reporting progress along the
+  // way
   for (int pageIndex = 1; pageIndex < nPages; pageIndex++) {
     outputProgress(pageIndex, nPages, mimeBoundary);
     fPage.reset(FPDF_LoadPage(fDocument.get(), pageIndex));
+    sprite.renderPageOrOutputErrorAndExit(fPage.get(), pageIndex, mimeBoundary);
     pageTexts.push_back(getPageTextUtf8OrOutputErrorAndExit(fPage.get(), mimeBoundary));
   }
 
+  if (!sprite.empty()) {
+    outputFragment("0-thumbnail-sprite.png", sprite.encodePng(), mimeBoundary);
+  }
+
   // Output text
   outputFragmentPrefix("0.txt", mimeBoundary);
   outputBytes(pageTexts[0]);
@@ -57,19 +86,28 @@ extractPdf(const char* filename, const std::string& inputJson, const std::string
 int
 main(int argc, char** argv)
 {
-  if (argc != 3) {
-    std::cerr << "Usage: " << argv[0] << " MIME-BOUNDARY JSON" << std::endl
+  if (argc != 3 && argc != 4) {
+    std::cerr << "Usage: " << argv[0] << " MIME-BOUNDARY JSON [OPTIONS-JSON]" << std::endl
               << std::endl
-              << "JSON will be emitted as-is." << std::endl;
+              << "JSON will be emitted as-is." << std::endl
+              << "OPTIONS-JSON may set \"thumbnailQuality\", \"thumbnailSize\"," << std::endl
+              << "\"extraThumbnailSizes\", \"thumbnailSpritePages\"," << std::endl
+              << "\"pngCompressionLevel\" and \"thumbnailFormat\"." << std::endl;
 
     return 1;
   }
 
   const std::string mimeBoundary = argv[1];
   const std::string inputJson = argv[2];
+  const std::string optionsJson(argc == 4 ? argv[3] : "{}");
+  const Options options(parseOptionsOrOutputErrorAndExit(optionsJson, mimeBoundary));
+
+  // A document we've converted before needs no PDFium at all.
+  const std::string resultKey(resultCacheKey("extract-pdf", optionsJson, "input.blob"));
+  replayCachedResultOrStartRecording(resultKey, nlohmann::json::parse(inputJson), mimeBoundary);
 
   FPDF_InitLibrary();
-  extractPdf("input.blob", inputJson, mimeBoundary);
+  extractPdf("input.blob", inputJson, options, mimeBoundary);
 
   outputDoneAndExit(mimeBoundary);
 
@@ -0,0 +1,224 @@
+#include <csetjmp>
+#include <cstdio> // jpeglib.h needs FILE
+
+#include <jpeglib.h>
+
+#include "jpeg.h"
+
+/**
+ * libjpeg error manager that longjmp()s back to us instead of exiting.
+ *
+ * libjpeg's default error_exit() calls exit(). We're better off rendering the
+ * page with PDFium than dying on a corrupt image.
+ */
+struct JpegErrorManager {
+  jpeg_error_mgr pub; // must be first: libjpeg casts
+  jmp_buf jump;
+};
+
+static void
+onJpegError(j_common_ptr cinfo)
+{
+  JpegErrorManager* err = reinterpret_cast<JpegErrorManager*>(cinfo->err);
+  std::longjmp(err->jump, 1);
+}
+
+static void
+onJpegMessage(j_common_ptr cinfo)
+{
+  // Ignore warnings: stdout is our output stream, and stderr is noise.
+}
+
+static void
+initErrorManager(JpegErrorManager* err)
+{
+  jpeg_std_error(&err->pub);
+  err->pub.error_exit = onJpegError;
+  err->pub.output_message = onJpegMessage;
+}
+
+bool
+decodeJpegScaled(const uint8_t* jpeg, size_t nBytes, size_t minWidth, size_t minHeight, JpegPixels* out)
+{
+  jpeg_decompress_struct cinfo;
+  JpegErrorManager err;
+  initErrorManager(&err);
+  cinfo.err = &err.pub;
+
+  if (setjmp(err.jump)) {
+    jpeg_destroy_decompress(&cinfo);
+    return false;
+  }
+
+  jpeg_create_decompress(&cinfo);
+  jpeg_mem_src(&cinfo, const_cast<unsigned char*>(jpeg), nBytes);
+  jpeg_read_header(&cinfo, TRUE);
+
+  switch (cinfo.jpeg_color_space) {
+    case JCS_GRAYSCALE:
+      cinfo.out_color_space = JCS_GRAYSCALE;
+      break;
+    case JCS_YCbCr:
+    case JCS_RGB:
+      cinfo.out_color_space = JCS_RGB;
+      break;
+    default:
+      jpeg_destroy_decompress(&cinfo);
+      return false; // CMYK, YCCK
+  }
+
+  // Pick the smallest scale that doesn't make us enlarge.
+  cinfo.scale_num = 1;
+  for (unsigned int denom = 8; denom >= 1; denom /= 2) {
+    cinfo.scale_denom = denom;
+    jpeg_calc_output_dimensions(&cinfo);
+    if (cinfo.output_width >= minWidth && cinfo.output_height >= minHeight) break;
+  }
+
+  jpeg_start_decompress(&cinfo);
+
+  out->width = cinfo.output_width;
+  out->height = cinfo.output_height;
+  out->nComponents = cinfo.output_components;
+  const size_t rowBytes = out->width * out->nComponents;
+  out->pixels.resize(rowBytes * out->height);
+
+  while (cinfo.output_scanline < cinfo.output_height) {
+    JSAMPROW row = &out->pixels[cinfo.output_scanline * rowBytes];
+    jpeg_read_scanlines(&cinfo, &row, 1);
+  }
+
+  jpeg_finish_decompress(&cinfo);
+  jpeg_destroy_decompress(&cinfo);
+  return true;
+}
+
+// Compressed bytes we buffer before handing them to the sink.
+static const size_t JpegOutputBufferSize = 64 * 1024;
+
+/**
+ * libjpeg destination manager that hands each full buffer to a sink.
+ */
+struct JpegSinkDestination {
+  jpeg_destination_mgr pub; // must be first: libjpeg casts
+  JpegWriter::Sink sink;
+  std::vector<uint8_t> buffer;
+};
+
+static void
+initSinkDestination(j_compress_ptr cinfo)
+{
+  JpegSinkDestination* dest = reinterpret_cast<JpegSinkDestination*>(cinfo->dest);
+  dest->pub.next_output_byte = &dest->buffer[0];
+  dest->pub.free_in_buffer = dest->buffer.size();
+}
+
+static boolean
+emptySinkDestination(j_compress_ptr cinfo)
+{
+  // libjpeg only calls this when the whole buffer is full.
+  JpegSinkDestination* dest = reinterpret_cast<JpegSinkDestination*>(cinfo->dest);
+  dest->sink(&dest->buffer[0], dest->buffer.size());
+  dest->pub.next_output_byte = &dest->buffer[0];
+  dest->pub.free_in_buffer = dest->buffer.size();
+  return TRUE;
+}
+
+static void
+termSinkDestination(j_compress_ptr cinfo)
+{
+  JpegSinkDestination* dest = reinterpret_cast<JpegSinkDestination*>(cinfo->dest);
+  const size_t nBytes = dest->buffer.size() - dest->pub.free_in_buffer;
+  if (nBytes) dest->sink(&dest->buffer[0], nBytes);
+}
+
+struct JpegWriter::State {
+  jpeg_compress_struct cinfo;
+  JpegErrorManager err;
+  JpegSinkDestination dest;
+};
+
+JpegWriter::JpegWriter(size_t width, size_t height, int nComponents, int quality, const Sink& sink)
+  : state(new State()), // zeroed: jpeg_destroy_compress() is safe even if create fails
+    ok(true)
+{
+  jpeg_compress_struct& cinfo(state->cinfo);
+  initErrorManager(&state->err);
+  cinfo.err = &state->err.pub;
+
+  state->dest.sink = sink;
+  state->dest.buffer.resize(JpegOutputBufferSize);
+  state->dest.pub.init_destination = initSinkDestination;
+  state->dest.pub.empty_output_buffer = emptySinkDestination;
+  state->dest.pub.term_destination = termSinkDestination;
+
+  if (setjmp(state->err.jump)) {
+    ok = false;
+    return;
+  }
+
+  jpeg_create_compress(&cinfo);
+  cinfo.dest = &state->dest.pub;
+
+  cinfo.image_width = width;
+  cinfo.image_height = height;
+  cinfo.input_components = nComponents;
+  cinfo.in_color_space = nComponents == 1 ? JCS_GRAYSCALE : JCS_RGB;
+  jpeg_set_defaults(&cinfo);
+  jpeg_set_quality(&cinfo, quality, TRUE);
+  cinfo.dct_method = JDCT_IFAST;
+
+  jpeg_start_compress(&cinfo, TRUE);
+}
+
+JpegWriter::~JpegWriter()
+{
+  jpeg_destroy_compress(&state->cinfo);
+}
+
+bool
+JpegWriter::writeRow(const uint8_t* row)
+{
+  if (!ok || state->cinfo.next_scanline >= state->cinfo.image_height) {
+    ok = false;
+    return false;
+  }
+
+  if (setjmp(state->err.jump)) {
+    ok = false;
+    return false;
+  }
+
+  JSAMPROW samples = const_cast<JSAMPROW>(row);
+  jpeg_write_scanlines(&state->cinfo, &samples, 1);
+  return true;
+}
+
+bool
+JpegWriter::finish()
+{
+  if (!ok) return false;
+
+  if (setjmp(state->err.jump)) {
+    ok = false;
+    return false;
+  }
+
+  jpeg_finish_compress(&state->cinfo); // errors if rows are missing
+  return true;
+}
+
+bool
+encodeJpeg(const uint8_t* pixels, size_t width, size_t height, int nComponents, int quality, std::vector<uint8_t>* out)
+{
+  out->clear();
+  JpegWriter writer(width, height, nComponents, quality, [out](const uint8_t* bytes, size_t nBytes) {
+    out->insert(out->end(), bytes, bytes + nBytes);
+  });
+
+  const size_t rowBytes = width * nComponents;
+  for (size_t y = 0; y < height; y++) {
+    if (!writer.writeRow(pixels + y * rowBytes)) return false;
+  }
+  return writer.finish();
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+
+/**
+ * Decoded 8-bit gray (nComponents=1) or RGB (nComponents=3) pixels, tightly
+ * packed.
+ */
+struct JpegPixels {
+  size_t width;
+  size_t height;
+  int nComponents;
+  std::vector<uint8_t> pixels;
+};
+
+/**
+ * Decodes a JPEG at the smallest of 1/8, 1/4, 1/2 or full scale that is at
+ * least minWidth x minHeight.
+ *
+ * libjpeg's scaled IDCT skips most of the work at 1/8 scale: it computes only
+ * each 8x8 block's DC coefficient. A 300dpi letter-size scan decoded at 1/4
+ * scale is 638x825 -- just bigger than a thumbnail, at 1/16th the work.
+ *
+ * Returns false (leaving `out` in an undefined state) if the JPEG is invalid
+ * or is CMYK: PDFs' CMYK JPEGs are often inverted, and we'd rather leave that
+ * puzzle to PDFium.
+ */
+bool
+decodeJpegScaled(
+  const uint8_t* jpeg,
+  size_t nBytes,
+  size_t minWidth,
+  size_t minHeight,
+  JpegPixels* out
+);
+
+/**
+ * Encodes a JPEG one row at a time, handing finished bytes to a sink as it
+ * goes -- like PngWriter, so callers can stream and band either format.
+ *
+ * We use the system libjpeg, which is libjpeg-turbo: its DCT and RGB-to-YCbCr
+ * conversion are SIMD. We pick the fast integer DCT (JDCT_IFAST). Its
+ * rounding only shows at qualities above 90, and our thumbnails are lower.
+ *
+ * Usage:
+ *
+ *     JpegWriter writer(width, height, 3, quality, sink);
+ *     for (each row) writer.writeRow(row);
+ *     writer.finish(); // sink gets the rest
+ *
+ * writeRow() and finish() return false on error (libjpeg out of memory, too
+ * many or too few rows); after that, the sink's output is garbage.
+ */
+class JpegWriter {
+public:
+  typedef std::function<void(const uint8_t* bytes, size_t nBytes)> Sink;
+
+  /**
+   * Starts a JPEG of 8-bit gray (nComponents=1) or RGB (nComponents=3)
+   * pixels at libjpeg `quality` (1-100).
+   */
+  JpegWriter(size_t width, size_t height, int nComponents, int quality, const Sink& sink);
+  ~JpegWriter();
+
+  // libjpeg's state points back into ours: never copy or move one.
+  JpegWriter(const JpegWriter&) = delete;
+  JpegWriter& operator=(const JpegWriter&) = delete;
+
+  /**
+   * Compresses one row of width * nComponents bytes.
+   */
+  bool writeRow(const uint8_t* row);
+
+  /**
+   * Compresses the last buffered rows and writes the end-of-image marker.
+   */
+  bool finish();
+
+private:
+  struct State; // libjpeg's structs: jpeglib.h clashes with too much to include here
+  std::unique_ptr<State> state;
+  bool ok;
+};
+
+/**
+ * Encodes 8-bit gray (nComponents=1) or RGB (nComponents=3) pixels as a JPEG
+ * with JpegWriter, replacing the contents of `out`.
+ *
+ * Returns false on error.
+ */
+bool
+encodeJpeg(
+  const uint8_t* pixels,
+  size_t width,
+  size_t height,
+  int nComponents,
+  int quality,
+  std::vector<uint8_t>* out
+);
@@ -0,0 +1,186 @@
+#include <algorithm>
+#include <cstdint>
+#include <string>
+
+#include "public/fpdfview.h"
+#include "json.hpp"
+
+#include "options.h"
+#include "util.h"
+
+static RenderTier
+parseRenderTierOrOutputErrorAndExit(const nlohmann::json& value, const std::string& mimeBoundary)
+{
+  if (value == "fast") return RenderTier::Fast;
+  if (value == "balanced") return RenderTier::Balanced;
+  if (value == "best") return RenderTier::Best;
+
+  outputErrorAndExit(std::string("Invalid thumbnailQuality ") + value.dump() + ": expected \"fast\", \"balanced\" or \"best\"", mimeBoundary);
+  return RenderTier::Balanced;
+}
+
+static int
+parseThumbnailSizeOrOutputErrorAndExit(const nlohmann::json& value, const std::string& mimeBoundary)
+{
+  if (!value.is_number_integer()) {
+    outputErrorAndExit(std::string("Invalid thumbnailSize ") + value.dump() + ": expected an integer", mimeBoundary);
+    return DefaultThumbnailSize;
+  }
+
+  // Clamp, rather than fail the import: a too-big size is a cost choice, not
+  // a mistake in the document.
+  const int64_t size = value.get<int64_t>();
+  return static_cast<int>(std::max<int64_t>(MinThumbnailSize, std::min<int64_t>(MaxThumbnailSize, size)));
+}
+
+static std::vector<int>
+parseExtraThumbnailSizesOrOutputErrorAndExit(const nlohmann::json& value, int thumbnailSize, const std::string& mimeBoundary)
+{
+  std::vector<int> sizes;
+
+  // Each size names its fragment ("N-thumbnail-SIZE.png"), so sizes must be
+  // distinct -- and smaller than the main thumbnail, which we shrink.
+  bool valid = value.is_array() && value.size() <= MaxExtraThumbnailSizes;
+  if (valid) {
+    for (const auto& size : value) {
+      if (!size.is_number_integer() || size.get<int64_t>() < 1 || size.get<int64_t>() >= thumbnailSize) {
+        valid = false;
+        break;
+      }
+      const int n = static_cast<int>(size.get<int64_t>());
+      if (std::find(sizes.begin(), sizes.end(), n) != sizes.end()) {
+        valid = false;
+        break;
+      }
+      sizes.push_back(n);
+    }
+  }
+
+  if (!valid) {
+    outputErrorAndExit(std::string("Invalid extraThumbnailSizes ") + value.dump() + ": expected an Array of up to " + std::to_string(MaxExtraThumbnailSizes) + " distinct integers from 1 to " + std::to_string(thumbnailSize - 1), mimeBoundary);
+  }
+  return sizes;
+}
+
+static int
+parseThumbnailSpritePagesOrOutputErrorAndExit(const nlohmann::json& value, const std::string& mimeBoundary)
+{
+  if (value.is_number_integer() && value.get<int64_t>() >= 0 && value.get<int64_t>() <= MaxThumbnailSpritePages) {
+    return value.get<int>();
+  }
+
+  outputErrorAndExit(std::string("Invalid thumbnailSpritePages ") + value.dump() + ": expected an integer from 0 to " + std::to_string(MaxThumbnailSpritePages), mimeBoundary);
+  return 0;
+}
+
+static int
+parsePngCompressionLevelOrOutputErrorAndExit(const nlohmann::json& value, const std::string& mimeBoundary)
+{
+  if (value.is_number_integer() && value.get<int64_t>() >= MinPngCompressionLevel && value.get<int64_t>() <= MaxPngCompressionLevel) {
+    return value.get<int>();
+  }
+
+  outputErrorAndExit(std::string("Invalid pngCompressionLevel ") + value.dump() + ": expected an integer from " + std::to_string(MinPngCompressionLevel) + " to " + std::to_string(MaxPngCompressionLevel), mimeBoundary);
+  return DefaultPngCompressionLevel;
+}
+
+static ThumbnailFormat
+parseThumbnailFormatOrOutputErrorAndExit(const nlohmann::json& value, const std::string& mimeBoundary)
+{
+  if (value == "auto") return ThumbnailFormat::Auto;
+  if (value == "png") return ThumbnailFormat::Png;
+  if (value == "jpeg") return ThumbnailFormat::Jpeg;
+
+  outputErrorAndExit(std::string("Invalid thumbnailFormat ") + value.dump() + ": expected \"auto\", \"png\" or \"jpeg\"", mimeBoundary);
+  return ThumbnailFormat::Auto;
+}
+
+Options
+parseOptionsOrOutputErrorAndExit(const std::string& optionsJson, const std::string& mimeBoundary)
+{
+  Options options;
+
+  const nlohmann::json json = nlohmann::json::parse(optionsJson, nullptr, false);
+  if (json.is_discarded() || !json.is_object()) {
+    outputErrorAndExit(std::string("Invalid options JSON: ") + optionsJson, mimeBoundary);
+    return options;
+  }
+
+  const auto thumbnailQuality = json.find("thumbnailQuality");
+  if (thumbnailQuality != json.end() && !thumbnailQuality->is_null()) {
+    options.renderTier = parseRenderTierOrOutputErrorAndExit(*thumbnailQuality, mimeBoundary);
+  }
+
+  const auto thumbnailSize = json.find("thumbnailSize");
+  if (thumbnailSize != json.end() && !thumbnailSize->is_null()) {
+    options.thumbnailSize = parseThumbnailSizeOrOutputErrorAndExit(*thumbnailSize, mimeBoundary);
+  }
+
+  const auto extraThumbnailSizes = json.find("extraThumbnailSizes");
+  if (extraThumbnailSizes != json.end() && !extraThumbnailSizes->is_null()) {
+    options.extraThumbnailSizes = parseExtraThumbnailSizesOrOutputErrorAndExit(*extraThumbnailSizes, options.thumbnailSize, mimeBoundary);
+  }
+
+  const auto thumbnailSpritePages = json.find("thumbnailSpritePages");
+  if (thumbnailSpritePages != json.end() && !thumbnailSpritePages->is_null()) {
+    options.thumbnailSpritePages = parseThumbnailSpritePagesOrOutputErrorAndExit(*thumbnailSpritePages, mimeBoundary);
+  }
+
+  const auto pngCompressionLevel = json.find("pngCompressionLevel");
+  if (pngCompressionLevel != json.end() && !pngCompressionLevel->is_null()) {
+    options.pngCompressionLevel = parsePngCompressionLevelOrOutputErrorAndExit(*pngCompressionLevel, mimeBoundary);
+  }
+
+  const auto thumbnailFormat = json.find("thumbnailFormat");
+  if (thumbnailFormat != json.end() && !thumbnailFormat->is_null()) {
+    options.thumbnailFormat = parseThumbnailFormatOrOutputErrorAndExit(*thumbnailFormat, mimeBoundary);
+  }
+
+  return options;
+}
+
+const char*
+renderTierName(RenderTier tier)
+{
+  switch (tier) {
+    case RenderTier::Fast: return "fast";
+    case RenderTier::Balanced: return "balanced";
+    case RenderTier::Best: return "best";
+  }
+  return "";
+}
+
+const char*
+thumbnailFormatName(ThumbnailFormat format)
+{
+  switch (format) {
+    case ThumbnailFormat::Auto: return "auto";
+    case ThumbnailFormat::Png: return "png";
+    case ThumbnailFormat::Jpeg: return "jpeg";
+  }
+  return "";
+}
+
+int
+renderFlagsForTier(RenderTier tier)
+{
+  // We render each page once, so PDFium's image cache is of no use to us:
+  // FPDF_RENDER_LIMITEDIMAGECACHE saves memory and doesn't change pixels.
+  switch (tier) {
+    case RenderTier::Fast:
+      // Text and line art get jagged; scans get blocky. Still legible at
+      // thumbnail size, and it skips anti-aliasing -- the costliest part of
+      // rasterizing text-heavy pages.
+      return FPDF_RENDER_LIMITEDIMAGECACHE
+        | FPDF_RENDER_NO_SMOOTHTEXT
+        | FPDF_RENDER_NO_SMOOTHIMAGE
+        | FPDF_RENDER_NO_SMOOTHPATH;
+    case RenderTier::Balanced:
+      return FPDF_RENDER_LIMITEDIMAGECACHE;
+    case RenderTier::Best:
+      // Annotations (highlights, stamps, form fields) are part of what the
+      // user sees in a PDF viewer.
+      return FPDF_RENDER_LIMITEDIMAGECACHE | FPDF_ANNOT;
+  }
+  return 0;
+}
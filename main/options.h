@@ -0,0 +1,134 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+/**
+ * The most extra thumbnail sizes a job may ask for. We encode each as a task
+ * on the worker pool, alongside the main thumbnail.
+ */
+static const size_t MaxExtraThumbnailSizes = 4;
+
+/**
+ * The most pages a thumbnail sprite may tile. 256 tiles of 128px make a
+ * 2048x2048 image.
+ */
+static const int MaxThumbnailSpritePages = 256;
+
+/**
+ * Bounds for "thumbnailSize". We clamp values outside them.
+ *
+ * Render and deflate time grow with the square of the size: 350px costs about
+ * a quarter of 700px. Above 2000px, a "thumbnail" is a page image, and that
+ * isn't our job.
+ */
+static const int DefaultThumbnailSize = 700;
+static const int MinThumbnailSize = 16;
+static const int MaxThumbnailSize = 2000;
+
+/**
+ * Bounds for "pngCompressionLevel": zlib's levels.
+ *
+ * We default to the fastest. On our thumbnails, levels 1-3 deflate in well
+ * under half the time of zlib's default (6), for files 30-100% bigger; level
+ * 9 takes five times as long as 6 and saves little.
+ */
+static const int DefaultPngCompressionLevel = 1;
+static const int MinPngCompressionLevel = 1;
+static const int MaxPngCompressionLevel = 9;
+
+/**
+ * How much effort to spend rendering each thumbnail.
+ *
+ * Each tier maps to a set of PDFium render flags. See renderFlagsForTier().
+ */
+enum class RenderTier {
+  Fast, // no anti-aliasing
+  Balanced, // anti-aliased, annotations hidden (the default)
+  Best // anti-aliased, annotations drawn
+};
+
+/**
+ * What to encode each page's main thumbnail as.
+ */
+enum class ThumbnailFormat {
+  Auto, // JPEG for pages that look like photos, else PNG (the default)
+  Png, // lossless: small and sharp for text and line art
+  Jpeg // lossy: for photos and scans, several times smaller and faster
+};
+
+/**
+ * Per-job settings.
+ *
+ * Overview may set these in the step's input JSON.
+ * do-convert-stream-to-mime-multipart picks them out and passes them to us as
+ * a JSON object, OPTIONS-JSON. Missing or null values mean, "use the default."
+ */
+struct Options {
+  /** "thumbnailQuality": "fast", "balanced" or "best". */
+  RenderTier renderTier = RenderTier::Balanced;
+
+  /**
+   * "thumbnailSize": longest side, in pixels, of the main thumbnail.
+   */
+  int thumbnailSize = DefaultThumbnailSize;
+
+  /**
+   * "extraThumbnailSizes": longest side, in pixels, of each smaller thumbnail
+   * to output alongside the main one. (Each is a downscaled copy of the main
+   * thumbnail: we only render once.)
+   *
+   * Each size is an integer from 1 to thumbnailSize - 1, and no two are the
+   * same: a size names its fragment. We reject any other value.
+   */
+  std::vector<int> extraThumbnailSizes;
+
+  /**
+   * "thumbnailSpritePages": in extract mode, tile small thumbnails of this
+   * many pages (from the first) into one sprite image. 0 means no sprite.
+   */
+  int thumbnailSpritePages = 0;
+
+  /**
+   * "pngCompressionLevel": zlib level for every PNG we encode, from 1
+   * (fastest) to 9 (smallest). It changes file size, never pixels.
+   */
+  int pngCompressionLevel = DefaultPngCompressionLevel;
+
+  /**
+   * "thumbnailFormat": "auto", "png" or "jpeg", for main thumbnails. A page
+   * that is nothing but a JPEG scan gets a JPEG either way; extra sizes and
+   * sprites are always PNGs.
+   */
+  ThumbnailFormat thumbnailFormat = ThumbnailFormat::Auto;
+};
+
+/**
+ * Parses OPTIONS-JSON.
+ *
+ * If the JSON is invalid or an option has an invalid value, outputs an "error"
+ * fragment and exits.
+ */
+Options
+parseOptionsOrOutputErrorAndExit(
+  const std::string& optionsJson,
+  const std::string& mimeBoundary
+);
+
+/**
+ * Returns the name of the given tier, as it appears in OPTIONS-JSON.
+ */
+const char*
+renderTierName(RenderTier tier);
+
+/**
+ * Returns the name of the given format, as it appears in OPTIONS-JSON.
+ */
+const char*
+thumbnailFormatName(ThumbnailFormat format);
+
+/**
+ * Returns FPDF_RenderPageBitmap() flags for the given tier.
+ */
+int
+renderFlagsForTier(RenderTier tier);
@@ -0,0 +1,134 @@
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+#include "public/cpp/fpdf_deleters.h"
+#include "public/fpdf_ppo.h"
+#include "public/fpdf_save.h"
+
+#include "page-fingerprint.h"
+#include "sha256.h"
+#include "util.h"
+
+/**
+ * A value PDFium changes from one save to the next: the bytes after `key`, up
+ * to `terminator`.
+ */
+struct VolatileValue {
+  std::string key;
+  uint8_t terminator;
+};
+static const VolatileValue VolatileValues[] = {
+  { "/CreationDate(", ')' },
+  { "/ID[", ']' },
+};
+static const size_t MaxKeySize = 14; // "/CreationDate("
+
+/**
+ * Hashes a PDF as it streams past, skipping the values PDFium changes from
+ * one save to the next.
+ *
+ * A volatile value's key can straddle two writes, so we hold back the last
+ * few bytes of each write until we know they don't start one.
+ */
+class PageFingerprinter {
+public:
+  PageFingerprinter() : skipping(nullptr) {}
+
+  void update(const uint8_t* bytes, size_t nBytes) {
+    pending.insert(pending.end(), bytes, bytes + nBytes);
+
+    const uint8_t* p = pending.data();
+    const uint8_t* const end = p + pending.size();
+    while (p < end) {
+      if (skipping) {
+        // Skip up to the terminator; we hash that.
+        const uint8_t* terminator = std::find(p, end, skipping->terminator);
+        if (terminator == end) {
+          p = end;
+          break;
+        }
+        p = terminator;
+        skipping = nullptr;
+        continue;
+      }
+
+      // Hash up to and including the next volatile value's key...
+      const VolatileValue* next = nullptr;
+      const uint8_t* nextKey = end;
+      for (const auto& value : VolatileValues) {
+        const uint8_t* key = std::search(p, end, value.key.begin(), value.key.end());
+        if (key < nextKey) {
+          nextKey = key;
+          next = &value;
+        }
+      }
+      if (next) {
+        const uint8_t* keyEnd = nextKey + next->key.size();
+        sha.update(p, keyEnd - p);
+        p = keyEnd;
+        skipping = next;
+        continue;
+      }
+
+      // ... or, with no whole key, up to where part of one might start.
+      const uint8_t* held = std::max(p, end - (MaxKeySize - 1));
+      sha.update(p, held - p);
+      p = held;
+      break;
+    }
+
+    pending.erase(pending.begin(), pending.begin() + (p - pending.data()));
+  }
+
+  std::string hexDigest() {
+    if (!skipping) sha.update(pending.data(), pending.size());
+    return sha.hexDigest();
+  }
+
+private:
+  Sha256 sha;
+  std::vector<uint8_t> pending;
+  const VolatileValue* skipping;
+};
+
+class FingerprintingWrite : public FPDF_FILEWRITE {
+public:
+  FingerprintingWrite(const PageBlobSink& sink) : sink(sink) {
+    FPDF_FILEWRITE::version = 1;
+    FPDF_FILEWRITE::WriteBlock = WriteBlockCallback;
+  }
+
+  static int WriteBlockCallback(FPDF_FILEWRITE* pFileWrite, const void* data, unsigned long size) {
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data);
+    FingerprintingWrite* write = static_cast<FingerprintingWrite*>(pFileWrite);
+    write->fingerprinter.update(bytes, size);
+    write->sink(bytes, size);
+    return size; // non-zero
+  }
+
+  PageFingerprinter fingerprinter;
+
+private:
+  const PageBlobSink& sink;
+};
+
+std::string
+writePageBlobOrOutputErrorAndExit(
+    FPDF_DOCUMENT fDocument,
+    int pageIndex,
+    const PageBlobSink& sink,
+    const std::string& mimeBoundary
+)
+{
+  std::unique_ptr<void, FPDFDocumentDeleter> outDocument(FPDF_CreateNewDocument());
+  std::string pageIndexString = std::to_string(pageIndex + 1);
+  if (!FPDF_ImportPages(outDocument.get(), fDocument, pageIndexString.c_str(), 0)) {
+    outputErrorAndExit(std::string("Error outputting page with index ") + std::to_string(pageIndex) + ": " + formatLastPdfiumError(), mimeBoundary);
+    return std::string();
+  }
+
+  FingerprintingWrite write(sink);
+  FPDF_SaveAsCopy(outDocument.get(), &write, FPDF_REMOVE_SECURITY);
+  return write.fingerprinter.hexDigest();
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include "public/fpdfview.h"
+
+/** Where writePageBlobOrOutputErrorAndExit() hands the PDF's bytes. */
+typedef std::function<void(const uint8_t* bytes, size_t nBytes)> PageBlobSink;
+
+/**
+ * Writes the page as an entire PDF, handing its bytes to `sink` as PDFium
+ * saves them, and returns the PDF's fingerprint.
+ *
+ * The fingerprint is the SHA-256 of the PDF's bytes, skipping the values
+ * PDFium changes from one save to the next (the /CreationDate string and the
+ * trailer's /ID array). We hash as PDFium writes: fingerprinting a page holds
+ * none of it in memory.
+ *
+ * The PDF holds the page's dimensions, content streams and every resource
+ * they use, renumbered from 1. So two pages with the same fingerprint render
+ * the same -- even pages from different documents.
+ *
+ * If PDFium can't import the page, outputs an "error" fragment and exits.
+ */
+std::string
+writePageBlobOrOutputErrorAndExit(
+  FPDF_DOCUMENT fDocument,
+  int pageIndex,
+  const PageBlobSink& sink,
+  const std::string& mimeBoundary
+);
@@ -0,0 +1,239 @@
+#include <cmath>
+#include <cstring>
+
+#include "public/fpdf_annot.h"
+#include "public/fpdf_edit.h"
+#include "public/fpdf_transformpage.h"
+#include "public/fpdfview.h"
+
+#include "page-objects.h"
+
+static bool
+isGray(unsigned int r, unsigned int g, unsigned int b)
+{
+  return r == g && g == b;
+}
+
+static bool
+fillColorIsGray(FPDF_PAGEOBJECT object)
+{
+  unsigned int r, g, b, a;
+  return FPDFPageObj_GetFillColor(object, &r, &g, &b, &a) && isGray(r, g, b);
+}
+
+static bool
+strokeColorIsGray(FPDF_PAGEOBJECT object)
+{
+  unsigned int r, g, b, a;
+  return FPDFPageObj_GetStrokeColor(object, &r, &g, &b, &a) && isGray(r, g, b);
+}
+
+static bool
+isWhite(unsigned int r, unsigned int g, unsigned int b)
+{
+  return r == 255 && g == 255 && b == 255;
+}
+
+/**
+ * Returns true if the path can only paint white.
+ */
+static bool
+pathIsWhite(FPDF_PAGEOBJECT object)
+{
+  // A blend mode like "Difference" paints white-on-white black.
+  if (FPDFPageObj_HasTransparency(object)) return false;
+
+  int fillMode;
+  FPDF_BOOL stroke;
+  if (!FPDFPath_GetDrawMode(object, &fillMode, &stroke)) return false;
+
+  unsigned int r, g, b, a;
+  if (fillMode != FPDF_FILLMODE_NONE) {
+    if (!FPDFPageObj_GetFillColor(object, &r, &g, &b, &a) || !isWhite(r, g, b)) return false;
+  }
+  if (stroke) {
+    if (!FPDFPageObj_GetStrokeColor(object, &r, &g, &b, &a) || !isWhite(r, g, b)) return false;
+  }
+  return true;
+}
+
+static bool
+imageIsGray(FPDF_PAGEOBJECT object, FPDF_PAGE page)
+{
+  FPDF_IMAGEOBJ_METADATA metadata;
+  if (!FPDFImageObj_GetImageMetadata(object, page, &metadata)) return false;
+
+  switch (metadata.colorspace) {
+    case FPDF_COLORSPACE_DEVICEGRAY:
+    case FPDF_COLORSPACE_CALGRAY:
+      return true;
+    case FPDF_COLORSPACE_ICCBASED:
+      // A one-component ICC profile. (RGB and CMYK need more bits.)
+      return metadata.bits_per_pixel <= 8 && metadata.bits_per_pixel > 0;
+    case FPDF_COLORSPACE_UNKNOWN:
+      // A stencil mask has no color space: it's painted in the fill color.
+      return metadata.bits_per_pixel == 1 && fillColorIsGray(object);
+    default:
+      return false;
+  }
+}
+
+bool
+pageIsGrayscale(FPDF_PAGE page, int renderFlags)
+{
+  if ((renderFlags & FPDF_ANNOT) && FPDFPage_GetAnnotCount(page) > 0) return false;
+
+  const int nObjects = FPDFPage_CountObjects(page);
+  for (int i = 0; i < nObjects; i++) {
+    FPDF_PAGEOBJECT object = FPDFPage_GetObject(page, i);
+    switch (FPDFPageObj_GetType(object)) {
+      case FPDF_PAGEOBJ_TEXT:
+      case FPDF_PAGEOBJ_PATH:
+        if (!fillColorIsGray(object) || !strokeColorIsGray(object)) return false;
+        break;
+      case FPDF_PAGEOBJ_IMAGE:
+        if (!imageIsGray(object, page)) return false;
+        break;
+      default:
+        return false; // shading, form XObject: we can't tell
+    }
+  }
+
+  return true;
+}
+
+bool
+pageIsBlank(FPDF_PAGE page, int renderFlags)
+{
+  if ((renderFlags & FPDF_ANNOT) && FPDFPage_GetAnnotCount(page) > 0) return false;
+
+  const int nObjects = FPDFPage_CountObjects(page);
+  for (int i = 0; i < nObjects; i++) {
+    FPDF_PAGEOBJECT object = FPDFPage_GetObject(page, i);
+    if (FPDFPageObj_GetType(object) != FPDF_PAGEOBJ_PATH || !pathIsWhite(object)) return false;
+  }
+
+  return true;
+}
+
+static bool
+nearlyEqual(float a, float b, float tolerance)
+{
+  return std::fabs(a - b) <= tolerance;
+}
+
+/**
+ * Returns true if FPDFImageObj_GetBitmap() will give one 8-bit gray channel
+ * or 8-bit RGB channels -- pixels we can shrink without a palette.
+ */
+static bool
+imageHasTrueColorPixels(const FPDF_IMAGEOBJ_METADATA& metadata)
+{
+  switch (metadata.colorspace) {
+    case FPDF_COLORSPACE_DEVICEGRAY:
+    case FPDF_COLORSPACE_CALGRAY:
+    case FPDF_COLORSPACE_DEVICERGB:
+    case FPDF_COLORSPACE_CALRGB:
+    case FPDF_COLORSPACE_DEVICECMYK:
+    case FPDF_COLORSPACE_ICCBASED:
+      return metadata.bits_per_pixel >= 8 && metadata.bits_per_pixel % 8 == 0;
+    default:
+      return false; // indexed, separation, stencil mask, ...
+  }
+}
+
+/**
+ * Finds the visible part of the page: the crop box, which defaults to the
+ * media box, which defaults to [0 0 width height].
+ */
+static void
+getVisibleBox(FPDF_PAGE page, float* left, float* bottom, float* right, float* top)
+{
+  if (!FPDFPage_GetCropBox(page, left, bottom, right, top)
+      && !FPDFPage_GetMediaBox(page, left, bottom, right, top)) {
+    *left = *bottom = 0;
+    *right = static_cast<float>(FPDF_GetPageWidth(page));
+    *top = static_cast<float>(FPDF_GetPageHeight(page));
+  }
+}
+
+FPDF_PAGEOBJECT
+pageScannedImage(FPDF_PAGE page, int renderFlags)
+{
+  if ((renderFlags & FPDF_ANNOT) && FPDFPage_GetAnnotCount(page) > 0) return nullptr;
+  if (FPDFPage_GetRotation(page) != 0) return nullptr;
+  if (FPDFPage_CountObjects(page) != 1) return nullptr;
+
+  FPDF_PAGEOBJECT object = FPDFPage_GetObject(page, 0);
+  if (FPDFPageObj_GetType(object) != FPDF_PAGEOBJ_IMAGE) return nullptr;
+  if (FPDFPageObj_HasTransparency(object)) return nullptr; // soft mask, blend mode
+
+  FPDF_IMAGEOBJ_METADATA metadata;
+  if (!FPDFImageObj_GetImageMetadata(object, page, &metadata)) return nullptr;
+  if (!imageHasTrueColorPixels(metadata) || metadata.width == 0 || metadata.height == 0) return nullptr;
+
+  float pageLeft, pageBottom, pageRight, pageTop;
+  getVisibleBox(page, &pageLeft, &pageBottom, &pageRight, &pageTop);
+
+  float left, bottom, right, top;
+  if (!FPDFPageObj_GetBounds(object, &left, &bottom, &right, &top)) return nullptr;
+
+  // Scanners place images to within a point or so.
+  const float tolerance = 2.0f;
+  if (!nearlyEqual(left, pageLeft, tolerance)
+      || !nearlyEqual(bottom, pageBottom, tolerance)
+      || !nearlyEqual(right, pageRight, tolerance)
+      || !nearlyEqual(top, pageTop, tolerance)) {
+    return nullptr;
+  }
+
+  // The image must be upright: no rotation, skew or flip. (Its bounds can't
+  // tell us, and a scan of a page upside-down would shrink upside-down.)
+  double a, b, c, d, e, f;
+  if (!FPDFImageObj_GetMatrix(object, &a, &b, &c, &d, &e, &f)) return nullptr;
+  if (a <= 0 || d <= 0 || b != 0 || c != 0) return nullptr;
+
+  return object;
+}
+
+bool
+imageIsJpeg(FPDF_PAGEOBJECT image)
+{
+  if (FPDFImageObj_GetImageFilterCount(image) != 1) return false;
+
+  char filter[16];
+  const unsigned long length = FPDFImageObj_GetImageFilter(image, 0, filter, sizeof(filter));
+  if (length == 0 || length > sizeof(filter)) return false;
+
+  // "DCT" is the abbreviation used in inline images.
+  return std::strcmp(filter, "DCTDecode") == 0 || std::strcmp(filter, "DCT") == 0;
+}
+
+double
+pageImageCoverage(FPDF_PAGE page)
+{
+  float pageLeft, pageBottom, pageRight, pageTop;
+  getVisibleBox(page, &pageLeft, &pageBottom, &pageRight, &pageTop);
+  const double pageArea = 1.0 * (pageRight - pageLeft) * (pageTop - pageBottom);
+  if (pageArea <= 0) return 0.0;
+
+  double imageArea = 0.0;
+  const int nObjects = FPDFPage_CountObjects(page);
+  for (int i = 0; i < nObjects; i++) {
+    FPDF_PAGEOBJECT object = FPDFPage_GetObject(page, i);
+    if (FPDFPageObj_GetType(object) != FPDF_PAGEOBJ_IMAGE) continue;
+
+    // Line art, logos and scanned text come as 1-bit or palette images: they
+    // don't make a page a photo.
+    FPDF_IMAGEOBJ_METADATA metadata;
+    if (!FPDFImageObj_GetImageMetadata(object, page, &metadata) || !imageHasTrueColorPixels(metadata)) continue;
+
+    float left, bottom, right, top;
+    if (!FPDFPageObj_GetBounds(object, &left, &bottom, &right, &top)) continue;
+    const float width = std::fmin(right, pageRight) - std::fmax(left, pageLeft);
+    const float height = std::fmin(top, pageTop) - std::fmax(bottom, pageBottom);
+    if (width > 0 && height > 0) imageArea += 1.0 * width * height;
+  }
+
+  return std::fmin(1.0, imageArea / pageArea);
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "public/fpdfview.h"
+
+/**
+ * Inspections of a page's objects that let us skip work before rendering.
+ *
+ * These only look at a page's top-level objects. Whenever an object could be
+ * something we don't understand (a form XObject, a shading, ...), they err on
+ * the side of "we can't skip anything."
+ */
+
+/**
+ * Returns true if the page is certain to render without color.
+ *
+ * That is: every text and path object's fill and stroke colors are gray, and
+ * every image is in a gray color space (or is a stencil mask painted in a gray
+ * color). `renderFlags` matters because FPDF_ANNOT draws annotations, which
+ * may be colorful.
+ */
+bool
+pageIsGrayscale(FPDF_PAGE page, int renderFlags);
+
+/**
+ * Returns true if the page is certain to render as nothing but white.
+ *
+ * That is: it has no objects, or its only objects are opaque paths that are
+ * unfilled, unstroked or white. (Office programs and scanners love to paint a
+ * white rectangle over a blank page.)
+ */
+bool
+pageIsBlank(FPDF_PAGE page, int renderFlags);
+
+/**
+ * Returns the page's image, if the page is a scan; otherwise nullptr.
+ *
+ * A scan is a page whose only object is an opaque image that covers the page,
+ * upright. Its thumbnail is the image, shrunk: no need to render.
+ *
+ * We only accept images that FPDFImageObj_GetBitmap() returns as true-color
+ * or 8-bit gray pixels: no palettes, no 1-bit images. And we only accept an
+ * image whose matrix scales it without rotating, skewing or flipping it:
+ * FPDFImageObj_GetBitmap() returns pixels as stored, not as drawn.
+ */
+FPDF_PAGEOBJECT
+pageScannedImage(FPDF_PAGE page, int renderFlags);
+
+/**
+ * Returns true if the image's data is a plain JPEG file: its only filter is
+ * DCTDecode.
+ */
+bool
+imageIsJpeg(FPDF_PAGEOBJECT image);
+
+/**
+ * Returns the fraction of the page, from 0 to 1, that continuous-tone images
+ * cover: 8-bit-or-more gray, RGB or CMYK, with no palette.
+ *
+ * We add up each such top-level image's bounding box, clipped to the page,
+ * and cap the sum at 1: overlapping images count twice. 1-bit and palette
+ * images (line art, logos, most scanned text) don't count, nor do images
+ * inside form XObjects.
+ */
+double
+pageImageCoverage(FPDF_PAGE page);
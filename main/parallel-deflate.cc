@@ -0,0 +1,264 @@
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <vector>
+#include <zlib.h>
+
+#include "lodepng.h"
+
+#include "parallel-deflate.h"
+#include "worker-pool.h"
+
+// Each task compresses this many input bytes at a time. Smaller chunks mean
+// more parallelism; larger chunks mean better compression. (pigz uses 128kb.)
+static const size_t ChunkSize = 128 * 1024;
+// Deflate can refer back this many bytes. We prime each chunk with the bytes
+// that precede it, so matches can cross chunk boundaries.
+static const size_t DictionarySize = 32 * 1024;
+static const unsigned LodepngAllocError = 83;
+static const unsigned ZlibError = 1000; // lodepng doesn't use this code
+
+/**
+ * A raw-deflate z_stream that we reset and reuse, instead of allocating zlib's
+ * ~256kb of state for every chunk.
+ */
+class DeflateScratch::Stream {
+public:
+  Stream(int level) : level(level) {
+    std::memset(&stream, 0, sizeof(stream));
+    initialized = deflateInit2(&stream, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+  }
+
+  ~Stream() {
+    if (initialized) deflateEnd(&stream);
+  }
+
+  // zlib's state points back to its z_stream: never copy or move one.
+  Stream(const Stream&) = delete;
+  Stream& operator=(const Stream&) = delete;
+
+  bool ok() const { return initialized; }
+
+  /**
+   * Returns the stream, ready to compress new data at `newLevel`, or nullptr.
+   */
+  z_stream* reset(int newLevel) {
+    if (!initialized || deflateReset(&stream) != Z_OK) return nullptr;
+    if (newLevel != level) {
+      // Nothing is pending after a reset, so this only changes settings.
+      if (deflateParams(&stream, newLevel, Z_DEFAULT_STRATEGY) != Z_OK) return nullptr;
+      level = newLevel;
+    }
+    return &stream;
+  }
+
+private:
+  z_stream stream;
+  int level;
+  bool initialized;
+};
+
+struct DeflateScratch::Chunk {
+  const uint8_t* data;
+  size_t size;
+  std::vector<uint8_t> deflated;
+  uLong adler;
+  bool ok;
+
+  /**
+   * Deflates the chunk as raw deflate data, ending on a byte boundary.
+   * `input` is where the bytes before it start: we prime the stream with up
+   * to DictionarySize of them.
+   *
+   * The last chunk ends with a final block; the others end with an empty
+   * stored block (Z_SYNC_FLUSH), so the next chunk's output can follow it.
+   */
+  void deflate(const uint8_t* input, bool isLast, int level, Stream& deflateStream) {
+    ok = false;
+    adler = adler32(adler32(0, Z_NULL, 0), data, size);
+
+    z_stream* streamPtr = deflateStream.reset(level);
+    if (!streamPtr) return;
+    z_stream& stream = *streamPtr;
+
+    if (data > input) {
+      const size_t dictionaryLength = std::min(DictionarySize, static_cast<size_t>(data - input));
+      if (deflateSetDictionary(&stream, data - dictionaryLength, dictionaryLength) != Z_OK) {
+        return;
+      }
+    }
+
+    // deflateBound() assumes Z_FINISH; a sync flush adds at most 5 bytes
+    // more. If that's ever wrong, we grow the buffer and keep going.
+    const int flush = isLast ? Z_FINISH : Z_SYNC_FLUSH;
+    size_t nWritten = 0;
+    deflated.resize(deflateBound(&stream, size) + 5);
+    stream.next_in = const_cast<Bytef*>(data);
+    stream.avail_in = size;
+
+    while (true) {
+      stream.next_out = deflated.data() + nWritten;
+      stream.avail_out = deflated.size() - nWritten;
+      const int err = ::deflate(&stream, flush);
+      nWritten = deflated.size() - stream.avail_out;
+
+      if (err == Z_STREAM_END || (err == Z_OK && flush == Z_SYNC_FLUSH && stream.avail_out > 0)) {
+        ok = true;
+        break;
+      }
+      if (err != Z_OK && err != Z_BUF_ERROR) break;
+      deflated.resize(deflated.size() * 2);
+    }
+
+    deflated.resize(nWritten);
+  }
+};
+
+/**
+ * Returns the zlib header's FLEVEL bits for a zlib compression level.
+ */
+static unsigned char
+zlibFlevel(int level)
+{
+  if (level == Z_DEFAULT_COMPRESSION) level = 6;
+  if (level < 2) return 0;
+  if (level < 6) return 1;
+  if (level == 6) return 2;
+  return 3;
+}
+
+DeflateScratch::DeflateScratch()
+{
+}
+
+DeflateScratch::~DeflateScratch()
+{
+}
+
+ParallelDeflater::ParallelDeflater(int level, const Sink& sink, size_t nThreads, DeflateScratch* scratch)
+  : level(level),
+    nThreads(nThreads ? nThreads : workerPool().nThreads()),
+    sink(sink),
+    ownScratch(scratch ? nullptr : new DeflateScratch()),
+    scratch(scratch ? *scratch : *ownScratch),
+    input(this->scratch.input),
+    isOk(true),
+    wroteHeader(false),
+    dictionaryBytes(0),
+    adler(adler32(0, Z_NULL, 0))
+{
+  input.clear();
+  input.reserve(DictionarySize + this->nThreads * ChunkSize);
+  while (this->scratch.chunks.size() < this->nThreads) {
+    this->scratch.chunks.emplace_back(new DeflateScratch::Chunk());
+    this->scratch.streams.emplace_back(new DeflateScratch::Stream(level));
+  }
+  for (size_t i = 0; i < this->nThreads; i++) {
+    isOk = isOk && this->scratch.streams[i]->ok();
+  }
+}
+
+ParallelDeflater::~ParallelDeflater()
+{
+}
+
+bool
+ParallelDeflater::write(const uint8_t* bytes, size_t nBytes)
+{
+  const size_t batchBytes = nThreads * ChunkSize;
+  while (isOk && nBytes > 0) {
+    const size_t n = std::min(nBytes, dictionaryBytes + batchBytes - input.size());
+    input.insert(input.end(), bytes, bytes + n);
+    bytes += n;
+    nBytes -= n;
+
+    // Only deflate a full batch once more input follows it: the stream's last
+    // chunk must end with a final block.
+    if (nBytes > 0 && !deflateChunks(batchBytes, false)) isOk = false;
+  }
+  return isOk;
+}
+
+bool
+ParallelDeflater::finish()
+{
+  if (!isOk || !deflateChunks(input.size() - dictionaryBytes, true)) return isOk = false;
+
+  const uint8_t trailer[4] = {
+    static_cast<uint8_t>(adler >> 24),
+    static_cast<uint8_t>(adler >> 16),
+    static_cast<uint8_t>(adler >> 8),
+    static_cast<uint8_t>(adler)
+  };
+  sink(trailer, sizeof(trailer));
+  return true;
+}
+
+/**
+ * Deflates the `nBytes` after the dictionary, in chunks on the pool, and hands
+ * them to the sink. Then keeps the last DictionarySize bytes as the next
+ * dictionary.
+ */
+bool
+ParallelDeflater::deflateChunks(size_t nBytes, bool isLast)
+{
+  const uint8_t* start = input.data() + dictionaryBytes;
+  const size_t nChunks = std::max(static_cast<size_t>(1), (nBytes + ChunkSize - 1) / ChunkSize);
+  const auto& chunks = scratch.chunks;
+  for (size_t i = 0; i < nChunks; i++) {
+    chunks[i]->data = start + i * ChunkSize;
+    chunks[i]->size = std::min(ChunkSize, nBytes - i * ChunkSize);
+  }
+
+  workerPool().run(nChunks, [&](size_t i) {
+    chunks[i]->deflate(input.data(), isLast && i == nChunks - 1, level, *scratch.streams[i]);
+  });
+
+  for (size_t i = 0; i < nChunks; i++) {
+    if (!chunks[i]->ok) return false;
+  }
+
+  if (!wroteHeader) {
+    // zlib stream: 2-byte header, deflate data, 4-byte big-endian Adler-32
+    const uint8_t cmf = 0x78; // deflate, 32kb window
+    unsigned flg = zlibFlevel(level) << 6;
+    flg += 31 - (cmf * 256 + flg) % 31;
+    const uint8_t header[2] = { cmf, static_cast<uint8_t>(flg) };
+    sink(header, sizeof(header));
+    wroteHeader = true;
+  }
+  for (size_t i = 0; i < nChunks; i++) {
+    const DeflateScratch::Chunk& chunk(*chunks[i]);
+    if (!chunk.deflated.empty()) sink(chunk.deflated.data(), chunk.deflated.size());
+    adler = adler32_combine(adler, chunk.adler, chunk.size);
+  }
+
+  const size_t keep = std::min(DictionarySize, dictionaryBytes + nBytes);
+  input.erase(input.begin(), input.begin() + (dictionaryBytes + nBytes - keep));
+  dictionaryBytes = keep;
+  return true;
+}
+
+unsigned
+parallelZlibCompress(unsigned char** out, size_t* outsize, const unsigned char* in, size_t insize, const LodePNGCompressSettings* settings)
+{
+  const DeflateSettings* deflateSettings = static_cast<const DeflateSettings*>(settings->custom_context);
+  const int level = deflateSettings ? deflateSettings->level : Z_DEFAULT_COMPRESSION;
+
+  std::vector<uint8_t> zlib;
+  ParallelDeflater deflater(level, [&zlib](const uint8_t* bytes, size_t nBytes) {
+    zlib.insert(zlib.end(), bytes, bytes + nBytes);
+  });
+  if (!deflater.write(in, insize) || !deflater.finish()) return ZlibError;
+
+  // lodepng will free() it
+  *outsize = zlib.size();
+  *out = static_cast<unsigned char*>(std::malloc(*outsize));
+  if (!*out) {
+    *outsize = 0;
+    return LodepngAllocError;
+  }
+  std::memcpy(*out, zlib.data(), zlib.size());
+  return 0;
+}
@@ -0,0 +1,144 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "lodepng.h"
+
+/**
+ * Settings for parallelZlibCompress(). Point
+ * LodePNGCompressSettings.custom_context at one.
+ */
+struct DeflateSettings {
+  /** zlib compression level, 1 (fastest) to 9 (smallest). */
+  int level;
+};
+
+/**
+ * A ParallelDeflater's buffers and zlib state, kept from one image to the
+ * next.
+ *
+ * Each of a ParallelDeflater's chunks needs ~256kb of zlib state and an output
+ * buffer, and the deflater buffers a batch of input. Allocating those for every
+ * thumbnail costs more than deflating a small one. So whoever encodes image
+ * after image (RenderArena) keeps a DeflateScratch and lends it to each
+ * deflater in turn. The deflater resets the zlib streams (and changes their
+ * level if need be) instead of reallocating them.
+ *
+ * Only one ParallelDeflater may use a DeflateScratch at a time.
+ */
+class DeflateScratch {
+public:
+  DeflateScratch();
+  ~DeflateScratch();
+
+  DeflateScratch(const DeflateScratch&) = delete;
+  DeflateScratch& operator=(const DeflateScratch&) = delete;
+
+private:
+  friend class ParallelDeflater;
+  struct Chunk;
+  class Stream;
+
+  std::vector<uint8_t> input; // dictionary bytes, then input we haven't deflated
+  std::vector<std::unique_ptr<Chunk>> chunks; // one per chunk of a batch
+  std::vector<std::unique_ptr<Stream>> streams; // one per chunk of a batch
+};
+
+/**
+ * Compresses bytes into a zlib stream as they come, using several threads,
+ * and hands the stream to a sink a batch at a time.
+ *
+ * Like pigz, we split the input into fixed-size chunks and deflate each chunk
+ * as a task on workerPool(). Each chunk is primed with the 32kb of input that precede
+ * it, so compression ratio barely suffers. Chunks end on a byte boundary
+ * (Z_SYNC_FLUSH), so we can concatenate them. We combine the chunks' Adler-32
+ * checksums into the checksum of the whole input.
+ *
+ * We hold `nThreads` chunks, plus the 32kb before them: once write() has
+ * more than that, we deflate those chunks and hand their output to the sink.
+ * So memory doesn't grow with the input, and output starts before the input
+ * ends.
+ *
+ * Chunk boundaries only depend on the input, so output only depends on input
+ * and level (not on the number of threads, or on how the caller splits its
+ * writes): it is deterministic.
+ *
+ * Usage:
+ *
+ *     ParallelDeflater deflater(level, sink);
+ *     if (!deflater.ok()) ... // zlib couldn't allocate; the sink has nothing
+ *     for (each piece) deflater.write(bytes, nBytes);
+ *     deflater.finish(); // sink gets the rest
+ */
+class ParallelDeflater {
+public:
+  typedef std::function<void(const uint8_t* bytes, size_t nBytes)> Sink;
+
+  /**
+   * Prepares to deflate at zlib `level` (1-9, or Z_DEFAULT_COMPRESSION),
+   * `nThreads` chunks at a time on workerPool() -- by default, one per
+   * thread. Allocates all of zlib's state now, so ok() tells whether
+   * deflating can fail.
+   *
+   * With `scratch`, reuses its buffers and zlib streams (growing them if need
+   * be) and leaves them there for the next deflater; `scratch` must outlive
+   * this. Without, allocates our own.
+   */
+  ParallelDeflater(int level, const Sink& sink, size_t nThreads = 0, DeflateScratch* scratch = nullptr);
+  ~ParallelDeflater();
+
+  ParallelDeflater(const ParallelDeflater&) = delete;
+  ParallelDeflater& operator=(const ParallelDeflater&) = delete;
+
+  bool ok() const { return isOk; }
+
+  /**
+   * Adds bytes to the stream, deflating whole batches of chunks.
+   */
+  bool write(const uint8_t* bytes, size_t nBytes);
+
+  /**
+   * Deflates what's left and hands the sink the end of the stream.
+   */
+  bool finish();
+
+private:
+  bool deflateChunks(size_t nBytes, bool isLast);
+
+  const int level;
+  const size_t nThreads;
+  Sink sink;
+  std::unique_ptr<DeflateScratch> ownScratch; // when the caller gave us none
+  DeflateScratch& scratch;
+  std::vector<uint8_t>& input; // dictionaryBytes of input we've deflated, then input we haven't
+  bool isOk;
+  bool wroteHeader;
+  size_t dictionaryBytes;
+  unsigned long adler;
+};
+
+/**
+ * Compresses `in` into a zlib stream with a ParallelDeflater.
+ *
+ * This has the signature of LodePNGCompressSettings.custom_zlib, so lodepng
+ * can use it to compress IDAT data. Output is the same as a ParallelDeflater
+ * given the same input and level.
+ *
+ * The level comes from `settings->custom_context`, a DeflateSettings; without
+ * one, we use zlib's default.
+ *
+ * On success, sets `*out` to a malloc()-allocated buffer (which lodepng will
+ * free) and returns 0. On failure, returns a non-zero lodepng error code.
+ */
+unsigned
+parallelZlibCompress(
+  unsigned char** out,
+  size_t* outsize,
+  const unsigned char* in,
+  size_t insize,
+  const LodePNGCompressSettings* settings
+);
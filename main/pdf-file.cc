@@ -0,0 +1,161 @@
+#include <algorithm>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "pdf-file.h"
+
+// How far before "stream" a dictionary may start.
+static const size_t MaxDictionaryBytes = 64 * 1024;
+
+static bool
+isPdfWhitespace(uint8_t c)
+{
+  return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\f' || c == '\0';
+}
+
+PdfFile::PdfFile()
+  : data(nullptr), nBytes(0), isIndexed(false)
+{
+}
+
+PdfFile::~PdfFile()
+{
+  unmap();
+}
+
+void
+PdfFile::unmap()
+{
+  if (data) munmap(const_cast<uint8_t*>(data), nBytes);
+  data = nullptr;
+  nBytes = 0;
+  isIndexed = false;
+  streamOffsets.clear();
+}
+
+void
+PdfFile::open(const char* filename, FPDF_DOCUMENT document)
+{
+  unmap();
+  if (FPDF_GetSecurityHandlerRevision(document) != -1) return; // encrypted
+
+  const int fd = ::open(filename, O_RDONLY);
+  if (fd == -1) return;
+
+  struct stat st;
+  if (fstat(fd, &st) == 0 && st.st_size > 0) {
+    void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p != MAP_FAILED) {
+      data = static_cast<const uint8_t*>(p);
+      nBytes = st.st_size;
+    }
+  }
+  close(fd);
+}
+
+/**
+ * Lists where each stream's data starts -- after "stream" and "\r\n" or
+ * "\n" -- and sorts those offsets by the bytes there.
+ */
+void
+PdfFile::indexStreams()
+{
+  isIndexed = true;
+
+  size_t pos = 0;
+  while (pos < nBytes) {
+    const void* found = memmem(data + pos, nBytes - pos, "stream", 6);
+    if (!found) break;
+    const size_t offset = static_cast<const uint8_t*>(found) - data;
+    pos = offset + 6;
+    if (offset >= 3 && std::memcmp(data + offset - 3, "end", 3) == 0) continue;
+
+    size_t start = pos;
+    if (start < nBytes && data[start] == '\r') start++;
+    if (start < nBytes && data[start] == '\n') streamOffsets.push_back(start + 1);
+  }
+
+  // Compare everything from each offset to the end of the file. Streams
+  // differ within a few hundred bytes (a scanner's JPEG tables), so
+  // comparisons end early.
+  const uint8_t* const bytes = data;
+  const size_t size = nBytes;
+  std::sort(streamOffsets.begin(), streamOffsets.end(), [bytes, size](size_t a, size_t b) {
+    const int order = std::memcmp(bytes + a, bytes + b, size - std::max(a, b));
+    return order != 0 ? order < 0 : a > b; // a prefix sorts first
+  });
+}
+
+bool
+PdfFile::findStreamDictionary(const uint8_t* stream, size_t nStreamBytes, std::string* dictionary)
+{
+  if (!data || nStreamBytes == 0 || nStreamBytes > nBytes) return false;
+  if (!isIndexed) indexStreams();
+
+  // Negative if the bytes at `offset` sort before `stream`; zero if they
+  // start with it.
+  const uint8_t* const bytes = data;
+  const size_t size = nBytes;
+  auto compare = [bytes, size, stream, nStreamBytes](size_t offset) {
+    const size_t n = std::min(nStreamBytes, size - offset);
+    const int order = std::memcmp(bytes + offset, stream, n);
+    return order != 0 ? order : (n < nStreamBytes ? -1 : 0);
+  };
+  const auto first = std::lower_bound(streamOffsets.begin(), streamOffsets.end(), 0, [&compare](size_t offset, int) {
+    return compare(offset) < 0;
+  });
+  const auto last = std::upper_bound(first, streamOffsets.end(), 0, [&compare](int, size_t offset) {
+    return compare(offset) > 0;
+  });
+  if (last - first != 1) return false; // no stream, or several, holds these bytes
+
+  return readDictionaryBefore(*first, dictionary);
+}
+
+bool
+PdfFile::readDictionaryBefore(size_t offset, std::string* dictionary) const
+{
+  // Stream data starts after "stream" and "\r\n" or "\n".
+  size_t pos = offset;
+  if (pos == 0 || data[pos - 1] != '\n') return false;
+  pos--;
+  if (pos > 0 && data[pos - 1] == '\r') pos--;
+  if (pos < 6 || std::memcmp(data + pos - 6, "stream", 6) != 0) return false;
+  pos -= 6;
+  while (pos > 0 && isPdfWhitespace(data[pos - 1])) pos--;
+
+  // Walk back to the "<<" that matches the ">>" before "stream". Dictionaries
+  // nest: "/DecodeParms << /ColorTransform 0 >>".
+  const size_t end = pos;
+  const size_t limit = end > MaxDictionaryBytes ? end - MaxDictionaryBytes : 0;
+  int depth = 0;
+  while (pos >= limit + 2) {
+    if (data[pos - 1] == '>' && data[pos - 2] == '>') {
+      depth++;
+      pos -= 2;
+    } else if (data[pos - 1] == '<' && data[pos - 2] == '<') {
+      depth--;
+      pos -= 2;
+      if (depth == 0) {
+        dictionary->assign(data + pos, data + end);
+        return true;
+      }
+      if (depth < 0) return false;
+    } else {
+      if (depth == 0) return false; // something other than ">>" before "stream"
+      pos--;
+    }
+  }
+  return false;
+}
+
+PdfFile&
+pdfFile()
+{
+  static PdfFile file;
+  return file;
+}
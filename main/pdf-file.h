@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "public/fpdfview.h"
+
+/**
+ * The PDF file this process converts, mapped read-only, for what PDFium's API
+ * won't tell us.
+ *
+ * That's an image's stream dictionary. PDFium applies an image's /Decode and
+ * /DecodeParms when it decodes the image, but can't show them to us -- and we
+ * need them before we decode a scanned JPEG ourselves.
+ *
+ * Not thread-safe.
+ */
+class PdfFile {
+public:
+  PdfFile();
+  ~PdfFile();
+  PdfFile(const PdfFile&) = delete;
+  PdfFile& operator=(const PdfFile&) = delete;
+
+  /**
+   * Maps `filename`, the file PDFium has open as `document`. If that fails,
+   * or the document is encrypted (its stream bytes on disk aren't the ones
+   * PDFium hands us), we find nothing.
+   */
+  void open(const char* filename, FPDF_DOCUMENT document);
+
+  /**
+   * Finds the stream whose data is `stream` -- as FPDFImageObj_GetImageDataRaw()
+   * returns it -- and sets `*dictionary` to its dictionary, "<<" to ">>".
+   *
+   * The first search lists every stream in the file and sorts them by their
+   * bytes: one pass over the file. After that, each search is a binary search.
+   *
+   * Returns false unless exactly one stream starts with these bytes. Two image
+   * objects may hold the same JPEG with different dictionaries (one with
+   * /Decode, one without), and we can't tell which one PDFium gave us.
+   */
+  bool findStreamDictionary(const uint8_t* stream, size_t nStreamBytes, std::string* dictionary);
+
+private:
+  void unmap();
+  void indexStreams();
+  bool readDictionaryBefore(size_t offset, std::string* dictionary) const;
+
+  const uint8_t* data;
+  size_t nBytes;
+  bool isIndexed;
+  std::vector<size_t> streamOffsets; // where each stream's data starts, sorted by the data
+};
+
+/**
+ * Returns this process's PdfFile.
+ */
+PdfFile&
+pdfFile();
@@ -0,0 +1,283 @@
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "pixel-analysis.h"
+
+struct RowScan {
+  bool hasInk; // some byte is not 0xff
+  size_t firstInk; // index of first non-0xff byte
+  size_t lastInk; // index of last non-0xff byte
+  bool isGray; // every pixel has R == G == B
+};
+
+typedef void (*RowScanner)(const uint8_t* row, size_t nBytes, int bytesPerPixel, RowScan* scan);
+
+static void
+noteInk(RowScan* scan, size_t first, size_t last)
+{
+  if (!scan->hasInk) {
+    scan->hasInk = true;
+    scan->firstInk = first;
+  }
+  scan->lastInk = last;
+}
+
+/**
+ * Scans bytes [begin, nBytes) of a row, one byte at a time.
+ *
+ * The gray check compares each R and G byte with the byte after it.
+ */
+static void
+scanRowScalar(const uint8_t* row, size_t begin, size_t nBytes, int bytesPerPixel, RowScan* scan)
+{
+  for (size_t i = begin; i < nBytes; i++) {
+    if (row[i] != 0xff) noteInk(scan, i, i);
+  }
+
+  if (bytesPerPixel == 3) {
+    for (size_t i = begin; i + 1 < nBytes; i++) {
+      if (i % 3 != 2 && row[i] != row[i + 1]) {
+        scan->isGray = false;
+        break;
+      }
+    }
+  }
+}
+
+#if defined(__x86_64__)
+
+/**
+ * GrayCheckMasks.bytes[phase][k] is 0xff if, in a vector that starts at a byte
+ * with index % 3 == phase, byte k is an R or G byte. Those are the bytes we
+ * compare with their successors.
+ */
+struct GrayCheckMasks {
+  uint8_t bytes[3][32];
+
+  GrayCheckMasks() {
+    for (int phase = 0; phase < 3; phase++) {
+      for (int k = 0; k < 32; k++) {
+        bytes[phase][k] = (phase + k) % 3 == 2 ? 0x00 : 0xff;
+      }
+    }
+  }
+};
+static const GrayCheckMasks grayCheckMasks;
+
+static void
+scanRowSse2(const uint8_t* row, size_t nBytes, int bytesPerPixel, RowScan* scan)
+{
+  const __m128i white = _mm_set1_epi8(-1);
+  __m128i notGray = _mm_setzero_si128();
+  int phase = 0;
+
+  // Stop one byte early: the gray check reads the byte after each vector.
+  size_t i = 0;
+  for (; i + 17 <= nBytes; i += 16) {
+    const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i));
+
+    const unsigned ink = _mm_movemask_epi8(_mm_cmpeq_epi8(v, white)) ^ 0xffff;
+    if (ink) noteInk(scan, i + __builtin_ctz(ink), i + 31 - __builtin_clz(ink));
+
+    if (bytesPerPixel == 3) {
+      const __m128i next = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i + 1));
+      const __m128i mask = _mm_loadu_si128(reinterpret_cast<const __m128i*>(grayCheckMasks.bytes[phase]));
+      notGray = _mm_or_si128(notGray, _mm_andnot_si128(_mm_cmpeq_epi8(v, next), mask));
+      phase = (phase + 16) % 3;
+    }
+  }
+
+  if (_mm_movemask_epi8(_mm_cmpeq_epi8(notGray, _mm_setzero_si128())) != 0xffff) {
+    scan->isGray = false;
+  }
+
+  scanRowScalar(row, i, nBytes, bytesPerPixel, scan);
+}
+
+__attribute__((target("avx2")))
+static void
+scanRowAvx2(const uint8_t* row, size_t nBytes, int bytesPerPixel, RowScan* scan)
+{
+  const __m256i white = _mm256_set1_epi8(-1);
+  __m256i notGray = _mm256_setzero_si256();
+  int phase = 0;
+
+  // Stop one byte early: the gray check reads the byte after each vector.
+  size_t i = 0;
+  for (; i + 33 <= nBytes; i += 32) {
+    const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row + i));
+
+    const unsigned ink = ~static_cast<unsigned>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, white)));
+    if (ink) noteInk(scan, i + __builtin_ctz(ink), i + 31 - __builtin_clz(ink));
+
+    if (bytesPerPixel == 3) {
+      const __m256i next = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row + i + 1));
+      const __m256i mask = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(grayCheckMasks.bytes[phase]));
+      notGray = _mm256_or_si256(notGray, _mm256_andnot_si256(_mm256_cmpeq_epi8(v, next), mask));
+      phase = (phase + 32) % 3;
+    }
+  }
+
+  if (!_mm256_testz_si256(notGray, notGray)) {
+    scan->isGray = false;
+  }
+
+  scanRowScalar(row, i, nBytes, bytesPerPixel, scan);
+}
+
+#else
+
+static void
+scanRowPortable(const uint8_t* row, size_t nBytes, int bytesPerPixel, RowScan* scan)
+{
+  scanRowScalar(row, 0, nBytes, bytesPerPixel, scan);
+}
+
+#endif /* __x86_64__ */
+
+static RowScanner
+chooseRowScanner()
+{
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) return scanRowAvx2;
+  return scanRowSse2; // every x86-64 CPU has SSE2
+#else
+  return scanRowPortable;
+#endif
+}
+
+/**
+ * Set of up to MaxCountedColors colors, with open addressing.
+ */
+class ColorSet {
+public:
+  ColorSet() : n(0) {
+    std::memset(slots, 0xff, sizeof(slots));
+  }
+
+  /**
+   * Adds a color. Returns false if the set was already full and the color is
+   * new -- that is, if there are more than MaxCountedColors colors.
+   */
+  bool add(uint32_t color) {
+    size_t slot = (color * 2654435761u) >> (32 - NSlotsLog2);
+    while (slots[slot] != Empty) {
+      if (slots[slot] == color) return true;
+      slot = (slot + 1) & (NSlots - 1);
+    }
+    if (n == MaxCountedColors) return false;
+    slots[slot] = color;
+    colors[n++] = color;
+    return true;
+  }
+
+  unsigned n;
+  uint32_t colors[MaxCountedColors];
+
+private:
+  static const int NSlotsLog2 = 10; // 4x MaxCountedColors: short probes
+  static const size_t NSlots = 1 << NSlotsLog2;
+  static const uint32_t Empty = 0xffffffff; // not a 0xRRGGBB value
+  uint32_t slots[NSlots];
+};
+
+/**
+ * Adds the colors of a row's pixels [first, last] to `colors`.
+ *
+ * Returns false if there are too many colors to count.
+ */
+static bool
+addRowColors(ColorSet& colors, const uint8_t* row, size_t first, size_t last, int bytesPerPixel)
+{
+  uint32_t previous = 0xffffffff;
+  for (size_t x = first; x <= last; x++) {
+    const uint8_t* p = row + x * bytesPerPixel;
+    const uint32_t color = bytesPerPixel == 3
+      ? (p[0] << 16) | (p[1] << 8) | p[2]
+      : p[0] * 0x010101u;
+    // Thumbnails are full of runs of one color: skip the hash lookup.
+    if (color == previous) continue;
+    if (!colors.add(color)) return false;
+    previous = color;
+  }
+  return true;
+}
+
+void
+analyzePixels(const uint8_t* pixels, size_t width, size_t height, int bytesPerPixel, PixelAnalysis* analysis)
+{
+  static const RowScanner scanRow = chooseRowScanner();
+
+  const size_t rowBytes = width * bytesPerPixel;
+  bool isBlank = true;
+  bool isGray = true;
+  bool countingColors = true;
+  ColorSet colors;
+
+  for (size_t y = 0; y < height; y++) {
+    const uint8_t* row = pixels + y * rowBytes;
+    RowScan scan = { false, 0, 0, true };
+    scanRow(row, rowBytes, bytesPerPixel, &scan);
+
+    isGray = isGray && scan.isGray;
+
+    size_t firstPixel = width;
+    size_t lastPixel = 0;
+    if (scan.hasInk) {
+      firstPixel = scan.firstInk / bytesPerPixel;
+      lastPixel = scan.lastInk / bytesPerPixel;
+      isBlank = false;
+    }
+
+    if (countingColors) {
+      // Everything outside [firstPixel, lastPixel] is white.
+      if (firstPixel > 0 || lastPixel + 1 < width) {
+        countingColors = colors.add(0xffffff);
+      }
+      if (countingColors && scan.hasInk) {
+        countingColors = addRowColors(colors, row, firstPixel, lastPixel, bytesPerPixel);
+      }
+    }
+  }
+
+  analysis->isBlank = isBlank;
+  analysis->isGray = isGray;
+  analysis->nColors = countingColors ? colors.n : MaxCountedColors + 1;
+  std::memcpy(analysis->colors, colors.colors, colors.n * sizeof(uint32_t));
+}
+
+// Neighbors differing by at least this much, in any channel, are "textured";
+// by EdgeStep, an edge. (Anti-aliased text steps by far more than EdgeStep.)
+static const int TextureStep = 4;
+static const int EdgeStep = 64;
+
+void
+analyzeEdges(const uint8_t* pixels, size_t width, size_t height, int bytesPerPixel, EdgeAnalysis* analysis)
+{
+  size_t nPairs = 0;
+  size_t nTextured = 0;
+  size_t nSharp = 0;
+
+  const size_t rowBytes = width * bytesPerPixel;
+  for (size_t y = 0; y < height; y += 2) {
+    const uint8_t* row = pixels + y * rowBytes;
+    for (size_t i = bytesPerPixel; i < rowBytes; i += bytesPerPixel) {
+      int difference = 0;
+      for (int c = 0; c < bytesPerPixel; c++) {
+        const int d = std::abs(row[i + c] - row[i + c - bytesPerPixel]);
+        if (d > difference) difference = d;
+      }
+      if (difference >= TextureStep) nTextured++;
+      if (difference >= EdgeStep) nSharp++;
+    }
+    nPairs += width - 1;
+  }
+
+  analysis->texturedShare = nPairs ? 1.0 * nTextured / nPairs : 0.0;
+  analysis->sharpShare = nTextured ? 1.0 * nSharp / nTextured : 0.0;
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * analyzePixels() counts up to this many distinct colors. That's as many as a
+ * PNG palette can hold.
+ */
+static const unsigned MaxCountedColors = 256;
+
+/**
+ * What a rendered thumbnail's pixels tell us about how to encode it.
+ *
+ * analyzePixels() computes all of this in one pass over the pixels, so each
+ * decision that depends on it (blank, gray, palette) costs nothing extra.
+ */
+struct PixelAnalysis {
+  /** Every pixel is white: we output the cached blank thumbnail. */
+  bool isBlank;
+
+  /** Every pixel has R == G == B. (Always true for 1-byte-per-pixel input.) */
+  bool isGray;
+
+  /**
+   * Number of distinct colors, or MaxCountedColors + 1 if there are more than
+   * MaxCountedColors. (We stop counting there: a palette can't hold more.)
+   */
+  unsigned nColors;
+
+  /**
+   * The distinct colors, as 0xRRGGBB, when nColors <= MaxCountedColors.
+   * Unordered.
+   */
+  uint32_t colors[MaxCountedColors];
+};
+
+/**
+ * Analyzes tightly-packed 8-bit gray (bytesPerPixel=1) or RGB
+ * (bytesPerPixel=3) pixels.
+ *
+ * Uses AVX2 or SSE2 (chosen at runtime) to scan each row for non-white and
+ * non-gray pixels, and counts colors while the row is still in cache.
+ */
+void
+analyzePixels(
+  const uint8_t* pixels,
+  size_t width,
+  size_t height,
+  int bytesPerPixel,
+  PixelAnalysis* analysis
+);
+
+/**
+ * How much neighboring pixels in a thumbnail differ, as a hint of whether it
+ * is a photo.
+ *
+ * Photos shade smoothly: most neighbors differ a little, and few differ a
+ * lot. Text, line art and screenshots are flat areas with sharp edges between
+ * them: few neighbors differ, and those that do, differ a lot.
+ */
+struct EdgeAnalysis {
+  /** Fraction of horizontal neighbors that differ at all noticeably. */
+  double texturedShare;
+
+  /** Of those, the fraction that differ sharply: edges. */
+  double sharpShare;
+};
+
+/**
+ * Measures tightly-packed 8-bit gray (bytesPerPixel=1) or RGB
+ * (bytesPerPixel=3) pixels' edges, on every other row.
+ *
+ * This is a second pass over the pixels, so only call it when the cheaper
+ * signals (image objects, color count) say a page may be a photo.
+ */
+void
+analyzeEdges(
+  const uint8_t* pixels,
+  size_t width,
+  size_t height,
+  int bytesPerPixel,
+  EdgeAnalysis* analysis
+);
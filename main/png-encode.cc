@@ -0,0 +1,212 @@
+#include <cstring>
+
+#include "lodepng.h"
+
+#include "parallel-deflate.h"
+#include "png-encode.h"
+#include "png-filter.h"
+
+static const uint32_t EmptySlot = 0xffffffff; // not a 0xRRGGBB value
+
+/**
+ * Returns the palette lookup table's first slot to probe for `color`. There
+ * are at most 4 * MaxCountedColors = 1024 slots: the hash's top 10 bits.
+ */
+static size_t
+firstSlot(uint32_t color, size_t nSlots)
+{
+  return ((color * 2654435761u) >> 22) & (nSlots - 1);
+}
+
+/**
+ * Returns the fewest bits per pixel (1, 2, 4 or 8) that can index `nColors`
+ * palette entries.
+ */
+static int
+paletteBitsForColors(unsigned nColors)
+{
+  if (nColors <= 2) return 1;
+  if (nColors <= 4) return 2;
+  if (nColors <= 16) return 4;
+  return 8;
+}
+
+/**
+ * Returns the fewest bits (1, 2, 4 or 8) of gray that represent every one of
+ * the analysis's gray levels exactly.
+ *
+ * A d-bit gray level v means 8-bit gray v * 255 / (2^d - 1): for 2 bits, 0,
+ * 85, 170 and 255.
+ */
+static int
+exactGrayBits(const PixelAnalysis& analysis)
+{
+  for (int bits = 1; bits < 8; bits *= 2) {
+    const unsigned step = 255 / ((1 << bits) - 1);
+    bool exact = true;
+    for (unsigned i = 0; exact && i < analysis.nColors; i++) {
+      exact = (analysis.colors[i] & 0xff) % step == 0;
+    }
+    if (exact) return bits;
+  }
+  return 8;
+}
+
+PngColorMode::PngColorMode(int bytesPerPixel)
+  : colorType(bytesPerPixel == 1 ? PngColorGray : PngColorRgb),
+    bitDepth(8)
+{
+}
+
+PngColorMode
+PngColorMode::smallest(const PixelAnalysis& analysis, int bytesPerPixel, size_t nPixels)
+{
+  PngColorMode mode(analysis.isGray ? 1 : bytesPerPixel);
+  if (analysis.nColors > MaxCountedColors) return mode;
+
+  // PLTE costs 3 bytes per color: like lodepng, skip it for tiny images.
+  const bool paletteIsWorthIt = static_cast<size_t>(analysis.nColors) * 2 < nPixels;
+  const int paletteBits = paletteBitsForColors(analysis.nColors);
+
+  if (analysis.isGray) {
+    const int grayBits = exactGrayBits(analysis);
+    if (!paletteIsWorthIt || grayBits <= paletteBits) {
+      mode.bitDepth = grayBits;
+      return mode;
+    }
+  } else if (!paletteIsWorthIt) {
+    return mode;
+  }
+
+  mode.colorType = PngColorPalette;
+  mode.bitDepth = paletteBits;
+  // Census order is roughly order of first appearance, as lodepng picks. (A
+  // sorted palette made our test files 5% bigger.)
+  mode.palette.assign(analysis.colors, analysis.colors + analysis.nColors);
+
+  size_t nSlots = 16;
+  while (nSlots < 4 * mode.palette.size()) nSlots *= 2; // short probes
+  mode.slotColors.assign(nSlots, EmptySlot);
+  mode.slotIndices.assign(nSlots, 0);
+  for (size_t i = 0; i < mode.palette.size(); i++) {
+    size_t slot = firstSlot(mode.palette[i], nSlots);
+    while (mode.slotColors[slot] != EmptySlot) slot = (slot + 1) & (nSlots - 1);
+    mode.slotColors[slot] = mode.palette[i];
+    mode.slotIndices[slot] = i;
+  }
+
+  return mode;
+}
+
+int
+PngColorMode::paletteIndex(uint32_t color) const
+{
+  const size_t nSlots = slotColors.size();
+  size_t slot = firstSlot(color, nSlots);
+  while (slotColors[slot] != EmptySlot) {
+    if (slotColors[slot] == color) return slotIndices[slot];
+    slot = (slot + 1) & (nSlots - 1);
+  }
+  return 0; // not in the palette: the caller broke our contract
+}
+
+bool
+PngColorMode::needsPacking(int bytesPerPixel) const
+{
+  if (bitDepth != 8) return true;
+  if (colorType == PngColorGray) return bytesPerPixel != 1;
+  if (colorType == PngColorRgb) return bytesPerPixel != 3;
+  return true;
+}
+
+size_t
+PngColorMode::packedBytes(size_t nPixels) const
+{
+  const size_t channels = colorType == PngColorRgb ? 3 : 1;
+  return (nPixels * channels * bitDepth + 7) / 8;
+}
+
+void
+PngColorMode::packPixels(const uint8_t* pixels, size_t nPixels, int bytesPerPixel, uint8_t* out) const
+{
+  if (colorType == PngColorRgb) {
+    std::memcpy(out, pixels, 3 * nPixels);
+    return;
+  }
+
+  if (bitDepth < 8) std::memset(out, 0, packedBytes(nPixels));
+
+  const int grayShift = 8 - bitDepth; // d-bit gray is 8-bit gray's top d bits
+  uint32_t previousColor = EmptySlot;
+  int previousIndex = 0;
+  for (size_t x = 0; x < nPixels; x++) {
+    const uint8_t* p = pixels + x * bytesPerPixel;
+
+    int value;
+    if (colorType == PngColorGray) {
+      value = p[0] >> grayShift;
+    } else {
+      const uint32_t color = bytesPerPixel == 3
+        ? (p[0] << 16) | (p[1] << 8) | p[2]
+        : p[0] * 0x010101u;
+      // Thumbnails are full of runs of one color: skip the hash lookup.
+      if (color != previousColor) {
+        previousColor = color;
+        previousIndex = paletteIndex(color);
+      }
+      value = previousIndex;
+    }
+
+    if (bitDepth == 8) {
+      out[x] = value;
+    } else {
+      const size_t bit = x * bitDepth;
+      out[bit / 8] |= value << (8 - bitDepth - bit % 8);
+    }
+  }
+}
+
+bool
+encodeSmallestPng(const uint8_t* pixels, size_t width, size_t height, int bytesPerPixel, const PixelAnalysis& analysis, int compressionLevel, std::vector<uint8_t>* out)
+{
+  const PngColorMode mode(PngColorMode::smallest(analysis, bytesPerPixel, width * height));
+
+  std::vector<uint8_t> packed;
+  std::vector<uint8_t> filters;
+
+  // lodepng's raw images, unlike PNG rows, don't pad rows to a whole byte:
+  // we pack the image as one long row.
+  const uint8_t* samples = pixels;
+  if (mode.needsPacking(bytesPerPixel)) {
+    packed.resize(mode.packedBytes(width * height));
+    mode.packPixels(pixels, width * height, bytesPerPixel, &packed[0]);
+    samples = &packed[0];
+  }
+
+  const DeflateSettings deflateSettings = { compressionLevel };
+
+  lodepng::State state;
+  state.info_raw.colortype = static_cast<LodePNGColorType>(mode.colorType);
+  state.info_raw.bitdepth = mode.bitDepth;
+  for (uint32_t color : mode.palette) {
+    lodepng_palette_add(&state.info_raw, color >> 16, (color >> 8) & 0xff, color & 0xff, 0xff);
+  }
+  // We picked the mode from our own census: lodepng needn't take another.
+  lodepng_color_mode_copy(&state.info_png.color, &state.info_raw);
+  state.encoder.auto_convert = 0;
+  if (mode.filtersAdaptively()) {
+    // lodepng's own filter selection is scalar, five passes per row.
+    choosePngFilters(samples, width, height, mode.filterBytesPerPixel(), &filters);
+    state.encoder.filter_strategy = LFS_PREDEFINED;
+    state.encoder.predefined_filters = &filters[0];
+  }
+  state.encoder.zlibsettings.custom_zlib = parallelZlibCompress;
+  state.encoder.zlibsettings.custom_context = &deflateSettings;
+
+  out->clear();
+  if (lodepng::encode(*out, samples, width, height, state)) {
+    out->clear();
+    return false;
+  }
+  return true;
+}
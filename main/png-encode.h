@@ -0,0 +1,108 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "pixel-analysis.h"
+
+/**
+ * PNG color types we write. The values are PNG's (and lodepng's).
+ */
+enum PngColorType {
+  PngColorGray = 0,
+  PngColorRgb = 2,
+  PngColorPalette = 3
+};
+
+/**
+ * How a PNG stores its pixels: color type, bit depth and palette.
+ *
+ * We render 8-bit gray or RGB, but most thumbnails need far less: black text
+ * on white fits in 1-bit gray; a few colored headings fit in a 16-color
+ * palette. Fewer bits per pixel means fewer bytes to filter and deflate, and
+ * a smaller file.
+ */
+class PngColorMode {
+public:
+  /**
+   * 8-bit gray (bytesPerPixel=1) or RGB (bytesPerPixel=3): pixels as they
+   * are.
+   */
+  explicit PngColorMode(int bytesPerPixel);
+
+  /**
+   * Returns the smallest mode that holds every pixel exactly, judging by the
+   * color census in `analysis` (of `nPixels` pixels, `bytesPerPixel` bytes
+   * each).
+   *
+   * Gray pixels get 1-, 2- or 4-bit gray if every level is exactly
+   * representable, else a smaller palette if that has fewer bits, else 8-bit
+   * gray. Color pixels get a palette if there are at most 256 colors, else
+   * RGB.
+   */
+  static PngColorMode smallest(const PixelAnalysis& analysis, int bytesPerPixel, size_t nPixels);
+
+  PngColorType colorType;
+  int bitDepth;
+  std::vector<uint32_t> palette; // 0xRRGGBB, for PngColorPalette
+
+  /**
+   * True if PNG rows of this mode differ from rows of `bytesPerPixel`-byte
+   * pixels, so they need packPixels().
+   */
+  bool needsPacking(int bytesPerPixel) const;
+
+  /**
+   * True if rows should get adaptive filters. PNG recommends the None filter
+   * for palette and sub-byte rows, as lodepng and libpng do.
+   */
+  bool filtersAdaptively() const { return colorType != PngColorPalette && bitDepth == 8; }
+
+  /** Bytes per pixel, rounded up, as PNG filters count them. */
+  int filterBytesPerPixel() const { return colorType == PngColorRgb ? 3 : 1; }
+
+  /** Bytes that hold `nPixels` packed pixels: for instance, one row. */
+  size_t packedBytes(size_t nPixels) const;
+
+  /**
+   * Writes packedBytes(nPixels) bytes of samples for `nPixels` consecutive
+   * 8-bit gray or RGB pixels, with no padding between rows: pass a row to get
+   * a PNG row, or a whole image to get a lodepng raw image.
+   *
+   * Every pixel's color must be representable: that is, the mode must come
+   * from smallest() on an analysis that includes these pixels.
+   */
+  void packPixels(const uint8_t* pixels, size_t nPixels, int bytesPerPixel, uint8_t* out) const;
+
+private:
+  int paletteIndex(uint32_t color) const;
+
+  // Open-addressing table of palette colors and their indices.
+  std::vector<uint32_t> slotColors;
+  std::vector<uint8_t> slotIndices;
+};
+
+/**
+ * Encodes tightly-packed 8-bit gray or RGB pixels as a PNG in
+ * PngColorMode::smallest(), with lodepng.
+ *
+ * `analysis` must describe these very pixels. Deflates with
+ * parallelZlibCompress() at zlib `compressionLevel`, and picks filters with
+ * choosePngFilters().
+ *
+ * Replaces `out`'s contents. Returns false if lodepng fails.
+ *
+ * This holds the whole image, packed, and the whole file: stream thumbnails
+ * with PngWriter instead.
+ */
+bool
+encodeSmallestPng(
+  const uint8_t* pixels,
+  size_t width,
+  size_t height,
+  int bytesPerPixel,
+  const PixelAnalysis& analysis,
+  int compressionLevel,
+  std::vector<uint8_t>* out
+);
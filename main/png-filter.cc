@@ -0,0 +1,313 @@
+#include <algorithm>
+#include <cstdlib>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "png-filter.h"
+
+/**
+ * Filters bytes [begin, end) of a row, writing each filter type's bytes to
+ * out[type] and adding their magnitudes to sums[type]. Returns the index of
+ * the first byte it did not filter.
+ *
+ * Vector filters require begin >= bytesPerPixel, so every byte they load has
+ * a left neighbor in the row.
+ */
+typedef size_t (*RowFilter)(const uint8_t* row, const uint8_t* up, size_t begin, size_t end, int bytesPerPixel, uint8_t* const out[NPngFilterTypes], uint64_t sums[NPngFilterTypes]);
+
+static uint8_t
+paethPredictor(int a, int b, int c)
+{
+  const int p = a + b - c;
+  const int pa = std::abs(p - a);
+  const int pb = std::abs(p - b);
+  const int pc = std::abs(p - c);
+  if (pa <= pb && pa <= pc) return a;
+  if (pb <= pc) return b;
+  return c;
+}
+
+static uint8_t
+magnitude(uint8_t filtered)
+{
+  return filtered < 128 ? filtered : 256 - filtered;
+}
+
+static void
+filterBytesScalar(const uint8_t* row, const uint8_t* up, size_t begin, size_t end, int bytesPerPixel, uint8_t* const out[NPngFilterTypes], uint64_t sums[NPngFilterTypes])
+{
+  for (size_t i = begin; i < end; i++) {
+    const uint8_t x = row[i];
+    const uint8_t a = i >= static_cast<size_t>(bytesPerPixel) ? row[i - bytesPerPixel] : 0;
+    const uint8_t b = up[i];
+    const uint8_t c = i >= static_cast<size_t>(bytesPerPixel) ? up[i - bytesPerPixel] : 0;
+
+    const uint8_t filtered[NPngFilterTypes] = {
+      x,
+      static_cast<uint8_t>(x - a),
+      static_cast<uint8_t>(x - b),
+      static_cast<uint8_t>(x - ((a + b) >> 1)),
+      static_cast<uint8_t>(x - paethPredictor(a, b, c))
+    };
+    for (int type = 0; type < NPngFilterTypes; type++) {
+      out[type][i] = filtered[type];
+      sums[type] += magnitude(filtered[type]);
+    }
+  }
+}
+
+#if defined(__x86_64__)
+
+/*
+ * The vector filters compute, for 16 (or 32) bytes at once:
+ *
+ * - Average: (a + b) >> 1 is avg_epu8(a, b), which rounds up, minus the
+ *   rounding bit (a ^ b) & 1.
+ * - Paeth: with p = a + b - c, |p - a| = |b - c|, |p - b| = |a - c| and
+ *   |p - c| = |(b - c) + (a - c)|. Those need 9 bits, so we compute them in
+ *   16-bit lanes and pack the comparisons back to byte masks.
+ * - Magnitudes: min_epu8(x, -x) is x's magnitude as a signed byte. sad_epu8
+ *   sums them.
+ */
+
+static __m128i
+magnitudesSse2(__m128i filtered)
+{
+  return _mm_min_epu8(filtered, _mm_sub_epi8(_mm_setzero_si128(), filtered));
+}
+
+static __m128i
+abs16Sse2(__m128i x)
+{
+  return _mm_max_epi16(x, _mm_sub_epi16(_mm_setzero_si128(), x));
+}
+
+/**
+ * Sets 16-bit lanes of *notA where Paeth does not predict a, and of *notB
+ * where it predicts c rather than b.
+ */
+static void
+paethMasks16Sse2(__m128i a, __m128i b, __m128i c, __m128i* notA, __m128i* notB)
+{
+  const __m128i bc = _mm_sub_epi16(b, c);
+  const __m128i ac = _mm_sub_epi16(a, c);
+  const __m128i pa = abs16Sse2(bc);
+  const __m128i pb = abs16Sse2(ac);
+  const __m128i pc = abs16Sse2(_mm_add_epi16(bc, ac));
+  *notA = _mm_or_si128(_mm_cmpgt_epi16(pa, pb), _mm_cmpgt_epi16(pa, pc));
+  *notB = _mm_cmpgt_epi16(pb, pc);
+}
+
+static __m128i
+paethSse2(__m128i a, __m128i b, __m128i c)
+{
+  const __m128i zero = _mm_setzero_si128();
+  __m128i notALo, notBLo, notAHi, notBHi;
+  paethMasks16Sse2(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero), _mm_unpacklo_epi8(c, zero), &notALo, &notBLo);
+  paethMasks16Sse2(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero), _mm_unpackhi_epi8(c, zero), &notAHi, &notBHi);
+  const __m128i notA = _mm_packs_epi16(notALo, notAHi);
+  const __m128i notB = _mm_packs_epi16(notBLo, notBHi);
+
+  const __m128i bOrC = _mm_or_si128(_mm_and_si128(notB, c), _mm_andnot_si128(notB, b));
+  return _mm_or_si128(_mm_and_si128(notA, bOrC), _mm_andnot_si128(notA, a));
+}
+
+static size_t
+filterRowSse2(const uint8_t* row, const uint8_t* up, size_t begin, size_t end, int bytesPerPixel, uint8_t* const out[NPngFilterTypes], uint64_t sums[NPngFilterTypes])
+{
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i one = _mm_set1_epi8(1);
+  __m128i vectorSums[NPngFilterTypes];
+  for (auto& sum : vectorSums) sum = zero;
+
+  size_t i = begin;
+  for (; i + 16 <= end; i += 16) {
+    const __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i));
+    const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i - bytesPerPixel));
+    const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(up + i));
+    const __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(up + i - bytesPerPixel));
+
+    const __m128i average = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+    const __m128i filtered[NPngFilterTypes] = {
+      x,
+      _mm_sub_epi8(x, a),
+      _mm_sub_epi8(x, b),
+      _mm_sub_epi8(x, average),
+      _mm_sub_epi8(x, paethSse2(a, b, c))
+    };
+    for (int type = 0; type < NPngFilterTypes; type++) {
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(out[type] + i), filtered[type]);
+      vectorSums[type] = _mm_add_epi64(vectorSums[type], _mm_sad_epu8(magnitudesSse2(filtered[type]), zero));
+    }
+  }
+
+  for (int type = 0; type < NPngFilterTypes; type++) {
+    uint64_t lanes[2];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), vectorSums[type]);
+    sums[type] += lanes[0] + lanes[1];
+  }
+  return i;
+}
+
+__attribute__((target("avx2")))
+static __m256i
+paethAvx2(__m256i a, __m256i b, __m256i c)
+{
+  // unpack and packs work within 128-bit lanes, so bytes go back where they
+  // came from.
+  const __m256i zero = _mm256_setzero_si256();
+  __m256i notA16[2], notB16[2];
+  for (int half = 0; half < 2; half++) {
+    const __m256i a16 = half ? _mm256_unpackhi_epi8(a, zero) : _mm256_unpacklo_epi8(a, zero);
+    const __m256i b16 = half ? _mm256_unpackhi_epi8(b, zero) : _mm256_unpacklo_epi8(b, zero);
+    const __m256i c16 = half ? _mm256_unpackhi_epi8(c, zero) : _mm256_unpacklo_epi8(c, zero);
+    const __m256i bc = _mm256_sub_epi16(b16, c16);
+    const __m256i ac = _mm256_sub_epi16(a16, c16);
+    const __m256i pa = _mm256_abs_epi16(bc);
+    const __m256i pb = _mm256_abs_epi16(ac);
+    const __m256i pc = _mm256_abs_epi16(_mm256_add_epi16(bc, ac));
+    notA16[half] = _mm256_or_si256(_mm256_cmpgt_epi16(pa, pb), _mm256_cmpgt_epi16(pa, pc));
+    notB16[half] = _mm256_cmpgt_epi16(pb, pc);
+  }
+  const __m256i notA = _mm256_packs_epi16(notA16[0], notA16[1]);
+  const __m256i notB = _mm256_packs_epi16(notB16[0], notB16[1]);
+
+  return _mm256_blendv_epi8(a, _mm256_blendv_epi8(b, c, notB), notA);
+}
+
+__attribute__((target("avx2")))
+static size_t
+filterRowAvx2(const uint8_t* row, const uint8_t* up, size_t begin, size_t end, int bytesPerPixel, uint8_t* const out[NPngFilterTypes], uint64_t sums[NPngFilterTypes])
+{
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i one = _mm256_set1_epi8(1);
+  __m256i vectorSums[NPngFilterTypes];
+  for (auto& sum : vectorSums) sum = zero;
+
+  size_t i = begin;
+  for (; i + 32 <= end; i += 32) {
+    const __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row + i));
+    const __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row + i - bytesPerPixel));
+    const __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(up + i));
+    const __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(up + i - bytesPerPixel));
+
+    const __m256i average = _mm256_sub_epi8(_mm256_avg_epu8(a, b), _mm256_and_si256(_mm256_xor_si256(a, b), one));
+    const __m256i filtered[NPngFilterTypes] = {
+      x,
+      _mm256_sub_epi8(x, a),
+      _mm256_sub_epi8(x, b),
+      _mm256_sub_epi8(x, average),
+      _mm256_sub_epi8(x, paethAvx2(a, b, c))
+    };
+    for (int type = 0; type < NPngFilterTypes; type++) {
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(out[type] + i), filtered[type]);
+      const __m256i magnitudes = _mm256_min_epu8(filtered[type], _mm256_sub_epi8(zero, filtered[type]));
+      vectorSums[type] = _mm256_add_epi64(vectorSums[type], _mm256_sad_epu8(magnitudes, zero));
+    }
+  }
+
+  for (int type = 0; type < NPngFilterTypes; type++) {
+    uint64_t lanes[4];
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), vectorSums[type]);
+    sums[type] += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+  }
+
+  // Finish a 16-byte tail with SSE2, rather than byte by byte.
+  return filterRowSse2(row, up, i, end, bytesPerPixel, out, sums);
+}
+
+#endif /* __x86_64__ */
+
+static size_t
+filterRowPortable(const uint8_t* row, const uint8_t* up, size_t begin, size_t end, int bytesPerPixel, uint8_t* const out[NPngFilterTypes], uint64_t sums[NPngFilterTypes])
+{
+  return begin; // filterPngRow() does the rest with filterBytesScalar()
+}
+
+static RowFilter
+chooseRowFilter()
+{
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) return filterRowAvx2;
+  return filterRowSse2; // every x86-64 CPU has SSE2
+#else
+  return filterRowPortable;
+#endif
+}
+
+// Set by usePngFilterImplementation(); nullptr means chooseRowFilter()'s.
+static RowFilter forcedRowFilter = nullptr;
+
+bool
+usePngFilterImplementation(PngFilterImplementation implementation)
+{
+  switch (implementation) {
+    case PngFilterImplementationBest:
+      forcedRowFilter = nullptr;
+      return true;
+    case PngFilterImplementationPortable:
+      forcedRowFilter = filterRowPortable;
+      return true;
+#if defined(__x86_64__)
+    case PngFilterImplementationSse2:
+      forcedRowFilter = filterRowSse2;
+      return true;
+    case PngFilterImplementationAvx2:
+      __builtin_cpu_init();
+      if (!__builtin_cpu_supports("avx2")) return false;
+      forcedRowFilter = filterRowAvx2;
+      return true;
+#endif
+    default:
+      return false;
+  }
+}
+
+PngFilterType
+filterPngRow(const uint8_t* row, const uint8_t* previousRow, size_t rowBytes, int bytesPerPixel, uint8_t* const filtered[NPngFilterTypes])
+{
+  static const RowFilter bestRowFilter = chooseRowFilter();
+  const RowFilter filterRow = forcedRowFilter ? forcedRowFilter : bestRowFilter;
+
+  uint8_t* out[NPngFilterTypes];
+  uint64_t sums[NPngFilterTypes] = { 0 };
+  for (int type = 0; type < NPngFilterTypes; type++) {
+    filtered[type][0] = type;
+    out[type] = filtered[type] + 1;
+  }
+
+  // The first pixel has no left neighbor: filter it byte by byte, then as
+  // much as we can with vectors, then the tail byte by byte.
+  const size_t begin = std::min(rowBytes, static_cast<size_t>(bytesPerPixel));
+  filterBytesScalar(row, previousRow, 0, begin, bytesPerPixel, out, sums);
+  const size_t end = filterRow(row, previousRow, begin, rowBytes, bytesPerPixel, out, sums);
+  filterBytesScalar(row, previousRow, end, rowBytes, bytesPerPixel, out, sums);
+
+  int best = PngFilterNone;
+  for (int type = PngFilterSub; type < NPngFilterTypes; type++) {
+    if (sums[type] < sums[best]) best = type;
+  }
+  return static_cast<PngFilterType>(best);
+}
+
+void
+choosePngFilters(const uint8_t* pixels, size_t width, size_t height, int bytesPerPixel, std::vector<uint8_t>* filters)
+{
+  const size_t rowBytes = width * bytesPerPixel;
+  const std::vector<uint8_t> zeroRow(rowBytes, 0);
+  std::vector<uint8_t> scratch(NPngFilterTypes * (1 + rowBytes));
+  uint8_t* filtered[NPngFilterTypes];
+  for (int type = 0; type < NPngFilterTypes; type++) {
+    filtered[type] = &scratch[type * (1 + rowBytes)];
+  }
+
+  filters->resize(height);
+  for (size_t y = 0; y < height; y++) {
+    const uint8_t* row = pixels + y * rowBytes;
+    const uint8_t* previousRow = y ? row - rowBytes : zeroRow.data();
+    (*filters)[y] = filterPngRow(row, previousRow, rowBytes, bytesPerPixel, filtered);
+  }
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/**
+ * PNG filter types. A filtered row starts with one of these bytes.
+ */
+enum PngFilterType {
+  PngFilterNone = 0,
+  PngFilterSub = 1,
+  PngFilterUp = 2,
+  PngFilterAverage = 3,
+  PngFilterPaeth = 4
+};
+
+static const int NPngFilterTypes = 5;
+
+/**
+ * Filters a row of 8-bit samples all five ways, and returns the type whose
+ * filtered bytes have the smallest sum of magnitudes (read as signed bytes) --
+ * the "minsum" heuristic, as in lodepng and libpng.
+ *
+ * `filtered[type]` must hold 1 + rowBytes bytes. Each gets its type byte and
+ * then the filtered row, so the caller can deflate filtered[result] as-is.
+ * `previousRow` is all zero for the first row.
+ *
+ * Uses AVX2 or SSE2 (chosen at runtime) to compute every filter and its sum in
+ * one pass over the row.
+ */
+PngFilterType
+filterPngRow(
+  const uint8_t* row,
+  const uint8_t* previousRow,
+  size_t rowBytes,
+  int bytesPerPixel,
+  uint8_t* const filtered[NPngFilterTypes]
+);
+
+/**
+ * How filterPngRow() filters the bulk of each row.
+ */
+enum PngFilterImplementation {
+  PngFilterImplementationBest,     // the fastest this CPU supports (the default)
+  PngFilterImplementationPortable, // byte by byte, as PNG's spec describes
+  PngFilterImplementationSse2,
+  PngFilterImplementationAvx2
+};
+
+/**
+ * For tests: makes filterPngRow() use `implementation`, so a test can check
+ * each one against the portable one on a CPU that would only ever run the
+ * best.
+ *
+ * Returns false (and changes nothing) if this CPU can't run it. Not
+ * thread-safe: call it before filtering.
+ */
+bool
+usePngFilterImplementation(PngFilterImplementation implementation);
+
+/**
+ * Picks each row's filter for tightly-packed 8-bit gray or RGB pixels, with
+ * filterPngRow().
+ *
+ * Feed the result to lodepng as LFS_PREDEFINED filters: then lodepng filters
+ * each row once instead of five times, with scalar code.
+ */
+void
+choosePngFilters(
+  const uint8_t* pixels,
+  size_t width,
+  size_t height,
+  int bytesPerPixel,
+  std::vector<uint8_t>* filters
+);
@@ -0,0 +1,159 @@
+#include <algorithm>
+#include <cstring>
+#include <zlib.h>
+
+#include "png-filter.h"
+#include "png-writer.h"
+#include "worker-pool.h"
+
+// Compressed bytes per IDAT chunk. Bigger chunks mean fewer chunk headers and
+// CRCs; 64kb is what libpng's callers typically use.
+static const size_t IdatSize = 64 * 1024;
+// ParallelDeflater's chunk size: we needn't hold more chunks than the image
+// has.
+static const size_t DeflateChunkSize = 128 * 1024;
+
+static const uint8_t PngSignature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+
+static void
+putUint32(uint8_t* p, uint32_t value)
+{
+  p[0] = value >> 24;
+  p[1] = value >> 16;
+  p[2] = value >> 8;
+  p[3] = value;
+}
+
+/**
+ * Returns how many chunks a ParallelDeflater should deflate at a time: one
+ * per pool thread, but no more than `nBytes` fill.
+ */
+static size_t
+nDeflateThreads(size_t nBytes)
+{
+  const size_t nChunks = std::max(static_cast<size_t>(1), (nBytes + DeflateChunkSize - 1) / DeflateChunkSize);
+  return std::min(nChunks, workerPool().nThreads());
+}
+
+PngWriter::PngWriter(size_t width, size_t height, int bytesPerPixel, const PngColorMode& colorMode, int compressionLevel, const Sink& sink, DeflateScratch* scratch)
+  : width(width),
+    height(height),
+    bytesPerPixel(bytesPerPixel),
+    colorMode(colorMode),
+    rowBytes(colorMode.packedBytes(width)),
+    sink(sink),
+    deflater(compressionLevel, [this](const uint8_t* bytes, size_t nBytes) { appendIdat(bytes, nBytes); }, nDeflateThreads(height * (1 + rowBytes)), scratch),
+    isOk(deflater.ok()),
+    nRowsWritten(0)
+{
+  if (!isOk) return; // before we hand the sink anything
+
+  idat.reserve(IdatSize);
+  if (colorMode.needsPacking(bytesPerPixel)) {
+    packed.resize(1 + rowBytes);
+    packed[0] = PngFilterNone;
+  }
+  if (colorMode.filtersAdaptively()) {
+    previousRow.resize(rowBytes, 0);
+    for (auto& buffer : filtered) {
+      buffer.resize(1 + rowBytes);
+    }
+  }
+
+  uint8_t ihdr[13];
+  putUint32(ihdr, width);
+  putUint32(ihdr + 4, height);
+  ihdr[8] = colorMode.bitDepth;
+  ihdr[9] = colorMode.colorType;
+  ihdr[10] = 0; // deflate
+  ihdr[11] = 0; // adaptive filtering
+  ihdr[12] = 0; // not interlaced
+
+  sink(PngSignature, sizeof(PngSignature));
+  writeChunk("IHDR", ihdr, sizeof(ihdr));
+
+  if (colorMode.colorType == PngColorPalette) {
+    std::vector<uint8_t> plte;
+    for (uint32_t color : colorMode.palette) {
+      plte.push_back(color >> 16);
+      plte.push_back(color >> 8);
+      plte.push_back(color);
+    }
+    writeChunk("PLTE", &plte[0], plte.size());
+  }
+}
+
+void
+PngWriter::writeChunk(const char* type, const uint8_t* data, size_t nBytes)
+{
+  const uint8_t* typeBytes = reinterpret_cast<const uint8_t*>(type);
+
+  uint8_t header[8];
+  putUint32(header, nBytes);
+  std::memcpy(header + 4, typeBytes, 4);
+
+  uLong crc = crc32(0, typeBytes, 4);
+  if (nBytes) crc = crc32(crc, data, nBytes);
+  uint8_t footer[4];
+  putUint32(footer, crc);
+
+  sink(header, sizeof(header));
+  if (nBytes) sink(data, nBytes);
+  sink(footer, sizeof(footer));
+}
+
+/**
+ * Collects the deflater's output into IDAT chunks of IdatSize bytes.
+ */
+void
+PngWriter::appendIdat(const uint8_t* bytes, size_t nBytes)
+{
+  while (nBytes > 0) {
+    const size_t n = std::min(nBytes, IdatSize - idat.size());
+    idat.insert(idat.end(), bytes, bytes + n);
+    bytes += n;
+    nBytes -= n;
+    if (idat.size() == IdatSize) flushIdat();
+  }
+}
+
+void
+PngWriter::flushIdat()
+{
+  if (!idat.empty()) writeChunk("IDAT", &idat[0], idat.size());
+  idat.clear();
+}
+
+bool
+PngWriter::writeRow(const uint8_t* row)
+{
+  if (!isOk || nRowsWritten == height) return isOk = false;
+
+  nRowsWritten++;
+
+  const uint8_t* samples = row;
+  if (!packed.empty()) {
+    colorMode.packPixels(row, width, bytesPerPixel, &packed[1]);
+    samples = &packed[1];
+  }
+
+  if (!colorMode.filtersAdaptively()) {
+    return isOk = deflater.write(&packed[0], 1 + rowBytes); // packed[0] is PngFilterNone
+  }
+
+  uint8_t* const filteredRows[NPngFilterTypes] = { &filtered[0][0], &filtered[1][0], &filtered[2][0], &filtered[3][0], &filtered[4][0] };
+  const PngFilterType best = filterPngRow(samples, &previousRow[0], rowBytes, colorMode.filterBytesPerPixel(), filteredRows);
+
+  std::memcpy(&previousRow[0], samples, rowBytes);
+  return isOk = deflater.write(&filtered[best][0], 1 + rowBytes);
+}
+
+bool
+PngWriter::finish()
+{
+  if (!isOk || nRowsWritten != height || !deflater.finish()) return isOk = false;
+
+  flushIdat();
+  writeChunk("IEND", nullptr, 0);
+  return true;
+}
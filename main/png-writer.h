@@ -0,0 +1,91 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include "parallel-deflate.h"
+#include "png-encode.h"
+#include "png-filter.h"
+
+/**
+ * Encodes a PNG one row at a time, handing finished bytes to a sink as it
+ * goes.
+ *
+ * Unlike lodepng, this never holds the whole image or the whole file: it
+ * keeps two rows (for filtering), a ParallelDeflater's batch of filtered
+ * rows and one IDAT chunk's worth of compressed bytes. So a caller can render
+ * a page in bands and encode each band as soon as it's rendered -- and rows
+ * still deflate on every core, with the same output as lodepng with
+ * parallelZlibCompress().
+ *
+ * It writes any PngColorMode, packing each row on the way. 8-bit gray and RGB
+ * rows get the PNG filter with the smallest sum of absolute filtered values
+ * (the "minsum" heuristic, as in lodepng and libpng): see filterPngRow().
+ * Palette and sub-byte rows get the None filter.
+ *
+ * Usage:
+ *
+ *     PngWriter writer(width, height, 3, PngColorMode(3), level, sink); // sink gets signature + IHDR
+ *     if (!writer.ok()) ... // zlib couldn't allocate; the sink has nothing
+ *     for (each row) writer.writeRow(row);
+ *     writer.finish(); // sink gets the rest
+ *
+ * The constructor allocates everything deflate needs, so once ok() is true,
+ * writeRow() and finish() only fail if the caller passes too many or too few
+ * rows. After a failure, the sink's output is garbage.
+ */
+class PngWriter {
+public:
+  typedef std::function<void(const uint8_t* bytes, size_t nBytes)> Sink;
+
+  /**
+   * Starts a PNG of 8-bit gray (bytesPerPixel=1) or RGB (bytesPerPixel=3)
+   * pixels, stored in `colorMode` and deflated at zlib `compressionLevel`
+   * (1-9).
+   *
+   * With `scratch`, deflates with its buffers and zlib state instead of
+   * allocating new ones: see DeflateScratch.
+   */
+  PngWriter(size_t width, size_t height, int bytesPerPixel, const PngColorMode& colorMode, int compressionLevel, const Sink& sink, DeflateScratch* scratch = nullptr);
+
+  PngWriter(const PngWriter&) = delete;
+  PngWriter& operator=(const PngWriter&) = delete;
+
+  /**
+   * False if we couldn't start deflating. Then the sink has nothing.
+   */
+  bool ok() const { return isOk; }
+
+  /**
+   * Packs, filters and compresses one row of width * bytesPerPixel bytes.
+   */
+  bool writeRow(const uint8_t* row);
+
+  /**
+   * Finishes the zlib stream and writes the last IDAT and IEND chunks.
+   */
+  bool finish();
+
+private:
+  void writeChunk(const char* type, const uint8_t* data, size_t nBytes);
+  void appendIdat(const uint8_t* bytes, size_t nBytes);
+  void flushIdat();
+
+  const size_t width;
+  const size_t height;
+  const int bytesPerPixel;
+  const PngColorMode colorMode;
+  const size_t rowBytes; // in the PNG, without the filter type byte
+  Sink sink;
+
+  ParallelDeflater deflater;
+  bool isOk;
+  size_t nRowsWritten;
+
+  std::vector<uint8_t> packed; // filter type byte, then packed row
+  std::vector<uint8_t> previousRow; // all zero before the first row
+  std::vector<uint8_t> filtered[NPngFilterTypes]; // filter type byte, then filtered row
+  std::vector<uint8_t> idat; // compressed bytes for the next IDAT chunk
+};
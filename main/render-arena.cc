@@ -0,0 +1,103 @@
+#include <sys/mman.h>
+
+#include "render-arena.h"
+
+// Transparent hugepages back 2MB-aligned, 2MB-sized regions.
+static const size_t HugePageSize = 2 * 1024 * 1024;
+
+static size_t
+roundUp(size_t n, size_t multiple)
+{
+  return (n + multiple - 1) / multiple * multiple;
+}
+
+RenderArena::RenderArena()
+  : mapping(nullptr), mappingSize(0), pixelBuffer(nullptr), pixelCapacity(0)
+{
+}
+
+RenderArena::~RenderArena()
+{
+  if (mapping) munmap(mapping, mappingSize);
+}
+
+uint8_t*
+RenderArena::pixels(size_t nBytes)
+{
+  if (nBytes <= pixelCapacity) return pixelBuffer;
+
+  if (mapping) {
+    munmap(mapping, mappingSize);
+    mapping = nullptr;
+    pixelBuffer = nullptr;
+    pixelCapacity = 0;
+  }
+
+  // Map an extra hugepage's worth, so we can align the buffer to a hugepage
+  // boundary.
+  const size_t capacity = roundUp(nBytes, HugePageSize);
+  const size_t size = capacity + HugePageSize;
+  void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) return nullptr;
+
+  mapping = p;
+  mappingSize = size;
+  const uintptr_t address = reinterpret_cast<uintptr_t>(p);
+  pixelBuffer = reinterpret_cast<uint8_t*>(roundUp(address, HugePageSize));
+  pixelCapacity = capacity;
+
+#ifdef MADV_HUGEPAGE
+  // Best effort: it fails harmlessly when hugepages are disabled.
+  madvise(pixelBuffer, pixelCapacity, MADV_HUGEPAGE);
+#endif
+
+  return pixelBuffer;
+}
+
+std::vector<std::vector<uint8_t>>&
+RenderArena::extraEncoded(size_t n)
+{
+  extraEncodedBuffers.resize(n);
+  for (auto& buffer : extraEncodedBuffers) {
+    buffer.clear(); // keeps capacity
+  }
+  return extraEncodedBuffers;
+}
+
+std::vector<uint8_t>&
+RenderArena::scanJpeg()
+{
+  return scanJpegBuffer;
+}
+
+JpegPixels&
+RenderArena::scanPixels()
+{
+  return scanPixelsBuffer;
+}
+
+RenderArena::DeflateScratchLease::DeflateScratchLease(RenderArena& arena)
+  : arena(arena)
+{
+  {
+    std::lock_guard<std::mutex> lock(arena.deflateScratchMutex);
+    if (!arena.idleDeflateScratch.empty()) {
+      scratch = std::move(arena.idleDeflateScratch.back());
+      arena.idleDeflateScratch.pop_back();
+    }
+  }
+  if (!scratch) scratch.reset(new DeflateScratch());
+}
+
+RenderArena::DeflateScratchLease::~DeflateScratchLease()
+{
+  std::lock_guard<std::mutex> lock(arena.deflateScratchMutex);
+  arena.idleDeflateScratch.push_back(std::move(scratch));
+}
+
+RenderArena&
+renderArena()
+{
+  static RenderArena arena;
+  return arena;
+}
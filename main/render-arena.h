@@ -0,0 +1,92 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "jpeg.h"
+#include "parallel-deflate.h"
+
+/**
+ * Buffers we reuse for every thumbnail this process renders.
+ *
+ * A conversion renders thousands of thumbnails of (nearly) the same size.
+ * Allocating, page-faulting and freeing a fresh 1.5MB bitmap for each one is
+ * wasted work: instead, we keep the biggest buffers we've needed so far and
+ * hand them out again. The same goes for PNG encoders' deflate state: a
+ * megabyte or more of zlib streams and chunk buffers per image. (Encoded
+ * thumbnails stream to stdout as they're compressed: they need no buffer.)
+ *
+ * Not thread-safe, except for DeflateScratchLease: one thumbnail at a time.
+ * Each buffer's contents are only valid until the next call that returns the
+ * same buffer.
+ */
+class RenderArena {
+public:
+  RenderArena();
+  ~RenderArena();
+  RenderArena(const RenderArena&) = delete;
+  RenderArena& operator=(const RenderArena&) = delete;
+
+  /**
+   * Returns a pixel buffer of at least `nBytes` bytes, or nullptr if we are
+   * out of memory.
+   *
+   * The buffer is page-aligned and, where the kernel supports transparent
+   * hugepages, hugepage-backed. Its contents are undefined.
+   */
+  uint8_t* pixels(size_t nBytes);
+
+  /**
+   * Returns `n` empty vectors for extra thumbnails' encoded bytes. Each keeps
+   * the capacity it had last time.
+   */
+  std::vector<std::vector<uint8_t>>& extraEncoded(size_t n);
+
+  /**
+   * Returns a vector for a scanned page's JPEG bytes, and one for its decoded
+   * pixels. Scans are megabytes each.
+   */
+  std::vector<uint8_t>& scanJpeg();
+  JpegPixels& scanPixels();
+
+  /**
+   * Borrows a DeflateScratch for one PNG, and gives it back on destruction.
+   *
+   * Thread-safe: extra thumbnail sizes encode on workerPool() while the main
+   * one does, each with a scratch of its own. We keep every scratch we've
+   * lent out, so there are only ever as many as encoders that ran at once.
+   */
+  class DeflateScratchLease {
+  public:
+    explicit DeflateScratchLease(RenderArena& arena);
+    ~DeflateScratchLease();
+    DeflateScratchLease(const DeflateScratchLease&) = delete;
+    DeflateScratchLease& operator=(const DeflateScratchLease&) = delete;
+
+    DeflateScratch* get() const { return scratch.get(); }
+
+  private:
+    RenderArena& arena;
+    std::unique_ptr<DeflateScratch> scratch;
+  };
+
+private:
+  void* mapping;
+  size_t mappingSize;
+  uint8_t* pixelBuffer;
+  size_t pixelCapacity;
+  std::vector<std::vector<uint8_t>> extraEncodedBuffers;
+  std::vector<uint8_t> scanJpegBuffer;
+  JpegPixels scanPixelsBuffer;
+  std::mutex deflateScratchMutex;
+  std::vector<std::unique_ptr<DeflateScratch>> idleDeflateScratch; // guarded by deflateScratchMutex
+};
+
+/**
+ * Returns this process's RenderArena.
+ */
+RenderArena&
+renderArena();
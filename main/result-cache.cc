@@ -0,0 +1,228 @@
+#include <cstdio>
+#include <memory>
+#include <vector>
+
+#include "disk-cache.h"
+#include "result-cache.h"
+#include "sha256.h"
+#include "util.h"
+
+// The Makefile sets this from the VERSION file.
+#ifndef CONVERTER_VERSION
+#define CONVERTER_VERSION "dev"
+#endif
+
+// Bump this when the record format changes.
+static const char RecordFormatVersion[] = "1";
+
+// Stop recording documents whose output grows past this: we hold the
+// recording in memory until "done", on top of PDFium's memory, and a
+// replay reads it all back in. That's a few hundred pages' blobs and
+// thumbnails in split mode; bigger documents are rarely duplicates.
+static const size_t MaxRecordingBytes = 32 * 1024 * 1024;
+
+static const size_t HashChunkSize = 1024 * 1024;
+
+/*
+ * A record is a sequence of fragments, each:
+ *
+ * - kind: 1 byte, RawFragment or JsonFragment
+ * - name length: 4 bytes, big-endian; then the name
+ * - data length: 8 bytes, big-endian; then the data
+ *
+ * A JsonFragment's data is { "pdfMetadata": ..., "patch": ... }.
+ */
+enum FragmentKind {
+  RawFragment = 'r',
+  JsonFragment = 'j'
+};
+
+struct Recording {
+  bool active = false;
+  std::string key;
+  std::vector<uint8_t> bytes;
+  size_t fragmentStart = 0; // offset of the current fragment's kind byte
+  size_t dataStart = 0; // offset of the current fragment's data
+  bool ignoringBytes = true; // for "progress" and JSON fragments
+};
+
+static Recording recording;
+
+static void
+putUint(std::vector<uint8_t>* bytes, uint64_t value, int nBytes)
+{
+  for (int shift = 8 * (nBytes - 1); shift >= 0; shift -= 8) {
+    bytes->push_back(static_cast<uint8_t>(value >> shift));
+  }
+}
+
+static uint64_t
+getUint(const uint8_t* p, int nBytes)
+{
+  uint64_t value = 0;
+  for (int i = 0; i < nBytes; i++) {
+    value = (value << 8) | p[i];
+  }
+  return value;
+}
+
+std::string
+resultCacheKey(const std::string& converter, const std::string& optionsJson, const char* inputFilename)
+{
+  if (!DiskCache::fromEnvironment("RESULT_CACHE").enabled()) return std::string();
+
+  std::unique_ptr<FILE, int(*)(FILE*)> file(std::fopen(inputFilename, "rb"), std::fclose);
+  if (!file) return std::string();
+
+  Sha256 sha;
+  const std::string header = std::string("result ") + RecordFormatVersion
+    + " " + CONVERTER_VERSION
+    + " " + converter
+    + " " + nlohmann::json::parse(optionsJson).dump() // canonical
+    + "\n";
+  sha.update(header.data(), header.size());
+
+  std::vector<uint8_t> chunk(HashChunkSize);
+  size_t nRead;
+  while ((nRead = std::fread(&chunk[0], 1, chunk.size(), file.get())) > 0) {
+    sha.update(&chunk[0], nRead);
+  }
+  if (std::ferror(file.get())) return std::string();
+
+  return sha.hexDigest();
+}
+
+struct RecordedFragment {
+  FragmentKind kind;
+  std::string name;
+  const uint8_t* data;
+  size_t nBytes;
+  nlohmann::json json; // for JsonFragment
+};
+
+/**
+ * Parses a record. Returns false if it is malformed -- so we never output
+ * half a replay.
+ */
+static bool
+parseRecord(const std::vector<uint8_t>& record, std::vector<RecordedFragment>* fragments)
+{
+  const uint8_t* p = record.data();
+  const uint8_t* const end = p + record.size();
+  while (p < end) {
+    if (end - p < 5) return false;
+    RecordedFragment fragment;
+    fragment.kind = static_cast<FragmentKind>(p[0]);
+    if (fragment.kind != RawFragment && fragment.kind != JsonFragment) return false;
+    const uint64_t nameLength = getUint(p + 1, 4);
+    p += 5;
+    if (static_cast<uint64_t>(end - p) < nameLength + 8) return false;
+    fragment.name.assign(reinterpret_cast<const char*>(p), nameLength);
+    p += nameLength;
+    fragment.nBytes = getUint(p, 8);
+    p += 8;
+    if (static_cast<uint64_t>(end - p) < fragment.nBytes) return false;
+    fragment.data = p;
+    p += fragment.nBytes;
+
+    if (fragment.kind == JsonFragment) {
+      fragment.json = nlohmann::json::parse(fragment.data, fragment.data + fragment.nBytes, nullptr, false);
+      if (fragment.json.is_discarded() || !fragment.json.is_object()) return false;
+    }
+    fragments->push_back(std::move(fragment));
+  }
+  return true;
+}
+
+void
+replayCachedResultOrStartRecording(const std::string& key, const nlohmann::json& jsonTemplate, const std::string& mimeBoundary)
+{
+  if (key.empty()) return;
+
+  std::vector<uint8_t> record;
+  std::vector<RecordedFragment> fragments;
+  if (DiskCache::fromEnvironment("RESULT_CACHE").get(key, &record) && parseRecord(record, &fragments)) {
+    for (const auto& fragment : fragments) {
+      outputFragmentPrefix(fragment.name, mimeBoundary);
+      if (fragment.kind == JsonFragment) {
+        outputBytes(buildOutputJson(jsonTemplate, fragment.json["pdfMetadata"], fragment.json["patch"]).dump());
+      } else {
+        outputBytes(fragment.data, fragment.nBytes);
+      }
+    }
+    outputDoneAndExit(mimeBoundary);
+    return;
+  }
+
+  recording.active = true;
+  recording.key = key;
+}
+
+void
+recordFragmentPrefix(const std::string& name)
+{
+  if (!recording.active) return;
+
+  if (name == "progress") {
+    recording.ignoringBytes = true;
+    return;
+  }
+
+  recording.fragmentStart = recording.bytes.size();
+  recording.bytes.push_back(RawFragment);
+  putUint(&recording.bytes, name.size(), 4);
+  recording.bytes.insert(recording.bytes.end(), name.begin(), name.end());
+  putUint(&recording.bytes, 0, 8); // data length: we'll fill it in
+  recording.dataStart = recording.bytes.size();
+  recording.ignoringBytes = false;
+}
+
+/**
+ * Sets the current fragment's data length to match the data we've recorded,
+ * or stops recording if it has grown too big.
+ */
+static void
+updateDataLength()
+{
+  if (recording.bytes.size() > MaxRecordingBytes) {
+    recording.active = false;
+    std::vector<uint8_t>().swap(recording.bytes);
+    return;
+  }
+
+  const uint64_t nBytes = recording.bytes.size() - recording.dataStart;
+  for (int i = 0; i < 8; i++) {
+    recording.bytes[recording.dataStart - 8 + i] = static_cast<uint8_t>(nBytes >> (8 * (7 - i)));
+  }
+}
+
+void
+recordBytes(const uint8_t* bytes, size_t len)
+{
+  if (!recording.active || recording.ignoringBytes) return;
+
+  recording.bytes.insert(recording.bytes.end(), bytes, bytes + len);
+  updateDataLength();
+}
+
+void
+recordJsonFragment(const nlohmann::json& pdfMetadata, const nlohmann::json& patch)
+{
+  if (!recording.active || recording.ignoringBytes) return;
+
+  const std::string json = nlohmann::json({ { "pdfMetadata", pdfMetadata }, { "patch", patch } }).dump();
+  recording.bytes[recording.fragmentStart] = JsonFragment;
+  recording.bytes.resize(recording.dataStart);
+  recording.bytes.insert(recording.bytes.end(), json.begin(), json.end());
+  updateDataLength();
+  recording.ignoringBytes = true;
+}
+
+void
+finishRecording()
+{
+  if (!recording.active) return;
+
+  recording.active = false;
+  DiskCache::fromEnvironment("RESULT_CACHE").put(recording.key, recording.bytes);
+}
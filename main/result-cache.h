@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include "json.hpp"
+
+/**
+ * Whole-document result cache: replays our output for a document we've
+ * converted before.
+ *
+ * Re-imports and duplicate uploads are common. With RESULT_CACHE_DIR set (see
+ * DiskCache::fromEnvironment()), we record every fragment of a successful
+ * conversion under a hash of the input blob, the options and our version.
+ * When the same input comes again, we output the recorded fragments instead
+ * of opening the PDF: a duplicate costs about a read of the file.
+ *
+ * Only the JSON fragments depend on the JSON template (filename, metadata,
+ * etc.). For those we record outputJsonFragment()'s PDF metadata and patch,
+ * and rebuild the JSON from the new template when we replay. We don't record
+ * "progress" fragments, and we only store a recording once we output "done":
+ * errors are never cached. Nor is output over 32MB: we hold the recording in
+ * memory.
+ */
+
+/**
+ * Returns the cache key for converting `inputFilename` with `optionsJson`,
+ * using `converter` (our binary's name: its output differs from the other's).
+ *
+ * Returns "" if the result cache is disabled or the input can't be read.
+ */
+std::string
+resultCacheKey(
+  const std::string& converter,
+  const std::string& optionsJson,
+  const char* inputFilename
+);
+
+/**
+ * If the result cache holds `key`, outputs its fragments (with JSON built
+ * from `jsonTemplate`) and "done", and exits.
+ *
+ * Otherwise, starts recording output under `key`: util.cc's output functions
+ * call the record*() functions below. Does nothing if `key` is "".
+ */
+void
+replayCachedResultOrStartRecording(
+  const std::string& key,
+  const nlohmann::json& jsonTemplate,
+  const std::string& mimeBoundary
+);
+
+/** Recording: starts a fragment. */
+void
+recordFragmentPrefix(const std::string& name);
+
+/** Recording: appends to the current fragment. */
+void
+recordBytes(const uint8_t* bytes, size_t len);
+
+/**
+ * Recording: marks the current fragment as outputJsonFragment()'s, to be
+ * rebuilt from `pdfMetadata` and `patch`. Ignores its bytes.
+ */
+void
+recordJsonFragment(const nlohmann::json& pdfMetadata, const nlohmann::json& patch);
+
+/**
+ * Recording: stores what we've recorded. Call this just before outputting
+ * "done".
+ */
+void
+finishRecording();
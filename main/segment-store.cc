@@ -0,0 +1,582 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "segment-store.h"
+
+static const uint64_t DefaultMaxBytes = 1024 * 1024 * 1024;
+
+static const uint32_t IndexMagic = 0x53495831; // "SIX1"
+static const uint32_t RecordMagic = 0x53475231; // "SGR1"
+
+// 64k slots of 32 bytes: a 2MB index. Compaction doubles it when it's 3/4
+// full.
+static const uint64_t InitialNSlots = 64 * 1024;
+
+// Values must fit a record's 32-bit length.
+static const uint64_t MaxRecordBytes = 1024 * 1024 * 1024;
+
+/*
+ * Shared memory: every field another process may write while we read goes
+ * through __atomic builtins.
+ */
+struct SegmentStore::IndexHeader {
+  uint32_t magic;
+  uint32_t stale; // 1 once compaction has renamed a new index over this one
+  uint64_t nSlots;
+  uint32_t currentSegment; // the segment put() appends to
+  uint32_t clock; // incremented on every put(); slots' lastUsed come from it
+  uint64_t nRecordBytes; // bytes in all segments, live or not
+  uint64_t nUsedSlots;
+  uint8_t padding[24];
+};
+
+/*
+ * A slot's hash is set once and stays: a slot being rewritten still reads as
+ * taken, so lookups probe past it. Its sequence is odd while put() rewrites
+ * segment, offset and nBytes, and even otherwise.
+ */
+struct SegmentStore::Slot {
+  uint64_t hash; // 0 means empty
+  uint64_t offset; // of the record within its segment
+  uint32_t segment;
+  uint32_t nBytes; // of the whole record
+  uint32_t lastUsed;
+  uint32_t sequence;
+};
+
+struct RecordHeader {
+  uint32_t magic;
+  uint32_t keyLength;
+  uint32_t valueLength;
+  uint32_t crc; // CRC-32 of key and value
+};
+
+template<typename T> static T
+loadAcquire(const T* p)
+{
+  return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+template<typename T> static T
+loadRelaxed(const T* p)
+{
+  return __atomic_load_n(p, __ATOMIC_RELAXED);
+}
+
+template<typename T> static void
+storeRelease(T* p, T value)
+{
+  __atomic_store_n(p, value, __ATOMIC_RELEASE);
+}
+
+template<typename T> static void
+storeRelaxed(T* p, T value)
+{
+  __atomic_store_n(p, value, __ATOMIC_RELAXED);
+}
+
+/**
+ * FNV-1a: stable across processes, unlike std::hash. Never returns 0, which
+ * marks empty slots.
+ */
+static uint64_t
+hashKey(const std::string& key)
+{
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (unsigned char c : key) {
+    hash = (hash ^ c) * 0x100000001b3ULL;
+  }
+  return hash ? hash : 1;
+}
+
+static uint32_t
+recordCrc(const uint8_t* key, size_t keyLength, const uint8_t* value, size_t valueLength)
+{
+  uLong crc = crc32(0, key, keyLength);
+  return crc32(crc, value, valueLength);
+}
+
+static bool
+writeAll(int fd, const uint8_t* bytes, size_t nBytes)
+{
+  while (nBytes > 0) {
+    const ssize_t n = write(fd, bytes, nBytes);
+    if (n <= 0) return false;
+    bytes += n;
+    nBytes -= n;
+  }
+  return true;
+}
+
+/**
+ * Holds an exclusive flock() until destroyed.
+ */
+class FileLock {
+public:
+  FileLock(int fd) : fd(fd), locked(fd != -1 && flock(fd, LOCK_EX) == 0) {}
+  ~FileLock() { if (locked) flock(fd, LOCK_UN); }
+  FileLock(const FileLock&) = delete;
+  FileLock& operator=(const FileLock&) = delete;
+  bool ok() const { return locked; }
+
+private:
+  int fd;
+  bool locked;
+};
+
+SegmentStore::SegmentStore()
+  : maxBytes(0), lockFd(-1), appendFd(-1), appendSegment(0), indexFd(-1), indexData(nullptr), indexBytes(0)
+{
+}
+
+SegmentStore::SegmentStore(const std::string& directory, uint64_t maxBytes)
+  : directory(directory), maxBytes(maxBytes), lockFd(-1), appendFd(-1), appendSegment(0), indexFd(-1), indexData(nullptr), indexBytes(0)
+{
+  if (mkdir(directory.c_str(), 0755) != 0 && errno != EEXIST) {
+    this->directory.clear();
+    return;
+  }
+
+  lockFd = open((directory + "/lock").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (lockFd == -1 || !openIndex()) {
+    this->directory.clear(); // disable
+  }
+}
+
+SegmentStore::~SegmentStore()
+{
+  closeSegments();
+  closeIndex();
+  if (appendFd != -1) close(appendFd);
+  if (lockFd != -1) close(lockFd);
+}
+
+SegmentStore&
+SegmentStore::fromEnvironment(const std::string& prefix)
+{
+  static std::map<std::string, SegmentStore*> stores;
+  SegmentStore*& store(stores[prefix]);
+  if (!store) {
+    const char* directory = std::getenv((prefix + "_DIR").c_str());
+    if (!directory || !*directory) {
+      store = new SegmentStore();
+    } else {
+      uint64_t maxBytes = DefaultMaxBytes;
+      const char* maxBytesString = std::getenv((prefix + "_MAX_BYTES").c_str());
+      if (maxBytesString && *maxBytesString) {
+        char* end = nullptr;
+        const unsigned long long value = std::strtoull(maxBytesString, &end, 10);
+        if (*end == '\0') maxBytes = value;
+      }
+      store = new SegmentStore(directory, maxBytes);
+    }
+  }
+  return *store;
+}
+
+/**
+ * Writes an empty index with `nSlots` slots to `path`.
+ */
+static bool
+createIndexFile(const std::string& path, uint64_t nSlots, uint32_t currentSegment)
+{
+  const int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd == -1) return false;
+
+  const size_t headerBytes = 64;
+  uint8_t header[headerBytes] = { 0 };
+  const uint32_t magic = IndexMagic;
+  std::memcpy(header, &magic, sizeof(magic));
+  std::memcpy(header + 8, &nSlots, sizeof(nSlots));
+  std::memcpy(header + 16, &currentSegment, sizeof(currentSegment));
+
+  const bool ok = writeAll(fd, header, headerBytes) && ftruncate(fd, headerBytes + nSlots * 32) == 0;
+  close(fd);
+  return ok;
+}
+
+bool
+SegmentStore::openIndex()
+{
+  static_assert(sizeof(IndexHeader) == 64, "IndexHeader must match createIndexFile()");
+  static_assert(sizeof(Slot) == 32, "Slot must match createIndexFile()");
+
+  const std::string path(directory + "/index");
+  indexFd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+  if (indexFd == -1) {
+    // First use of this directory: create the index, unless another process
+    // beats us to it.
+    FileLock lock(lockFd);
+    if (!lock.ok()) return false;
+    indexFd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+    if (indexFd == -1) {
+      if (!createIndexFile(path + ".tmp", InitialNSlots, 0) || rename((path + ".tmp").c_str(), path.c_str()) != 0) return false;
+      indexFd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+      if (indexFd == -1) return false;
+    }
+  }
+
+  struct stat st;
+  if (fstat(indexFd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(IndexHeader)) {
+    closeIndex();
+    return false;
+  }
+
+  void* data = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, indexFd, 0);
+  if (data == MAP_FAILED) {
+    closeIndex();
+    return false;
+  }
+  indexData = static_cast<uint8_t*>(data);
+  indexBytes = st.st_size;
+
+  const IndexHeader* header = reinterpret_cast<const IndexHeader*>(indexData);
+  if (header->magic != IndexMagic || indexBytes != sizeof(IndexHeader) + header->nSlots * sizeof(Slot) || header->nSlots == 0) {
+    closeIndex();
+    return false;
+  }
+  return true;
+}
+
+void
+SegmentStore::closeIndex()
+{
+  if (indexData) munmap(indexData, indexBytes);
+  if (indexFd != -1) close(indexFd);
+  indexData = nullptr;
+  indexBytes = 0;
+  indexFd = -1;
+}
+
+bool
+SegmentStore::ensureIndexIsCurrent()
+{
+  if (indexData && !loadAcquire(&reinterpret_cast<IndexHeader*>(indexData)->stale)) return true;
+
+  // Compaction replaced the index and deleted the segments it points to.
+  closeSegments();
+  closeIndex();
+  return openIndex();
+}
+
+SegmentStore::Segment*
+SegmentStore::segment(uint32_t number, uint64_t minBytes)
+{
+  auto it = std::find_if(segments.begin(), segments.end(), [number](const Segment& s) { return s.number == number; });
+  if (it == segments.end()) {
+    const int fd = open((directory + "/segment-" + std::to_string(number)).c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return nullptr;
+    segments.push_back({ number, fd, nullptr, 0 });
+    it = segments.end() - 1;
+  }
+
+  Segment& s(*it);
+  if (s.mappedBytes < minBytes) {
+    // The segment has grown since we mapped it.
+    struct stat st;
+    if (fstat(s.fd, &st) != 0 || static_cast<uint64_t>(st.st_size) < minBytes) return nullptr;
+    if (s.data) munmap(s.data, s.mappedBytes);
+    void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, s.fd, 0);
+    s.data = data == MAP_FAILED ? nullptr : static_cast<uint8_t*>(data);
+    s.mappedBytes = s.data ? st.st_size : 0;
+    if (!s.data) return nullptr;
+  }
+  return &s;
+}
+
+void
+SegmentStore::closeSegments()
+{
+  for (auto& s : segments) {
+    if (s.data) munmap(s.data, s.mappedBytes);
+    close(s.fd);
+  }
+  segments.clear();
+}
+
+/**
+ * Finds the slot for `key`, reading it seqlock-style, and checks its record.
+ * Returns nullptr if the key isn't in the index (or its slot is mid-write).
+ *
+ * Probing continues past slots whose record is bad. If `badSlot` is set, it
+ * gets the first of those with the key's hash (or nullptr), so put() can
+ * reuse it.
+ */
+const SegmentStore::Slot*
+SegmentStore::findSlot(uint64_t hash, const std::string& key, uint32_t* segmentNumber, uint64_t* offset, uint32_t* nBytes, const Slot** badSlot)
+{
+  if (badSlot) *badSlot = nullptr;
+
+  const IndexHeader* header = reinterpret_cast<const IndexHeader*>(indexData);
+  const Slot* slots = reinterpret_cast<const Slot*>(indexData + sizeof(IndexHeader));
+  const uint64_t nSlots = header->nSlots;
+
+  for (uint64_t i = 0; i < nSlots; i++) {
+    const Slot* slot = &slots[(hash + i) % nSlots];
+    const uint64_t slotHash = loadAcquire(&slot->hash);
+    if (slotHash == 0) return nullptr;
+    if (slotHash != hash) continue;
+
+    const uint32_t sequence = loadAcquire(&slot->sequence);
+    if (sequence & 1) continue; // a writer is updating it
+    *segmentNumber = loadRelaxed(&slot->segment);
+    *offset = loadRelaxed(&slot->offset);
+    *nBytes = loadRelaxed(&slot->nBytes);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (loadRelaxed(&slot->sequence) != sequence) continue; // ... and it just did
+
+    const Segment* s = segment(*segmentNumber, *offset + *nBytes);
+    RecordHeader recordHeader;
+    if (s && *nBytes >= sizeof(RecordHeader)) std::memcpy(&recordHeader, s->data + *offset, sizeof(recordHeader));
+    if (!s
+        || *nBytes < sizeof(RecordHeader)
+        || recordHeader.magic != RecordMagic
+        || sizeof(RecordHeader) + uint64_t(recordHeader.keyLength) + recordHeader.valueLength != *nBytes) {
+      // A lost segment or a corrupt record. Our key may still be further on.
+      if (badSlot && !*badSlot) *badSlot = slot;
+      continue;
+    }
+    const uint8_t* record = s->data + *offset;
+    if (recordHeader.keyLength != key.size() || std::memcmp(record + sizeof(RecordHeader), key.data(), key.size()) != 0) {
+      continue; // hash collision
+    }
+    // We don't check the CRC here: it would cost more than the lookup. put()
+    // syncs each record before publishing it, so only disk corruption could
+    // break it -- and compaction checks for that.
+    return slot;
+  }
+  return nullptr;
+}
+
+bool
+SegmentStore::get(const std::string& key, std::vector<uint8_t>* value)
+{
+  if (!enabled() || !ensureIndexIsCurrent()) return false;
+
+  uint32_t segmentNumber;
+  uint64_t offset;
+  uint32_t nBytes;
+  const uint64_t hash = hashKey(key);
+  Slot* slot = const_cast<Slot*>(findSlot(hash, key, &segmentNumber, &offset, &nBytes));
+  if (!slot) return false;
+
+  const uint8_t* valueBytes = segment(segmentNumber, offset + nBytes)->data + offset + sizeof(RecordHeader) + key.size();
+  value->assign(valueBytes, valueBytes + nBytes - sizeof(RecordHeader) - key.size());
+
+  // Racy, and that's fine: LRU only needs to be roughly right.
+  IndexHeader* header = reinterpret_cast<IndexHeader*>(indexData);
+  storeRelaxed(&slot->lastUsed, loadRelaxed(&header->clock));
+  return true;
+}
+
+void
+SegmentStore::put(const std::string& key, const std::vector<uint8_t>& value)
+{
+  if (!enabled()) return;
+
+  const uint64_t nBytes = sizeof(RecordHeader) + key.size() + value.size();
+  if (nBytes > MaxRecordBytes || nBytes > maxBytes / 2) return;
+
+  FileLock lock(lockFd);
+  if (!lock.ok() || !ensureIndexIsCurrent()) return;
+
+  IndexHeader* header = reinterpret_cast<IndexHeader*>(indexData);
+  if (header->nRecordBytes + nBytes > maxBytes) {
+    if (!compactLocked(header->nSlots)) return;
+    header = reinterpret_cast<IndexHeader*>(indexData);
+  }
+  if ((header->nUsedSlots + 1) * 4 > header->nSlots * 3) {
+    if (!compactLocked(header->nSlots * 2)) return;
+    header = reinterpret_cast<IndexHeader*>(indexData);
+  }
+
+  // Append the record
+  if (appendFd == -1 || appendSegment != header->currentSegment) {
+    if (appendFd != -1) close(appendFd);
+    appendSegment = header->currentSegment;
+    appendFd = open((directory + "/segment-" + std::to_string(appendSegment)).c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (appendFd == -1) return;
+  }
+  const off_t offset = lseek(appendFd, 0, SEEK_END); // we hold the lock: nobody else appends
+  if (offset == -1) return;
+
+  std::vector<uint8_t> record(nBytes);
+  const RecordHeader recordHeader = {
+    RecordMagic,
+    static_cast<uint32_t>(key.size()),
+    static_cast<uint32_t>(value.size()),
+    recordCrc(reinterpret_cast<const uint8_t*>(key.data()), key.size(), value.data(), value.size())
+  };
+  std::memcpy(&record[0], &recordHeader, sizeof(recordHeader));
+  std::memcpy(&record[sizeof(recordHeader)], key.data(), key.size());
+  if (!value.empty()) std::memcpy(&record[sizeof(recordHeader) + key.size()], value.data(), value.size());
+  // Sync before publishing, so that after a power cut the index never points
+  // at bytes that didn't reach the disk.
+  if (!writeAll(appendFd, record.data(), record.size()) || fdatasync(appendFd) != 0) return;
+
+  // Publish it: reuse the key's slot, or a slot with its hash whose record
+  // went bad, or take the first empty one.
+  const uint64_t hash = hashKey(key);
+  uint32_t oldSegment;
+  uint64_t oldOffset;
+  uint32_t oldNBytes;
+  const Slot* badSlot;
+  Slot* slot = const_cast<Slot*>(findSlot(hash, key, &oldSegment, &oldOffset, &oldNBytes, &badSlot));
+  if (!slot) slot = const_cast<Slot*>(badSlot);
+  const bool isNewSlot = !slot;
+  if (isNewSlot) {
+    Slot* slots = reinterpret_cast<Slot*>(indexData + sizeof(IndexHeader));
+    for (uint64_t i = 0; i < header->nSlots && !slot; i++) {
+      Slot* candidate = &slots[(hash + i) % header->nSlots];
+      if (candidate->hash == 0) slot = candidate;
+    }
+    if (!slot) return;
+    header->nUsedSlots++;
+  }
+
+  // We hold the lock, so nobody else writes the sequence. Odd tells readers
+  // to skip the slot; its hash stays set, so they probe past it rather than
+  // stopping there as they would at an empty slot.
+  const uint32_t clock = header->clock + 1;
+  const uint32_t sequence = slot->sequence;
+  storeRelaxed(&slot->sequence, sequence + 1);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  storeRelaxed(&slot->segment, appendSegment);
+  storeRelaxed(&slot->offset, static_cast<uint64_t>(offset));
+  storeRelaxed(&slot->nBytes, static_cast<uint32_t>(nBytes));
+  storeRelaxed(&slot->lastUsed, clock);
+  storeRelease(&slot->sequence, sequence + 2);
+  if (isNewSlot) storeRelease(&slot->hash, hash);
+
+  storeRelaxed(&header->clock, clock);
+  header->nRecordBytes += nBytes;
+}
+
+void
+SegmentStore::compact()
+{
+  if (!enabled()) return;
+
+  FileLock lock(lockFd);
+  if (!lock.ok() || !ensureIndexIsCurrent()) return;
+  compactLocked(reinterpret_cast<IndexHeader*>(indexData)->nSlots);
+}
+
+bool
+SegmentStore::compactLocked(uint64_t nSlots)
+{
+  const IndexHeader* oldHeader = reinterpret_cast<const IndexHeader*>(indexData);
+  const Slot* oldSlots = reinterpret_cast<const Slot*>(indexData + sizeof(IndexHeader));
+
+  // Most recently used first. (The clock may have wrapped: compare distances
+  // back from now.)
+  const uint32_t now = oldHeader->clock;
+  std::vector<Slot> live;
+  for (uint64_t i = 0; i < oldHeader->nSlots; i++) {
+    if (oldSlots[i].hash) live.push_back(oldSlots[i]);
+  }
+  std::sort(live.begin(), live.end(), [now](const Slot& a, const Slot& b) {
+    return uint32_t(now - a.lastUsed) < uint32_t(now - b.lastUsed);
+  });
+
+  const uint32_t newSegment = oldHeader->currentSegment + 1;
+  const std::string segmentPath(directory + "/segment-" + std::to_string(newSegment));
+  const int segmentFd = open(segmentPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (segmentFd == -1) return false;
+
+  const std::string indexPath(directory + "/index");
+  if (!createIndexFile(indexPath + ".tmp", nSlots, newSegment)) {
+    close(segmentFd);
+    return false;
+  }
+  const int newIndexFd = open((indexPath + ".tmp").c_str(), O_RDWR | O_CLOEXEC);
+  const size_t newIndexBytes = sizeof(IndexHeader) + nSlots * sizeof(Slot);
+  void* mapped = newIndexFd == -1 ? MAP_FAILED : mmap(nullptr, newIndexBytes, PROT_READ | PROT_WRITE, MAP_SHARED, newIndexFd, 0);
+  if (mapped == MAP_FAILED) {
+    if (newIndexFd != -1) close(newIndexFd);
+    close(segmentFd);
+    return false;
+  }
+  IndexHeader* newHeader = static_cast<IndexHeader*>(mapped);
+  Slot* newSlots = reinterpret_cast<Slot*>(static_cast<uint8_t*>(mapped) + sizeof(IndexHeader));
+
+  // Copy records, newest first, until we've kept half of maxBytes.
+  bool ok = true;
+  uint64_t nCopied = 0;
+  uint64_t nUsedSlots = 0;
+  for (const auto& slot : live) {
+    if (nCopied + slot.nBytes > maxBytes / 2) break;
+    const Segment* s = segment(slot.segment, slot.offset + slot.nBytes);
+    if (!s || slot.nBytes < sizeof(RecordHeader)) continue;
+
+    const uint8_t* record = s->data + slot.offset;
+    RecordHeader recordHeader;
+    std::memcpy(&recordHeader, record, sizeof(recordHeader));
+    const uint8_t* keyBytes = record + sizeof(RecordHeader);
+    if (recordHeader.magic != RecordMagic
+        || sizeof(RecordHeader) + uint64_t(recordHeader.keyLength) + recordHeader.valueLength != slot.nBytes
+        // the one place we check CRCs: drop entries the disk has corrupted
+        || recordCrc(keyBytes, recordHeader.keyLength, keyBytes + recordHeader.keyLength, recordHeader.valueLength) != recordHeader.crc) {
+      continue;
+    }
+
+    if (!writeAll(segmentFd, record, slot.nBytes)) {
+      ok = false;
+      break;
+    }
+
+    Slot newSlot(slot);
+    newSlot.segment = newSegment;
+    newSlot.offset = nCopied;
+    newSlot.sequence = 0;
+    for (uint64_t i = 0; i < nSlots; i++) {
+      Slot& candidate = newSlots[(slot.hash + i) % nSlots];
+      if (candidate.hash == 0) {
+        candidate = newSlot;
+        break;
+      }
+    }
+    nCopied += slot.nBytes;
+    nUsedSlots++;
+  }
+
+  newHeader->clock = now;
+  newHeader->nRecordBytes = nCopied;
+  newHeader->nUsedSlots = nUsedSlots;
+  munmap(mapped, newIndexBytes);
+  close(newIndexFd);
+  ok = ok && fdatasync(segmentFd) == 0;
+  ok = close(segmentFd) == 0 && ok;
+
+  if (!ok || rename((indexPath + ".tmp").c_str(), indexPath.c_str()) != 0) {
+    unlink((indexPath + ".tmp").c_str());
+    unlink(segmentPath.c_str());
+    return false;
+  }
+
+  // Tell other processes, then delete segments the new index doesn't use.
+  // (Processes that mapped them keep their mappings until they re-open.)
+  storeRelease(&reinterpret_cast<IndexHeader*>(indexData)->stale, uint32_t(1));
+  if (DIR* dir = opendir(directory.c_str())) {
+    while (struct dirent* dirent = readdir(dir)) {
+      const std::string name(dirent->d_name);
+      if (name.compare(0, 8, "segment-") == 0 && name != "segment-" + std::to_string(newSegment)) {
+        unlink((directory + "/" + name).c_str());
+      }
+    }
+    closedir(dir);
+  }
+
+  return ensureIndexIsCurrent();
+}
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * A key-value store in a directory: append-only segment files of records,
+ * and a memory-mapped hash index pointing into them. Many processes may use
+ * one directory at once.
+ *
+ * The page cache sees a lookup and an insert for nearly every page we
+ * convert, from many converters at once. A file per entry (see DiskCache)
+ * costs an open(), a read() and a utime per hit and a directory scan per
+ * eviction; here a hit is a few loads from shared memory and a memcpy.
+ *
+ * Layout:
+ *
+ * - "index": a header and an open-addressing table of slots. Each slot holds
+ *   a key's 64-bit hash and where its latest record is. Every process maps
+ *   it shared.
+ * - "segment-N": records, each a header, the key and the value. Only the
+ *   newest segment grows.
+ * - "lock": writers flock() it.
+ *
+ * Lookups take no lock. A slot can change while we read it, so each slot has
+ * a sequence number that put() makes odd while it writes, and we read slots
+ * seqlock-style (sequence, fields, sequence again). Then we check the
+ * record's header and key. A slot mid-write is a miss; a slot whose record
+ * is bad is skipped, and the next put() of its key reuses it.
+ *
+ * Inserts flock() the lock file, append the record to the newest segment with
+ * O_APPEND, fdatasync() it and then publish it in the index. A writer that
+ * crashes mid-append leaves bytes no slot points to. Each record carries a
+ * CRC-32, which compaction checks as it copies.
+ *
+ * Eviction is by compaction: when the segments outgrow maxBytes (or the index
+ * fills up), the inserting process copies the most recently used entries,
+ * up to half of maxBytes, into a new segment and a new index, renames the
+ * index into place and deletes the old segments. Other processes notice the
+ * old index's "stale" flag and re-open.
+ *
+ * Like DiskCache, errors read as misses or dropped inserts. Not thread-safe:
+ * use one SegmentStore per thread (or process).
+ */
+class SegmentStore {
+public:
+  /**
+   * Creates a store that does nothing: get() always misses.
+   */
+  SegmentStore();
+
+  /**
+   * Opens (or creates) the store in `directory`, holding at most about
+   * `maxBytes` of records.
+   */
+  SegmentStore(const std::string& directory, uint64_t maxBytes);
+
+  ~SegmentStore();
+
+  SegmentStore(const SegmentStore&) = delete;
+  SegmentStore& operator=(const SegmentStore&) = delete;
+
+  /**
+   * Returns the store configured by the environment: `prefix`_DIR (unset or
+   * empty means no store) and `prefix`_MAX_BYTES (default 1GB).
+   */
+  static SegmentStore& fromEnvironment(const std::string& prefix);
+
+  bool enabled() const { return !directory.empty(); }
+
+  /**
+   * Reads the value into `value` and returns true, or returns false on a miss.
+   */
+  bool get(const std::string& key, std::vector<uint8_t>* value);
+
+  /**
+   * Stores the value, replacing any existing one.
+   */
+  void put(const std::string& key, const std::vector<uint8_t>& value);
+
+  /**
+   * Compacts now, keeping the most recently used entries up to half of
+   * maxBytes. (put() calls this when needed; benchmarks call it directly.)
+   */
+  void compact();
+
+private:
+  struct IndexHeader;
+  struct Slot;
+  struct Segment {
+    uint32_t number;
+    int fd;
+    uint8_t* data;
+    size_t mappedBytes;
+  };
+
+  bool openIndex();
+  void closeIndex();
+  bool ensureIndexIsCurrent();
+  Segment* segment(uint32_t number, uint64_t minBytes);
+  void closeSegments();
+  const Slot* findSlot(uint64_t hash, const std::string& key, uint32_t* segmentNumber, uint64_t* offset, uint32_t* nBytes, const Slot** badSlot = nullptr);
+  bool compactLocked(uint64_t nSlots);
+
+  std::string directory;
+  uint64_t maxBytes;
+  int lockFd;
+  int appendFd; // the newest segment, for put()
+  uint32_t appendSegment;
+  int indexFd;
+  uint8_t* indexData;
+  size_t indexBytes;
+  std::vector<Segment> segments;
+};
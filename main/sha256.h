@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/**
+ * SHA-256 (FIPS 180-4), for fingerprinting content.
+ *
+ * We link statically against a handful of libraries, none of which has a
+ * hash we can call; this is small enough to carry.
+ *
+ * Usage:
+ *
+ *     Sha256 sha;
+ *     sha.update(bytes, nBytes); // as many times as you like
+ *     std::string hex = sha.hexDigest(); // 64 lowercase hex characters
+ */
+class Sha256 {
+public:
+  Sha256();
+
+  void update(const void* bytes, size_t nBytes);
+
+  /**
+   * Finishes the hash and returns it as hex. Call this once.
+   */
+  std::string hexDigest();
+
+private:
+  void processBlock(const uint8_t* block);
+
+  uint32_t state[8];
+  uint64_t nBytesTotal;
+  uint8_t buffer[64];
+  size_t nBuffered;
+};
@@ -1,7 +1,10 @@
+#include <algorithm>
 #include <iostream>
+#include <cstdio>
 #include <cstdlib>
 #include <memory>
 #include <string>
+#include <vector>
 
 #include "public/cpp/fpdf_deleters.h"
 #include "public/fpdfview.h"
@@ -11,53 +14,91 @@
 #include "public/fpdf_text.h"
 #include "lodepng.h"
 
+#include "page-fingerprint.h"
+#include "pdf-file.h"
+#include "result-cache.h"
 #include "util.h"
 #include "json.hpp"
 
 using json = nlohmann::json;
 
-class StdoutWrite : public FPDF_FILEWRITE {
+/**
+ * A page's PDF, held until we output it after the page's thumbnail and text.
+ *
+ * Most pages' PDFs are a few kilobytes. A page with a big scan can take tens
+ * of megabytes: past MaxMemoryBytes we move the PDF to a temporary file, so
+ * memory stays bounded.
+ */
+class PageBlob {
 public:
-  StdoutWrite() {
-    FPDF_FILEWRITE::version = 1;
-    FPDF_FILEWRITE::WriteBlock = WriteBlockCallback;
+  PageBlob(const std::string& mimeBoundary) : file(nullptr), nFileBytes(0), mimeBoundary(mimeBoundary) {}
+  ~PageBlob() { if (file) std::fclose(file); }
+  PageBlob(const PageBlob&) = delete;
+  PageBlob& operator=(const PageBlob&) = delete;
+
+  void clear() {
+    bytes.clear();
+    nFileBytes = 0;
   }
 
-  static int WriteBlockCallback(FPDF_FILEWRITE* pFileWrite, const void* data, unsigned long size) {
-    outputBytes(reinterpret_cast<const uint8_t*>(data), size); // or crash!
-    return size; // non-zero
+  void write(const uint8_t* data, size_t nBytes) {
+    if (nFileBytes == 0 && bytes.size() + nBytes <= MaxMemoryBytes) {
+      bytes.insert(bytes.end(), data, data + nBytes);
+      return;
+    }
+
+    if (nFileBytes == 0) {
+      if (!file) file = std::tmpfile();
+      if (!file || std::fseek(file, 0, SEEK_SET) != 0) {
+        outputErrorAndExit("Failed to open temporary file for page PDF", mimeBoundary);
+      }
+      writeToFile(bytes.data(), bytes.size());
+      bytes.clear();
+    }
+    writeToFile(data, nBytes);
   }
-};
 
-/**
- * Outputs the page as an entire PDF.
- */
-static void
-outputPageBlobFragment(
-    FPDF_DOCUMENT fDocument,
-    FPDF_PAGE fPage,
-    int pageIndex,
-    const std::string& mimeBoundary
-)
-{
-  outputFragmentPrefix(std::to_string(pageIndex) + ".blob", mimeBoundary);
+  void outputFragment(const std::string& name) {
+    outputFragmentPrefix(name, mimeBoundary);
+    if (nFileBytes == 0) {
+      outputBytes(bytes);
+      return;
+    }
 
-  std::unique_ptr<void, FPDFDocumentDeleter> outDocument(FPDF_CreateNewDocument());
-  std::string pageIndexString = std::to_string(pageIndex + 1);
-  if (!FPDF_ImportPages(outDocument.get(), fDocument, pageIndexString.c_str(), 0)) {
-    outputErrorAndExit(std::string("Error outputting page with index ") + std::to_string(pageIndex) + ": " + formatLastPdfiumError(), mimeBoundary);
-    return;
+    if (std::fflush(file) != 0 || std::fseek(file, 0, SEEK_SET) != 0) {
+      outputErrorAndExit("Failed to read temporary file for page PDF", mimeBoundary);
+    }
+    uint8_t buf[64 * 1024];
+    for (size_t remaining = nFileBytes; remaining > 0; ) {
+      const size_t n = std::fread(buf, 1, std::min(remaining, sizeof(buf)), file);
+      if (n == 0) outputErrorAndExit("Failed to read temporary file for page PDF", mimeBoundary);
+      outputBytes(buf, n);
+      remaining -= n;
+    }
   }
 
-  StdoutWrite write;
-  FPDF_SaveAsCopy(outDocument.get(), &write, FPDF_REMOVE_SECURITY);
-}
+private:
+  static const size_t MaxMemoryBytes = 16 * 1024 * 1024;
+
+  void writeToFile(const uint8_t* data, size_t nBytes) {
+    if (std::fwrite(data, 1, nBytes, file) != nBytes) {
+      outputErrorAndExit("Failed to write temporary file for page PDF", mimeBoundary);
+    }
+    nFileBytes += nBytes;
+  }
+
+  std::vector<uint8_t> bytes;
+  FILE* file;
+  size_t nFileBytes;
+  const std::string& mimeBoundary;
+};
 
 static void
 splitAndExtractPdf(
     const char* filename,
     const std::string& mimeBoundary,
-    const std::string& jsonTemplate
+    const std::string& jsonTemplate,
+    const Options& options
 )
 {
   FPDF_STRING fFilename(filename);
@@ -66,11 +107,14 @@ splitAndExtractPdf(
     outputErrorAndExit(std::string("Failed to open PDF: ") + formatLastPdfiumError(), mimeBoundary);
     return;
   }
+  pdfFile().open(filename, fDocument.get());
 
-  json pageJson = json::parse(jsonTemplate);
-  addDocumentMetadataFromPdf(pageJson["metadata"], fDocument.get());
+  const json templateJson = json::parse(jsonTemplate);
+  json pdfMetadata = json::object();
+  addDocumentMetadataFromPdf(pdfMetadata, fDocument.get());
 
   const int nPages = FPDF_GetPageCount(fDocument.get());
+  PageBlob pageBlob(mimeBoundary);
 
   for (int pageIndex = 0; pageIndex < nPages; ++pageIndex) {
     // in-between: progress (should come immediately before JSON)
@@ -84,39 +128,53 @@ splitAndExtractPdf(
     }
 
     // 1. JSON (must come first)
-    pageJson["metadata"]["pageNumber"] = pageIndex + 1;
+    const json patch = { { "metadata", { { "pageNumber", pageIndex + 1 } } } };
     const std::string jsonName(std::to_string(pageIndex) + ".json");
-    outputFragment(jsonName, pageJson.dump(), mimeBoundary);
+    outputJsonFragment(jsonName, templateJson, pdfMetadata, patch, mimeBoundary);
 
-    // 2. Thumbnail
-    outputPageThumbnailFragmentOrErrorAndExit(fPage.get(), pageIndex, mimeBoundary);
+    // 2. Thumbnail. Form letters and slide decks repeat pages: we write the
+    // blob first, and reuse an earlier page's thumbnail if the blobs match.
+    pageBlob.clear();
+    const std::string fingerprint(writePageBlobOrOutputErrorAndExit(fDocument.get(), pageIndex, [&pageBlob](const uint8_t* bytes, size_t nBytes) {
+      pageBlob.write(bytes, nBytes);
+    }, mimeBoundary));
+    outputPageThumbnailFragmentOrErrorAndExit(fPage.get(), pageIndex, fingerprint, options, mimeBoundary);
 
     // 3. Text
-    outputPageTextFragmentOrErrorAndExit(fPage.get(), pageIndex, mimeBoundary);
+    outputPageTextFragmentOrErrorAndExit(fPage.get(), pageIndex, fingerprint, mimeBoundary);
 
     // 4. Blob
-    outputPageBlobFragment(fDocument.get(), fPage.get(), pageIndex, mimeBoundary);
+    pageBlob.outputFragment(std::to_string(pageIndex) + ".blob");
   }
 }
 
 int
 main(int argc, char** argv)
 {
-  if (argc != 3) {
-    std::cerr << "Usage: " << argv[0] << " MIME-BOUNDARY JSON-TEMPLATE" << std::endl
+  if (argc != 3 && argc != 4) {
+    std::cerr << "Usage: " << argv[0] << " MIME-BOUNDARY JSON-TEMPLATE [OPTIONS-JSON]" << std::endl
               << std::endl
               << "JSON-TEMPLATE will be emitted for each page; its metadata.pageNumber will "
-              << "be a page number starting with 1." << std::endl;
+              << "be a page number starting with 1." << std::endl
+              << "OPTIONS-JSON may set \"thumbnailQuality\", \"thumbnailSize\"," << std::endl
+              << "\"extraThumbnailSizes\", \"pngCompressionLevel\" and" << std::endl
+              << "\"thumbnailFormat\"." << std::endl;
 
     return 1;
   }
 
   const std::string mimeBoundary(argv[1]);
   const std::string jsonTemplate(argv[2]);
+  const std::string optionsJson(argc == 4 ? argv[3] : "{}");
+  const Options options(parseOptionsOrOutputErrorAndExit(optionsJson, mimeBoundary));
+
+  // A document we've converted before needs no PDFium at all.
+  const std::string resultKey(resultCacheKey("split-and-extract-pdf", optionsJson, "input.blob"));
+  replayCachedResultOrStartRecording(resultKey, json::parse(jsonTemplate), mimeBoundary);
 
   FPDF_InitLibrary();
 
-  splitAndExtractPdf("input.blob", mimeBoundary, jsonTemplate);
+  splitAndExtractPdf("input.blob", mimeBoundary, jsonTemplate, options);
 
   outputDoneAndExit(mimeBoundary);
 
@@ -0,0 +1,128 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "png-filter.h"
+
+/**
+ * Tests filterPngRow()'s SSE2 and AVX2 filters against its portable one: the
+ * same filtered bytes and the same choice of filter, for every row length
+ * around the vector widths and both pixel sizes. Exits non-zero on failure.
+ *
+ * Our Python tests only run whichever filter the CPU picks.
+ */
+
+static int nFailures = 0;
+
+#define EXPECT(condition) \
+  do { \
+    if (!(condition)) { \
+      std::fprintf(stderr, "%s:%d: %s: expected %s\n", __FILE__, __LINE__, __func__, #condition); \
+      nFailures++; \
+    } \
+  } while (0)
+
+/**
+ * Returns bytes that exercise every filter: random bytes, runs, and extremes
+ * (0 and 255 side by side overflow careless Average and Paeth arithmetic).
+ */
+static std::vector<uint8_t>
+makeRow(size_t nBytes, uint32_t seed)
+{
+  std::vector<uint8_t> row(nBytes);
+  uint32_t random = seed;
+  for (size_t i = 0; i < nBytes; i++) {
+    random = random * 1103515245 + 12345;
+    switch ((random >> 28) % 4) {
+      case 0: row[i] = static_cast<uint8_t>(random >> 16); break;
+      case 1: row[i] = i ? row[i - 1] : 0; break;
+      case 2: row[i] = (random >> 20) & 1 ? 255 : 0; break;
+      default: row[i] = static_cast<uint8_t>(i * 7); break;
+    }
+  }
+  return row;
+}
+
+struct FilteredRow {
+  PngFilterType type;
+  std::vector<uint8_t> bytes; // all five filters' rows, one after another
+};
+
+static FilteredRow
+filterRow(const std::vector<uint8_t>& row, const std::vector<uint8_t>& previousRow, int bytesPerPixel)
+{
+  FilteredRow result;
+  result.bytes.resize(NPngFilterTypes * (1 + row.size()));
+  uint8_t* filtered[NPngFilterTypes];
+  for (int type = 0; type < NPngFilterTypes; type++) {
+    filtered[type] = &result.bytes[type * (1 + row.size())];
+  }
+  result.type = filterPngRow(row.data(), previousRow.data(), row.size(), bytesPerPixel, filtered);
+  return result;
+}
+
+static void
+testImplementation(const char* name, PngFilterImplementation implementation)
+{
+  if (!usePngFilterImplementation(implementation)) {
+    std::printf("test-png-filter: skipping %s: this CPU can't run it\n", name);
+    return;
+  }
+
+  for (int bytesPerPixel : { 1, 3 }) {
+    for (size_t nBytes = 0; nBytes <= 100; nBytes++) {
+      for (uint32_t seed = 1; seed <= 20; seed++) {
+        const std::vector<uint8_t> row(makeRow(nBytes, seed));
+        const std::vector<uint8_t> previousRow(makeRow(nBytes, seed + 1000));
+
+        usePngFilterImplementation(PngFilterImplementationPortable);
+        const FilteredRow expect(filterRow(row, previousRow, bytesPerPixel));
+        usePngFilterImplementation(implementation);
+        const FilteredRow actual(filterRow(row, previousRow, bytesPerPixel));
+
+        if (actual.type != expect.type || actual.bytes != expect.bytes) {
+          std::fprintf(stderr, "%s: %d bytes per pixel, %zu-byte row, seed %u: differs from portable filter\n", name, bytesPerPixel, nBytes, seed);
+          nFailures++;
+        }
+      }
+    }
+  }
+}
+
+/**
+ * choosePngFilters() picks the filters filterPngRow() does, row by row.
+ */
+static void
+testChoosePngFilters()
+{
+  usePngFilterImplementation(PngFilterImplementationBest);
+  const size_t width = 37, height = 9;
+  const std::vector<uint8_t> pixels(makeRow(width * height * 3, 42));
+  std::vector<uint8_t> filters;
+  choosePngFilters(pixels.data(), width, height, 3, &filters);
+  EXPECT(filters.size() == height);
+
+  std::vector<uint8_t> previousRow(width * 3, 0);
+  for (size_t y = 0; y < height && y < filters.size(); y++) {
+    const std::vector<uint8_t> row(&pixels[y * width * 3], &pixels[(y + 1) * width * 3]);
+    EXPECT(filters[y] == filterRow(row, previousRow, 3).type);
+    previousRow = row;
+  }
+}
+
+int
+main()
+{
+  testImplementation("SSE2", PngFilterImplementationSse2);
+  testImplementation("AVX2", PngFilterImplementationAvx2);
+  testImplementation("best", PngFilterImplementationBest);
+  testChoosePngFilters();
+
+  if (nFailures) {
+    std::fprintf(stderr, "test-png-filter: %d failures\n", nFailures);
+    return 1;
+  }
+  std::printf("test-png-filter: ok\n");
+  return 0;
+}
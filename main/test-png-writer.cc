@@ -0,0 +1,224 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "lodepng.h"
+
+#include "parallel-deflate.h"
+#include "pixel-analysis.h"
+#include "png-encode.h"
+#include "png-writer.h"
+
+/**
+ * Tests PngWriter, which streams our thumbnails, and the ParallelDeflater it
+ * deflates with: images decode to the pixels we wrote, in every color mode,
+ * and match what lodepng writes from the same pixels. Exits non-zero on
+ * failure.
+ */
+
+static int nFailures = 0;
+
+#define EXPECT(condition) \
+  do { \
+    if (!(condition)) { \
+      std::fprintf(stderr, "%s:%d: %s: expected %s\n", __FILE__, __LINE__, __func__, #condition); \
+      nFailures++; \
+    } \
+  } while (0)
+
+/**
+ * Makes an image like a thumbnail: white, with runs of `nColors` colors
+ * (gray if bytesPerPixel is 1) and, if `noisy`, pixels a deflater can't
+ * predict, like a photo's.
+ */
+static std::vector<uint8_t>
+makePixels(size_t width, size_t height, int bytesPerPixel, int nColors, bool noisy)
+{
+  std::vector<uint8_t> pixels(width * height * bytesPerPixel, 0xff);
+  uint32_t random = 12345;
+  for (size_t y = 0; y < height; y++) {
+    for (size_t x = 0; x < width; x++) {
+      random = random * 1103515245 + 12345;
+      uint8_t* p = &pixels[(y * width + x) * bytesPerPixel];
+      if (noisy) {
+        for (int c = 0; c < bytesPerPixel; c++) p[c] = static_cast<uint8_t>((x + y + (random >> (16 + c * 4))) & 0xff);
+      } else if ((x / 7 + y / 3) % 5 == 0) {
+        const int color = static_cast<int>((x / 7 + y) % nColors);
+        for (int c = 0; c < bytesPerPixel; c++) p[c] = static_cast<uint8_t>(255 * color / std::max(1, nColors - 1) ^ (c * 0x55));
+      }
+    }
+  }
+  return pixels;
+}
+
+static std::vector<uint8_t>
+writeWithPngWriter(const std::vector<uint8_t>& pixels, size_t width, size_t height, int bytesPerPixel, const PngColorMode& mode, int level)
+{
+  std::vector<uint8_t> png;
+  PngWriter writer(width, height, bytesPerPixel, mode, level, [&png](const uint8_t* bytes, size_t nBytes) {
+    png.insert(png.end(), bytes, bytes + nBytes);
+  });
+  EXPECT(writer.ok());
+  for (size_t y = 0; y < height; y++) {
+    EXPECT(writer.writeRow(&pixels[y * width * bytesPerPixel]));
+  }
+  EXPECT(writer.finish());
+  return png;
+}
+
+/**
+ * Returns the concatenated IDAT data: the zlib stream.
+ */
+static std::vector<uint8_t>
+idatData(const std::vector<uint8_t>& png)
+{
+  std::vector<uint8_t> zlib;
+  for (size_t pos = 8; pos + 12 <= png.size(); ) {
+    const size_t length = (size_t(png[pos]) << 24) | (png[pos + 1] << 16) | (png[pos + 2] << 8) | png[pos + 3];
+    if (std::memcmp(&png[pos + 4], "IDAT", 4) == 0) zlib.insert(zlib.end(), &png[pos + 8], &png[pos + 8] + length);
+    pos += 12 + length;
+  }
+  return zlib;
+}
+
+static void
+testImage(const char* name, size_t width, size_t height, int bytesPerPixel, int nColors, bool noisy)
+{
+  const std::vector<uint8_t> pixels(makePixels(width, height, bytesPerPixel, nColors, noisy));
+  PixelAnalysis analysis;
+  analyzePixels(&pixels[0], width, height, bytesPerPixel, &analysis);
+  const PngColorMode mode(PngColorMode::smallest(analysis, bytesPerPixel, width * height));
+
+  for (int level : { 1, 9 }) {
+    const std::vector<uint8_t> png(writeWithPngWriter(pixels, width, height, bytesPerPixel, mode, level));
+
+    // It decodes to our pixels
+    std::vector<unsigned char> decoded;
+    unsigned decodedWidth, decodedHeight;
+    const LodePNGColorType colorType = bytesPerPixel == 1 ? LCT_GREY : LCT_RGB;
+    const unsigned err = lodepng::decode(decoded, decodedWidth, decodedHeight, png, colorType, 8);
+    if (err) std::fprintf(stderr, "%s: %s\n", name, lodepng_error_text(err));
+    EXPECT(err == 0);
+    EXPECT(decodedWidth == width && decodedHeight == height);
+    EXPECT(decoded.size() == pixels.size() && std::memcmp(&decoded[0], &pixels[0], pixels.size()) == 0);
+
+    // lodepng with our filters and parallelZlibCompress() writes the same
+    // zlib stream (in one IDAT chunk, where we write 64kb chunks)
+    std::vector<uint8_t> lodepngPng;
+    EXPECT(encodeSmallestPng(&pixels[0], width, height, bytesPerPixel, analysis, level, &lodepngPng));
+    if (idatData(png) != idatData(lodepngPng)) {
+      std::fprintf(stderr, "%s: level %d: zlib stream differs from lodepng's\n", name, level);
+      nFailures++;
+    }
+  }
+}
+
+static void
+testColorModes()
+{
+  testImage("1-bit gray", 700, 700, 1, 2, false);
+  testImage("4-color palette from gray", 700, 700, 1, 3, false);
+  testImage("8-bit gray", 700, 700, 1, 0, true);
+  testImage("palette", 541, 700, 3, 20, false);
+  testImage("RGB", 700, 541, 3, 0, true);
+  testImage("one pixel", 1, 1, 3, 1, false);
+  testImage("one odd row", 13, 1, 1, 2, false);
+}
+
+static void
+testTooManyOrTooFewRows()
+{
+  const std::vector<uint8_t> row(30, 0x80);
+  PngWriter tooFew(10, 2, 3, PngColorMode(3), 1, [](const uint8_t*, size_t) {});
+  EXPECT(tooFew.writeRow(&row[0]));
+  EXPECT(!tooFew.finish());
+
+  PngWriter tooMany(10, 1, 3, PngColorMode(3), 1, [](const uint8_t*, size_t) {});
+  EXPECT(tooMany.writeRow(&row[0]));
+  EXPECT(!tooMany.writeRow(&row[0]));
+}
+
+/**
+ * ParallelDeflater's output depends only on its input and level: not on its
+ * thread count or how callers split their writes.
+ */
+static void
+testDeflaterIsDeterministic()
+{
+  const std::vector<uint8_t> input(makePixels(1000, 1000, 1, 0, true));
+  std::vector<uint8_t> expect;
+  for (size_t nThreads : { 1, 2, 3, 8 }) {
+    for (size_t pieceBytes : { size_t(1) << 20, size_t(2101), size_t(7) }) {
+      std::vector<uint8_t> zlib;
+      ParallelDeflater deflater(6, [&zlib](const uint8_t* bytes, size_t nBytes) { zlib.insert(zlib.end(), bytes, bytes + nBytes); }, nThreads);
+      EXPECT(deflater.ok());
+      for (size_t i = 0; i < input.size(); i += pieceBytes) {
+        deflater.write(&input[i], std::min(pieceBytes, input.size() - i));
+      }
+      EXPECT(deflater.finish());
+
+      if (expect.empty()) {
+        expect = zlib;
+        std::vector<unsigned char> inflated;
+        EXPECT(lodepng::decompress(inflated, &zlib[0], zlib.size()) == 0 && inflated.size() == input.size());
+        EXPECT(std::memcmp(&inflated[0], &input[0], input.size()) == 0);
+      }
+      if (zlib != expect) {
+        std::fprintf(stderr, "ParallelDeflater: %zu threads, %zu-byte writes: output differs\n", nThreads, pieceBytes);
+        nFailures++;
+      }
+    }
+  }
+}
+
+static std::vector<uint8_t>
+deflateAll(const std::vector<uint8_t>& input, int level, size_t nThreads, DeflateScratch* scratch)
+{
+  std::vector<uint8_t> zlib;
+  ParallelDeflater deflater(level, [&zlib](const uint8_t* bytes, size_t nBytes) { zlib.insert(zlib.end(), bytes, bytes + nBytes); }, nThreads, scratch);
+  EXPECT(deflater.ok());
+  EXPECT(deflater.write(input.data(), input.size()));
+  EXPECT(deflater.finish());
+  return zlib;
+}
+
+/**
+ * A DeflateScratch reused across images -- bigger and smaller, at other
+ * levels and thread counts -- gives the output a fresh one does.
+ */
+static void
+testDeflateScratchIsReusable()
+{
+  DeflateScratch scratch;
+  for (int round = 0; round < 2; round++) {
+    for (int level : { 9, 1, 6 }) {
+      for (size_t nThreads : { 4, 1, 8 }) {
+        for (size_t size : { 700, 1500 }) {
+          const std::vector<uint8_t> input(makePixels(size, size, 1, 0, true));
+          if (deflateAll(input, level, nThreads, &scratch) != deflateAll(input, level, nThreads, nullptr)) {
+            std::fprintf(stderr, "DeflateScratch: level %d, %zu threads, %zux%zu: output differs\n", level, nThreads, size, size);
+            nFailures++;
+          }
+        }
+      }
+    }
+  }
+}
+
+int
+main()
+{
+  testColorModes();
+  testTooManyOrTooFewRows();
+  testDeflaterIsDeterministic();
+  testDeflateScratchIsReusable();
+
+  if (nFailures) {
+    std::fprintf(stderr, "test-png-writer: %d failures\n", nFailures);
+    return 1;
+  }
+  std::printf("test-png-writer: ok\n");
+  return 0;
+}
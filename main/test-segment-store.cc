@@ -0,0 +1,238 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "segment-store.h"
+
+/**
+ * Tests SegmentStore against a scratch directory: round trips, overwrites,
+ * probe chains and corrupt records. Exits non-zero on failure.
+ *
+ * Our Python tests drive whole conversions, which can't reach these cases.
+ */
+
+static int nFailures = 0;
+
+#define EXPECT(condition) \
+  do { \
+    if (!(condition)) { \
+      std::fprintf(stderr, "%s:%d: %s: expected %s\n", __FILE__, __LINE__, __func__, #condition); \
+      nFailures++; \
+    } \
+  } while (0)
+
+static std::vector<uint8_t>
+bytes(const std::string& s)
+{
+  return std::vector<uint8_t>(s.begin(), s.end());
+}
+
+static std::string
+get(SegmentStore& store, const std::string& key)
+{
+  std::vector<uint8_t> value;
+  if (!store.get(key, &value)) return "(miss)";
+  return std::string(value.begin(), value.end());
+}
+
+static std::string
+makeDirectory()
+{
+  char path[] = "/tmp/test-segment-store-XXXXXX";
+  if (!mkdtemp(path)) {
+    std::perror("mkdtemp");
+    std::exit(1);
+  }
+  return path;
+}
+
+static void
+removeDirectory(const std::string& directory)
+{
+  const std::string command("rm -rf '" + directory + "'");
+  if (std::system(command.c_str()) != 0) std::perror("rm");
+}
+
+/**
+ * Reads the index header's nUsedSlots (see SegmentStore::IndexHeader).
+ */
+static uint64_t
+nUsedSlots(const std::string& directory)
+{
+  uint64_t n = 0;
+  const int fd = open((directory + "/index").c_str(), O_RDONLY);
+  if (fd == -1 || pread(fd, &n, sizeof(n), 32) != sizeof(n)) n = UINT64_MAX;
+  if (fd != -1) close(fd);
+  return n;
+}
+
+/**
+ * Overwrites the magic of the record at `offset` in segment 0, as disk
+ * corruption would. (Each record is a 16-byte header, the key and the value.)
+ */
+static void
+corruptRecord(const std::string& directory, off_t offset)
+{
+  const uint32_t garbage = 0xdeadbeef;
+  const int fd = open((directory + "/segment-0").c_str(), O_WRONLY);
+  if (fd == -1 || pwrite(fd, &garbage, sizeof(garbage), offset) != sizeof(garbage)) {
+    std::perror("corruptRecord");
+    std::exit(1);
+  }
+  close(fd);
+}
+
+/**
+ * Returns keys that all land in the same index slot, so each probes past the
+ * ones before it. Mirrors hashKey() in segment-store.cc and the index's 64k
+ * initial slots.
+ */
+static std::vector<std::string>
+collidingKeys(size_t n)
+{
+  std::vector<std::string> keys;
+  uint64_t wantBucket = 0;
+  for (int i = 0; keys.size() < n; i++) {
+    const std::string key("key-" + std::to_string(i));
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (unsigned char c : key) hash = (hash ^ c) * 0x100000001b3ULL;
+    const uint64_t bucket = hash % (64 * 1024);
+    if (keys.empty()) wantBucket = bucket;
+    if (bucket == wantBucket) keys.push_back(key);
+  }
+  return keys;
+}
+
+static void
+testDisabledStoreMisses()
+{
+  SegmentStore store;
+  store.put("a", bytes("1"));
+  EXPECT(!store.enabled());
+  EXPECT(get(store, "a") == "(miss)");
+}
+
+static void
+testRoundTrip()
+{
+  const std::string directory(makeDirectory());
+  {
+    SegmentStore store(directory, 1024 * 1024);
+    EXPECT(get(store, "a") == "(miss)");
+    store.put("a", bytes("apple"));
+    store.put("b", bytes("banana"));
+    store.put("empty", bytes(""));
+    EXPECT(get(store, "a") == "apple");
+    EXPECT(get(store, "b") == "banana");
+    EXPECT(get(store, "empty") == "");
+    EXPECT(get(store, "c") == "(miss)");
+  }
+  {
+    // Another process's view
+    SegmentStore store(directory, 1024 * 1024);
+    EXPECT(get(store, "a") == "apple");
+    EXPECT(get(store, "b") == "banana");
+  }
+  removeDirectory(directory);
+}
+
+static void
+testOverwrite()
+{
+  const std::string directory(makeDirectory());
+  SegmentStore writer(directory, 1024 * 1024);
+  SegmentStore reader(directory, 1024 * 1024);
+  writer.put("a", bytes("first"));
+  EXPECT(get(reader, "a") == "first");
+  writer.put("a", bytes("second, longer"));
+  EXPECT(get(writer, "a") == "second, longer");
+  EXPECT(get(reader, "a") == "second, longer");
+  EXPECT(nUsedSlots(directory) == 1);
+  removeDirectory(directory);
+}
+
+static void
+testCollisionChain()
+{
+  const std::string directory(makeDirectory());
+  const std::vector<std::string> keys(collidingKeys(4));
+  SegmentStore store(directory, 1024 * 1024);
+  for (const auto& key : keys) store.put(key, bytes("value of " + key));
+  for (const auto& key : keys) EXPECT(get(store, key) == "value of " + key);
+
+  // Overwriting one in the middle of the chain leaves the rest alone.
+  store.put(keys[1], bytes("new"));
+  EXPECT(get(store, keys[0]) == "value of " + keys[0]);
+  EXPECT(get(store, keys[1]) == "new");
+  EXPECT(get(store, keys[2]) == "value of " + keys[2]);
+  EXPECT(get(store, keys[3]) == "value of " + keys[3]);
+  EXPECT(nUsedSlots(directory) == keys.size());
+  removeDirectory(directory);
+}
+
+static void
+testCorruptRecord()
+{
+  const std::string directory(makeDirectory());
+  const std::vector<std::string> keys(collidingKeys(3));
+  SegmentStore store(directory, 1024 * 1024);
+  for (const auto& key : keys) store.put(key, bytes("value of " + key));
+
+  // The first record in the chain goes bad: it misses, and lookups of the
+  // keys behind it still probe past it.
+  corruptRecord(directory, 0);
+  EXPECT(get(store, keys[0]) == "(miss)");
+  EXPECT(get(store, keys[1]) == "value of " + keys[1]);
+  EXPECT(get(store, keys[2]) == "value of " + keys[2]);
+
+  // Putting it again reuses its slot rather than taking a new one.
+  store.put(keys[0], bytes("restored"));
+  EXPECT(get(store, keys[0]) == "restored");
+  EXPECT(get(store, keys[1]) == "value of " + keys[1]);
+  EXPECT(nUsedSlots(directory) == keys.size());
+
+  // Compaction drops corrupt records and keeps good ones.
+  const off_t keys2Offset = 2 * 16 + keys[0].size() + keys[1].size() + ("value of " + keys[0]).size() + ("value of " + keys[1]).size();
+  corruptRecord(directory, keys2Offset);
+  store.compact();
+  EXPECT(get(store, keys[0]) == "restored");
+  EXPECT(get(store, keys[1]) == "value of " + keys[1]);
+  EXPECT(get(store, keys[2]) == "(miss)");
+  EXPECT(nUsedSlots(directory) == 2);
+  removeDirectory(directory);
+}
+
+static void
+testCompactionEvictsLeastRecentlyUsed()
+{
+  const std::string directory(makeDirectory());
+  const std::vector<uint8_t> value(1000, 'x');
+  SegmentStore store(directory, 10 * 1000);
+  for (int i = 0; i < 20; i++) store.put("key-" + std::to_string(i), value);
+  EXPECT(get(store, "key-0") == "(miss)");
+  EXPECT(get(store, "key-19") == std::string(value.begin(), value.end()));
+  removeDirectory(directory);
+}
+
+int
+main()
+{
+  testDisabledStoreMisses();
+  testRoundTrip();
+  testOverwrite();
+  testCollisionChain();
+  testCorruptRecord();
+  testCompactionEvictsLeastRecentlyUsed();
+
+  if (nFailures) {
+    std::fprintf(stderr, "test-segment-store: %d failures\n", nFailures);
+    return 1;
+  }
+  std::printf("test-segment-store: ok\n");
+  return 0;
+}
@@ -0,0 +1,88 @@
+#include <algorithm>
+#include <cmath>
+#include <new>
+
+#include "pixel-analysis.h"
+#include "png-encode.h"
+#include "thumbnail-sprite.h"
+#include "util.h"
+
+ThumbnailSprite::ThumbnailSprite(FPDF_DOCUMENT document, int nPages, const Options& options)
+  : width(0), height(0), flags(renderFlagsForTier(options.renderTier)),
+    compressionLevel(options.pngCompressionLevel)
+{
+  const int nTiles = std::min(nPages, options.thumbnailSpritePages);
+  if (nTiles <= 0) return;
+
+  // As square as we can make it: ceil(sqrt(n)) columns.
+  const int columns = static_cast<int>(std::ceil(std::sqrt(static_cast<double>(nTiles))));
+  const int rows = (nTiles + columns - 1) / columns;
+  width = columns * TileDimension;
+  height = rows * TileDimension;
+
+  for (int i = 0; i < nTiles; i++) {
+    double pageWidth = 0, pageHeight = 0;
+    FPDF_GetPageSizeByIndex(document, i, &pageWidth, &pageHeight);
+
+    Tile tile = { (i % columns) * TileDimension, (i / columns) * TileDimension, TileDimension, TileDimension };
+    if (pageWidth > pageHeight) {
+      tile.height = std::max(1, static_cast<int>(std::round(TileDimension * pageHeight / pageWidth)));
+    } else if (pageHeight > 0) {
+      tile.width = std::max(1, static_cast<int>(std::round(TileDimension * pageWidth / pageHeight)));
+    }
+    tiles.push_back(tile);
+  }
+}
+
+nlohmann::json
+ThumbnailSprite::layoutJson() const
+{
+  nlohmann::json pages = nlohmann::json::array();
+  for (const auto& tile : tiles) {
+    pages.push_back({ { "x", tile.x }, { "y", tile.y }, { "width", tile.width }, { "height", tile.height } });
+  }
+  return { { "width", width }, { "height", height }, { "pages", pages } };
+}
+
+void
+ThumbnailSprite::renderPageOrOutputErrorAndExit(FPDF_PAGE page, int pageIndex, const std::string& mimeBoundary)
+{
+  if (pageIndex >= static_cast<int>(tiles.size())) return;
+
+  if (pixels.empty()) {
+    try {
+      pixels.assign(3 * width * height, 0xff);
+    } catch (const std::bad_alloc&) {
+      outputErrorAndExit("out of memory when creating thumbnail sprite", mimeBoundary);
+      return;
+    }
+  }
+
+  // PDFium renders straight into the sprite: the tile's bitmap starts at its
+  // top-left pixel and has the sprite's stride.
+  const Tile& tile(tiles[pageIndex]);
+  const int stride = 3 * width;
+  uint8_t* firstPixel = &pixels[tile.y * stride + 3 * tile.x];
+  FPDF_BITMAP bitmap = FPDFBitmap_CreateEx(tile.width, tile.height, FPDFBitmap_BGR, firstPixel, stride);
+  if (!bitmap) {
+    outputErrorAndExit("unknown error while creating thumbnail sprite", mimeBoundary);
+    return;
+  }
+
+  FPDF_RenderPageBitmap(bitmap, page, 0, 0, tile.width, tile.height, 0, flags | FPDF_REVERSE_BYTE_ORDER);
+  FPDFBitmap_Destroy(bitmap);
+}
+
+std::vector<uint8_t>
+ThumbnailSprite::encodePng()
+{
+  std::vector<uint8_t> png;
+  if (pixels.empty()) return png;
+
+  // The census picks the PNG's color mode: most documents' sprites fit a
+  // small gray or palette PNG.
+  PixelAnalysis analysis;
+  analyzePixels(&pixels[0], width, height, 3, &analysis);
+  encodeSmallestPng(&pixels[0], width, height, 3, analysis, compressionLevel, &png);
+  return png;
+}
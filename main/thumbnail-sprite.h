@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "json.hpp"
+#include "public/fpdfview.h"
+
+#include "options.h"
+
+/**
+ * A "contact sheet": small thumbnails of a document's first pages, tiled into
+ * one PNG.
+ *
+ * In extract mode we only output page 0's thumbnail. A viewer flipping
+ * through pages can fetch this one small image instead of rendering the PDF.
+ *
+ * Each page gets a TileDimension x TileDimension cell, in rows of `columns`
+ * cells; its thumbnail sits in the cell's top-left corner. We lay out cells
+ * from page sizes before rendering anything, so the layout can go in the
+ * JSON fragment we output first. Then we render each page into its cell as
+ * we load it for text.
+ */
+class ThumbnailSprite {
+public:
+  static const int TileDimension = 128;
+
+  /**
+   * Lays out the first min(options.thumbnailSpritePages, nPages) pages.
+   */
+  ThumbnailSprite(FPDF_DOCUMENT document, int nPages, const Options& options);
+
+  /** True if there are no tiles: the caller should output nothing. */
+  bool empty() const { return tiles.empty(); }
+
+  /**
+   * Returns the layout, for the output JSON:
+   *
+   *     { "width": W, "height": H, "pages": [ { "x": X, "y": Y, "width": W, "height": H }, ... ] }
+   */
+  nlohmann::json layoutJson() const;
+
+  /**
+   * Renders the page into its tile, if it has one.
+   *
+   * If there's no space in memory for the sprite, outputs an "error" fragment
+   * and exits.
+   */
+  void renderPageOrOutputErrorAndExit(FPDF_PAGE page, int pageIndex, const std::string& mimeBoundary);
+
+  /**
+   * Encodes the sprite as a PNG. Returns an empty vector on failure.
+   *
+   * Call this after rendering every tile.
+   */
+  std::vector<uint8_t> encodePng();
+
+private:
+  struct Tile {
+    int x;
+    int y;
+    int width;
+    int height;
+  };
+
+  std::vector<Tile> tiles;
+  int width;
+  int height;
+  int flags;
+  int compressionLevel;
+  std::vector<uint8_t> pixels; // RGB; allocated on first render
+};
@@ -1,24 +1,57 @@
+#include <algorithm>
 #include <cctype>
 #include <cmath>
 #include <codecvt>
+#include <cstring>
+#include <functional>
 #include <locale>
+#include <map>
 #include <memory>
 #include <string>
+#include <tuple>
 #include <unistd.h>
+#include <unordered_map>
 #include <vector>
 
 #include "public/cpp/fpdf_deleters.h"
 #include "public/fpdf_doc.h"
+#include "public/fpdf_edit.h"
 #include "public/fpdf_text.h"
 #include "public/fpdfview.h"
 #include "json.hpp"
-#include "lodepng.h"
 
+#include "downscale.h"
+#include "jpeg.h"
+#include "page-objects.h"
+#include "pdf-file.h"
+#include "pixel-analysis.h"
+#include "png-encode.h"
+#include "png-writer.h"
+#include "render-arena.h"
+#include "result-cache.h"
+#include "segment-store.h"
 #include "util.h"
+#include "worker-pool.h"
 
 static const int MaxNUtf16CharsPerPage = 100000;
-static const int MaxThumbnailDimension = 700;
-static const std::vector<uint8_t> EmptyPng;
+static const int ThumbnailJpegQuality = 85;
+// Bitmaps bigger than this (about 1180x1180 RGB) render in bands of
+// about BandBytes each. Default-size (700px) thumbnails never do.
+static const size_t MaxUnbandedBitmapBytes = 4 * 1024 * 1024;
+static const size_t BandBytes = 512 * 1024;
+static const size_t MaxThumbnailMemoBytes = 64 * 1024 * 1024;
+// We keep a streamed thumbnail's bytes for the memo and the page cache only up
+// to this size. Banded thumbnails can be far bigger.
+static const size_t MaxThumbnailCopyBytes = 8 * 1024 * 1024;
+static const std::vector<uint8_t> EmptyImage;
+// thumbnailFormat "auto" picks JPEG for a page that images cover at least
+// MinPhotoImageCoverage of, if its pixels have too many colors for a palette
+// and shade like a photo: see analyzeEdges(). Banded thumbnails have no
+// pixels to look at before encoding, so they go by coverage alone.
+static const double MinPhotoImageCoverage = 0.3;
+static const double MinPhotoTexturedShare = 0.2;
+static const double MaxPhotoSharpShare = 0.25;
+static const double MinBandedPhotoImageCoverage = 0.9;
 
 // Remove "\f" characters. This helps us conform with the spec, which places
 // a "\f" before every subsequent page's info.
@@ -32,72 +65,689 @@ normalizeUtf16(char16_t* buf, int n) {
 }
 
 /**
- * Encodes a PNG from correctly-sized buffer of pixel data.
+ * Encodes tightly-packed 8-bit RGB or gray pixels as a PNG in `colorMode`,
+ * handing its bytes to `sink` as PngWriter produces them. Deflates with a
+ * DeflateScratch borrowed from renderArena().
  *
- * This overwrites data in argbBuffer.
+ * Returns false if PngWriter fails; then the sink's bytes are garbage.
  */
-static std::vector<uint8_t>
-argbToPng(uint32_t* argbBuffer, size_t width, size_t height)
+static bool
+writePng(const uint8_t* pixels, size_t width, size_t height, int bytesPerPixel, const PngColorMode& colorMode, int compressionLevel, const ByteSink& sink)
 {
-  // Write BGR to the same buffer, destroying it. This saves memory.
-  uint8_t* bgrBuffer = reinterpret_cast<uint8_t*>(argbBuffer);
-
-  size_t n = width * height;
-  for (size_t i = 0, o = 0; i < n; i++, o += 3) {
-    const uint32_t argb = argbBuffer[i];
-    bgrBuffer[o + 0] = (argb >>  0) & 0xff;
-    bgrBuffer[o + 1] = (argb >>  8) & 0xff;
-    bgrBuffer[o + 2] = (argb >> 16) & 0xff;
+  const RenderArena::DeflateScratchLease scratch(renderArena());
+  PngWriter writer(width, height, bytesPerPixel, colorMode, compressionLevel, sink, scratch.get());
+  const size_t rowBytes = bytesPerPixel * width;
+  for (size_t y = 0; y < height; y++) {
+    if (!writer.writeRow(pixels + y * rowBytes)) return false;
   }
+  return writer.finish();
+}
 
-  std::vector<uint8_t> out;
-  const unsigned int err = lodepng::encode(out, &bgrBuffer[0], width, height, LCT_RGB);
-  if (err) {
-    return EmptyPng;
+/**
+ * Encodes tightly-packed 8-bit RGB or gray pixels as a JPEG, like writePng().
+ */
+static bool
+writeJpeg(const uint8_t* pixels, size_t width, size_t height, int bytesPerPixel, int quality, const ByteSink& sink)
+{
+  JpegWriter writer(width, height, bytesPerPixel, quality, sink);
+  const size_t rowBytes = bytesPerPixel * width;
+  for (size_t y = 0; y < height; y++) {
+    if (!writer.writeRow(pixels + y * rowBytes)) return false;
   }
-  return out;
+  return writer.finish();
 }
 
 /**
- * Renders the given PDF page as a PNG.
+ * Asks for the main thumbnail to go straight into its fragment on stdout,
+ * chunk by chunk as the encoder compresses it, instead of into a buffer we
+ * output afterwards.
+ */
+struct ThumbnailStream {
+  /** "N-thumbnail": the encoder's format picks the extension. */
+  std::string fragmentPrefix;
+
+  /**
+   * If set, also gets the image's bytes: for the memo and the page cache.
+   * Past MaxThumbnailCopyBytes, we give up and leave it empty.
+   */
+  std::vector<uint8_t>* copy;
+
+  /** If set, gets the image's bytes instead of stdout (and no prefix). */
+  const ByteSink* sink;
+};
+
+/**
+ * Where the main thumbnail goes: its fragment, or the stream's sink.
  *
- * Returns "" if rendering failed. That means out-of-memory.
+ * The fragment's prefix goes out with the encoder's first bytes. PngWriter
+ * and JpegWriter allocate all they need before they hand the sink anything,
+ * so an encoder that can't start leaves stdout alone.
  */
-static std::vector<uint8_t>
-renderPageThumbnailPngOrOutputErrorAndExit(FPDF_PAGE page, const std::string& mimeBoundary)
+class ThumbnailOutput {
+public:
+  ThumbnailOutput(const ThumbnailStream& stream, const char* extension, const std::string& mimeBoundary)
+    : stream(stream),
+      extension(extension),
+      mimeBoundary(mimeBoundary),
+      bytes(stream.copy),
+      isStarted(false)
+  {
+    if (bytes) bytes->clear();
+  }
+
+  ThumbnailOutput(const ThumbnailOutput&) = delete;
+  ThumbnailOutput& operator=(const ThumbnailOutput&) = delete;
+
+  /** True once part of the image is on stdout (or in the stream's sink). */
+  bool streamed() const { return isStarted; }
+
+  ByteSink sink() {
+    return [this](const uint8_t* data, size_t nBytes) {
+      if (!isStarted && !stream.sink) {
+        outputFragmentPrefix(stream.fragmentPrefix + "." + extension, mimeBoundary);
+      }
+      isStarted = true;
+      if (stream.sink) {
+        (*stream.sink)(data, nBytes);
+      } else {
+        outputBytes(data, nBytes);
+      }
+      if (bytes) {
+        if (bytes->size() + nBytes <= MaxThumbnailCopyBytes) {
+          bytes->insert(bytes->end(), data, data + nBytes);
+        } else {
+          std::vector<uint8_t>().swap(*bytes); // free it
+          bytes = nullptr;
+        }
+      }
+    };
+  }
+
+  /**
+   * Returns the stream's copy of the image's bytes (empty if there's none),
+   * given whether the encoder succeeded.
+   *
+   * An image that failed before reaching stdout comes back empty. One that's
+   * partly on stdout can't be taken back: we output an "error" fragment and
+   * exit. (That takes a zlib or libjpeg failure mid-image: neither allocates
+   * once it has started.)
+   */
+  const std::vector<uint8_t>& finishOrOutputErrorAndExit(bool ok) const {
+    if (!ok) {
+      if (isStarted) outputErrorAndExit("failed to encode thumbnail", mimeBoundary);
+      if (bytes) bytes->clear();
+      return EmptyImage;
+    }
+    return bytes ? *bytes : EmptyImage;
+  }
+
+private:
+  const ThumbnailStream& stream;
+  const char* extension;
+  const std::string& mimeBoundary;
+  std::vector<uint8_t>* bytes;
+  bool isStarted;
+};
+
+/**
+ * Encodes the main thumbnail with `write`, into a ThumbnailOutput, and points
+ * `thumbnail` at the result.
+ *
+ * Returns false if `write` failed before any of the image reached stdout:
+ * then the caller can try the other format.
+ */
+static bool
+writeThumbnailOrOutputErrorAndExit(const char* extension, const std::function<bool(const ByteSink& sink)>& write, const ThumbnailStream& stream, Thumbnail* thumbnail, const std::string& mimeBoundary)
 {
-  double pageWidth = FPDF_GetPageWidth(page);
-  double pageHeight = FPDF_GetPageHeight(page);
+  ThumbnailOutput output(stream, extension, mimeBoundary);
+  const bool ok = write(output.sink());
+  thumbnail->extension = extension;
+  thumbnail->bytes = &output.finishOrOutputErrorAndExit(ok);
+  thumbnail->streamed = output.streamed();
+  return ok;
+}
 
-  int width = MaxThumbnailDimension;
-  int height = MaxThumbnailDimension;
-  if (pageWidth > pageHeight) {
-    height = static_cast<int>(std::round(1.0 * MaxThumbnailDimension * pageHeight / pageWidth));
+/**
+ * Computes the size of a thumbnail of a `width` x `height` image (or page),
+ * with its longest side `maxDimension`.
+ */
+static void
+fitThumbnail(double width, double height, int maxDimension, int* thumbnailWidth, int* thumbnailHeight)
+{
+  *thumbnailWidth = maxDimension;
+  *thumbnailHeight = maxDimension;
+  if (width > height) {
+    *thumbnailHeight = std::max(1, static_cast<int>(std::round(1.0 * maxDimension * height / width)));
   } else {
-    width = static_cast<int>(std::round(1.0 * MaxThumbnailDimension * pageWidth / pageHeight));
+    *thumbnailWidth = std::max(1, static_cast<int>(std::round(1.0 * maxDimension * width / height)));
+  }
+}
+
+/**
+ * Shrinks tightly-packed 8-bit RGB or gray pixels to fit `maxDimension` and
+ * encodes them as a PNG into `out`. (An empty `out` means encoding failed.)
+ *
+ * Thread-safe: it uses its own buffers, its own PngWriter and its own
+ * DeflateScratchLease.
+ */
+static void
+encodeExtraThumbnailPng(const uint8_t* pixels, int width, int height, bool gray, int maxDimension, int compressionLevel, std::vector<uint8_t>* out)
+{
+  const int bytesPerPixel = gray ? 1 : 3;
+
+  int extraWidth, extraHeight;
+  fitThumbnail(width, height, std::min(maxDimension, std::max(width, height)), &extraWidth, &extraHeight);
+  extraWidth = std::min(extraWidth, width);
+  extraHeight = std::min(extraHeight, height);
+
+  std::vector<uint8_t> shrunk(bytesPerPixel * extraWidth * extraHeight);
+  downscaleBox(pixels, width, height, bytesPerPixel * width, bytesPerPixel, &shrunk[0], extraWidth, extraHeight);
+
+  // Shrinking blends colors, so the main thumbnail's census doesn't apply.
+  PixelAnalysis analysis;
+  analyzePixels(&shrunk[0], extraWidth, extraHeight, bytesPerPixel, &analysis);
+  const PngColorMode colorMode(PngColorMode::smallest(analysis, bytesPerPixel, extraWidth * extraHeight));
+
+  const bool ok = writePng(&shrunk[0], extraWidth, extraHeight, bytesPerPixel, colorMode, compressionLevel, [out](const uint8_t* bytes, size_t nBytes) {
+    out->insert(out->end(), bytes, bytes + nBytes);
+  });
+  if (!ok) out->clear();
+}
+
+/**
+ * Encodes Options.extraThumbnailSizes from a thumbnail's pixels, one
+ * workerPool() task per size, while the caller encodes the main thumbnail.
+ *
+ * The pixels must not change until join() -- or the destructor -- returns.
+ */
+class ExtraThumbnailEncoder {
+public:
+  ExtraThumbnailEncoder(const uint8_t* pixels, int width, int height, bool gray, const Options& options)
+    : pngs(renderArena().extraEncoded(options.extraThumbnailSizes.size())),
+      encode([this, pixels, width, height, gray, &options](size_t i) {
+        encodeExtraThumbnailPng(pixels, width, height, gray, options.extraThumbnailSizes[i], options.pngCompressionLevel, &pngs[i]);
+      }),
+      batch(workerPool().start(options.extraThumbnailSizes.size(), encode))
+  {
+  }
+
+  ~ExtraThumbnailEncoder() {
+    join();
+  }
+
+  ExtraThumbnailEncoder(const ExtraThumbnailEncoder&) = delete;
+  ExtraThumbnailEncoder& operator=(const ExtraThumbnailEncoder&) = delete;
+
+  /**
+   * Waits for every size (encoding the ones no worker has started), and
+   * returns the PNGs in the order of Options.extraThumbnailSizes.
+   */
+  const std::vector<std::vector<uint8_t>>& join() {
+    if (batch) {
+      workerPool().wait(*batch);
+      batch.reset();
+    }
+    return pngs;
+  }
+
+private:
+  std::vector<std::vector<uint8_t>>& pngs;
+  const std::function<void(size_t)> encode;
+  std::shared_ptr<WorkerPool::Batch> batch;
+};
+
+/**
+ * Returns a JPEG (if `asJpeg`) or PNG of a white page.
+ */
+static const std::vector<uint8_t>&
+blankThumbnailImageOrOutputErrorAndExit(int width, int height, bool asJpeg, int compressionLevel, const std::string& mimeBoundary)
+{
+  // Blank pages in a document tend to share a size: encode each size once.
+  static std::map<std::tuple<int, int, bool, int>, std::vector<uint8_t>> cache;
+
+  const std::tuple<int, int, bool, int> key(width, height, asJpeg, compressionLevel);
+  auto it = cache.find(key);
+  if (it == cache.end()) {
+    uint8_t* buffer = renderArena().pixels(width * height);
+    if (!buffer) {
+      outputErrorAndExit("out of memory when creating thumbnail", mimeBoundary);
+      return EmptyImage;
+    }
+    std::fill(buffer, buffer + width * height, 0xff);
+    PixelAnalysis analysis;
+    analyzePixels(buffer, width, height, 1, &analysis);
+    std::vector<uint8_t> image;
+    const ByteSink sink([&image](const uint8_t* bytes, size_t nBytes) {
+      image.insert(image.end(), bytes, bytes + nBytes);
+    });
+    const bool ok = asJpeg
+      ? writeJpeg(buffer, width, height, 1, ThumbnailJpegQuality, sink)
+      : writePng(buffer, width, height, 1, PngColorMode::smallest(analysis, 1, width * height), compressionLevel, sink);
+    if (!ok) image.clear();
+    it = cache.emplace(key, std::move(image)).first;
+  }
+  return it->second;
+}
+
+/**
+ * Returns a thumbnail of a white page.
+ */
+static Thumbnail
+blankThumbnailsOrOutputErrorAndExit(int width, int height, bool asJpeg, const Options& options, const std::string& mimeBoundary)
+{
+  Thumbnail thumbnail = { asJpeg ? "jpg" : "png", &blankThumbnailImageOrOutputErrorAndExit(width, height, asJpeg, options.pngCompressionLevel, mimeBoundary), nullptr, false };
+
+  uint8_t* buffer = nullptr;
+  if (!options.extraThumbnailSizes.empty()) {
+    buffer = renderArena().pixels(width * height);
+    if (!buffer) {
+      outputErrorAndExit("out of memory when creating thumbnail", mimeBoundary);
+      return thumbnail;
+    }
+    std::fill(buffer, buffer + width * height, 0xff);
   }
 
-  std::unique_ptr<uint32_t[]> buffer(new (std::nothrow) uint32_t[width * height]);
+  ExtraThumbnailEncoder extras(buffer, width, height, true, options);
+  thumbnail.extraPngs = &extras.join();
+  return thumbnail;
+}
+
+/**
+ * Rewrites RGB pixels with R == G == B as 8-bit gray, in place.
+ */
+static void
+packRgbToGray(uint8_t* pixels, size_t nPixels)
+{
+  for (size_t i = 0; i < nPixels; i++) {
+    pixels[i] = pixels[i * 3];
+  }
+}
+
+/**
+ * Returns true if thumbnail pixels look like a photo, so a JPEG will be
+ * smaller than a PNG and will look as good.
+ *
+ * Text and line art fit in a palette, or have sharp edges that JPEG smears.
+ */
+static bool
+pixelsLookLikePhoto(const uint8_t* pixels, int width, int height, int bytesPerPixel, const PixelAnalysis& analysis)
+{
+  if (analysis.nColors <= MaxCountedColors) return false;
+
+  EdgeAnalysis edges;
+  analyzeEdges(pixels, width, height, bytesPerPixel, &edges);
+  return edges.texturedShare >= MinPhotoTexturedShare && edges.sharpShare <= MaxPhotoSharpShare;
+}
+
+/**
+ * Encodes a thumbnail, and its extra sizes, from tightly-packed 8-bit RGB or
+ * gray pixels.
+ *
+ * The main thumbnail is a JPEG or PNG, as `format` says: ThumbnailFormat::Auto
+ * means a JPEG if pixelsLookLikePhoto(). (A JPEG libjpeg can't start comes
+ * out a PNG.) It's streamed, as `stream` says. Extra sizes are always
+ * PNGs. A page that rendered all white gets the blank thumbnail instead,
+ * unstreamed.
+ *
+ * Overwrites the pixels.
+ */
+static Thumbnail
+encodeThumbnails(uint8_t* buffer, int width, int height, bool gray, ThumbnailFormat format, const Options& options, const ThumbnailStream& stream, const std::string& mimeBoundary)
+{
+  // The census picks the PNG's color mode. And pageIsGrayscale() is
+  // conservative, and scanners often save gray pages in color: if the pixels
+  // are gray, we drop to one byte per pixel.
+  PixelAnalysis analysis;
+  analyzePixels(buffer, width, height, gray ? 1 : 3, &analysis);
+  // pageIsBlank() only vouches for pages of white paths. Invisible text (a
+  // blank scan's OCR layer), white text and white images render blank, too.
+  if (analysis.isBlank) {
+    return blankThumbnailsOrOutputErrorAndExit(width, height, format == ThumbnailFormat::Jpeg, options, mimeBoundary);
+  }
+  if (!gray && analysis.isGray) {
+    packRgbToGray(buffer, width * height);
+    gray = true;
+  }
+
+  ExtraThumbnailEncoder extras(buffer, width, height, gray, options);
+
+  const int bytesPerPixel = gray ? 1 : 3;
+  const bool asJpeg = format == ThumbnailFormat::Jpeg
+    || (format == ThumbnailFormat::Auto && pixelsLookLikePhoto(buffer, width, height, bytesPerPixel, analysis));
+  Thumbnail thumbnail = { nullptr, nullptr, nullptr, false };
+
+  // libjpeg can run out of memory before it writes a byte. Then a PNG beats
+  // no thumbnail.
+  const bool wroteJpeg = asJpeg && writeThumbnailOrOutputErrorAndExit("jpg", [&](const ByteSink& sink) {
+    return writeJpeg(buffer, width, height, bytesPerPixel, ThumbnailJpegQuality, sink);
+  }, stream, &thumbnail, mimeBoundary);
+  if (!wroteJpeg) {
+    writeThumbnailOrOutputErrorAndExit("png", [&](const ByteSink& sink) {
+      return writePng(buffer, width, height, bytesPerPixel, PngColorMode::smallest(analysis, bytesPerPixel, width * height), options.pngCompressionLevel, sink);
+    }, stream, &thumbnail, mimeBoundary);
+  }
+
+  thumbnail.extraPngs = &extras.join();
+  return thumbnail;
+}
+
+/**
+ * Renders the page into a tightly-packed 8-bit RGB or gray bitmap in the
+ * render arena, and returns it.
+ *
+ * In RGB, we ask PDFium for FPDFBitmap_BGR with FPDF_REVERSE_BYTE_ORDER: that
+ * gives rows of R, G, B bytes, exactly what the PNG encoder wants. (A BGRA
+ * bitmap would cost 33% more memory, plus a pass to rearrange bytes.)
+ *
+ * Only render gray when pageIsGrayscale(): otherwise, colors will be lost.
+ */
+static uint8_t*
+renderPixelsOrOutputErrorAndExit(FPDF_PAGE page, int width, int height, bool gray, int flags, const std::string& mimeBoundary)
+{
+  const int bytesPerPixel = gray ? 1 : 3;
+  uint8_t* buffer = renderArena().pixels(bytesPerPixel * width * height);
   if (!buffer) {
     outputErrorAndExit("out of memory when creating thumbnail", mimeBoundary);
-    return EmptyPng;
+    return nullptr;
   }
 
-  FPDF_BITMAP bitmap = FPDFBitmap_CreateEx(width, height, FPDFBitmap_BGRA, &buffer[0], sizeof(uint32_t) * width);
+  FPDF_BITMAP bitmap = FPDFBitmap_CreateEx(width, height, gray ? FPDFBitmap_Gray : FPDFBitmap_BGR, buffer, bytesPerPixel * width);
   if (!bitmap) {
     outputErrorAndExit("unknown error while creating thumbnail", mimeBoundary);
-    return EmptyPng;
+    return nullptr;
   }
 
-  // TODO investigate speedup from
-  // FPDF_RENDER_NO_SMOOTHTEXT, FPDF_RENDER_NO_SMOOTHIMAGE, FPDF_RENDER_NO_SMOOTHPATH
-  int flags = 0;
   FPDFBitmap_FillRect(bitmap, 0, 0, width, height, 0xffffffff);
-  FPDF_RenderPageBitmap(bitmap, page, 0, 0, width, height, 0, flags);
+  FPDF_RenderPageBitmap(bitmap, page, 0, 0, width, height, 0, flags | FPDF_REVERSE_BYTE_ORDER);
   FPDFBitmap_Destroy(bitmap);
 
-  std::vector<uint8_t> png(argbToPng(&buffer[0], width, height));
-  return png;
+  return buffer;
+}
+
+/**
+ * Renders the page one horizontal band at a time, and hands each row to
+ * `writeRow` as soon as its band is rendered.
+ *
+ * Peak memory is one band plus a few rows, no matter how big the thumbnail.
+ * But without the whole bitmap, we can't take a color census to pick a
+ * smaller color mode; so we only band thumbnails too big to render whole.
+ *
+ * Returns false as soon as writeRow() does.
+ */
+static bool
+renderBandsOrOutputErrorAndExit(FPDF_PAGE page, int width, int height, bool gray, int flags, const std::function<bool(const uint8_t* row)>& writeRow, const std::string& mimeBoundary)
+{
+  const int bytesPerPixel = gray ? 1 : 3;
+  const size_t rowBytes = bytesPerPixel * width;
+  const int bandHeight = static_cast<int>(std::max<size_t>(1, BandBytes / rowBytes));
+
+  uint8_t* buffer = renderArena().pixels(rowBytes * bandHeight);
+  if (!buffer) {
+    outputErrorAndExit("out of memory when creating thumbnail", mimeBoundary);
+    return false;
+  }
+
+  // Scale page points to thumbnail pixels.
+  const float scaleX = static_cast<float>(width / FPDF_GetPageWidth(page));
+  const float scaleY = static_cast<float>(height / FPDF_GetPageHeight(page));
+
+  for (int top = 0; top < height; top += bandHeight) {
+    const int nRows = std::min(bandHeight, height - top);
+
+    FPDF_BITMAP bitmap = FPDFBitmap_CreateEx(width, nRows, gray ? FPDFBitmap_Gray : FPDFBitmap_BGR, buffer, rowBytes);
+    if (!bitmap) {
+      outputErrorAndExit("unknown error while creating thumbnail", mimeBoundary);
+      return false;
+    }
+
+    // Shift the page up so this band's first row is the bitmap's first row,
+    // and clip to the band so PDFium skips everything else.
+    const FS_MATRIX matrix = { scaleX, 0, 0, scaleY, 0, static_cast<float>(-top) };
+    const FS_RECTF clip = { 0, 0, static_cast<float>(width), static_cast<float>(nRows) };
+    FPDFBitmap_FillRect(bitmap, 0, 0, width, nRows, 0xffffffff);
+    FPDF_RenderPageBitmapWithMatrix(bitmap, page, &matrix, &clip, flags | FPDF_REVERSE_BYTE_ORDER);
+    FPDFBitmap_Destroy(bitmap);
+
+    for (int y = 0; y < nRows; y++) {
+      if (!writeRow(buffer + y * rowBytes)) return false;
+    }
+  }
+
+  return true;
+}
+
+/**
+ * Renders a thumbnail too big to render whole, in bands: see
+ * renderBandsOrOutputErrorAndExit(). It's a JPEG if `asJpeg`, else a PNG.
+ *
+ * Extra sizes are small, so we render the largest of them whole afterwards
+ * and shrink the rest from it.
+ */
+static Thumbnail
+renderBandedThumbnailsOrOutputErrorAndExit(FPDF_PAGE page, int width, int height, bool gray, bool asJpeg, int flags, const Options& options, const ThumbnailStream& stream, const std::string& mimeBoundary)
+{
+  const int bytesPerPixel = gray ? 1 : 3;
+  Thumbnail thumbnail = { nullptr, nullptr, nullptr, false };
+
+  // As in encodeThumbnails(), a JPEG that fails before its first byte
+  // becomes a PNG: we render the bands again.
+  const bool wroteJpeg = asJpeg && writeThumbnailOrOutputErrorAndExit("jpg", [&](const ByteSink& sink) {
+    JpegWriter writer(width, height, bytesPerPixel, ThumbnailJpegQuality, sink);
+    return renderBandsOrOutputErrorAndExit(page, width, height, gray, flags, [&writer](const uint8_t* row) { return writer.writeRow(row); }, mimeBoundary)
+      && writer.finish();
+  }, stream, &thumbnail, mimeBoundary);
+  if (!wroteJpeg) {
+    writeThumbnailOrOutputErrorAndExit("png", [&](const ByteSink& sink) {
+      const RenderArena::DeflateScratchLease scratch(renderArena());
+      PngWriter writer(width, height, bytesPerPixel, PngColorMode(bytesPerPixel), options.pngCompressionLevel, sink, scratch.get());
+      return renderBandsOrOutputErrorAndExit(page, width, height, gray, flags, [&writer](const uint8_t* row) { return writer.writeRow(row); }, mimeBoundary)
+        && writer.finish();
+    }, stream, &thumbnail, mimeBoundary);
+  }
+
+  const std::vector<int>& extraSizes = options.extraThumbnailSizes;
+
+  uint8_t* buffer = nullptr;
+  int extraWidth = 0, extraHeight = 0;
+  if (!extraSizes.empty()) {
+    const int largest = std::min(*std::max_element(extraSizes.begin(), extraSizes.end()), std::max(width, height));
+    fitThumbnail(width, height, largest, &extraWidth, &extraHeight);
+    buffer = renderPixelsOrOutputErrorAndExit(page, extraWidth, extraHeight, gray, flags, mimeBoundary);
+  }
+
+  ExtraThumbnailEncoder extras(buffer, extraWidth, extraHeight, gray, options);
+  thumbnail.extraPngs = &extras.join();
+  return thumbnail;
+}
+
+/**
+ * Rewrites BGR or BGRx pixels as tightly-packed RGB, in place.
+ */
+static void
+packBgrToRgb(uint8_t* pixels, size_t nPixels, int bytesPerPixel)
+{
+  for (size_t i = 0; i < nPixels; i++) {
+    const uint8_t* bgr = pixels + i * bytesPerPixel;
+    const uint8_t b = bgr[0];
+    const uint8_t g = bgr[1];
+    const uint8_t r = bgr[2];
+    pixels[i * 3] = r;
+    pixels[i * 3 + 1] = g;
+    pixels[i * 3 + 2] = b;
+  }
+}
+
+/**
+ * Shrinks a scanned page's image into `buffer` (which must hold 4 * width *
+ * height bytes), as 8-bit gray or RGB pixels.
+ *
+ * Returns false if we can't: the image would need enlarging, or PDFium hands
+ * us a format we don't handle. Then the caller should render the page.
+ */
+static bool
+downscaleScannedImage(FPDF_PAGEOBJECT image, int width, int height, uint8_t* buffer, bool* gray)
+{
+  std::unique_ptr<void, FPDFBitmapDeleter> bitmap(FPDFImageObj_GetBitmap(image));
+  if (!bitmap) return false;
+
+  const int srcWidth = FPDFBitmap_GetWidth(bitmap.get());
+  const int srcHeight = FPDFBitmap_GetHeight(bitmap.get());
+  if (srcWidth < width || srcHeight < height) return false;
+
+  int bytesPerPixel;
+  switch (FPDFBitmap_GetFormat(bitmap.get())) {
+    case FPDFBitmap_Gray: bytesPerPixel = 1; break;
+    case FPDFBitmap_BGR: bytesPerPixel = 3; break;
+    case FPDFBitmap_BGRx: bytesPerPixel = 4; break;
+    default: return false; // alpha, or 1-bit
+  }
+
+  downscaleBox(
+    static_cast<const uint8_t*>(FPDFBitmap_GetBuffer(bitmap.get())),
+    srcWidth,
+    srcHeight,
+    FPDFBitmap_GetStride(bitmap.get()),
+    bytesPerPixel,
+    buffer,
+    width,
+    height
+  );
+
+  *gray = bytesPerPixel == 1;
+  if (!*gray) {
+    packBgrToRgb(buffer, width * height, bytesPerPixel);
+  }
+  return true;
+}
+
+/**
+ * Returns true if a PDF `dictionary` holds the whole name `name`: "/Decode"
+ * isn't in "/DecodeParms" or "/DecodeX".
+ */
+static bool
+hasPdfName(const std::string& dictionary, const char* name)
+{
+  const size_t nameLength = std::strlen(name);
+  for (size_t pos = dictionary.find(name); pos != std::string::npos; pos = dictionary.find(name, pos + 1)) {
+    const size_t end = pos + nameLength;
+    // A name ends at whitespace or a delimiter.
+    if (end == dictionary.size() || std::strchr(" \t\r\n\f/[]<>(){}%", dictionary[end])) return true;
+  }
+  return false;
+}
+
+/**
+ * Shrinks a scanned page's JPEG into `buffer` (which must hold 3 * width *
+ * height bytes), decoding it at reduced scale.
+ *
+ * Returns false if libjpeg can't decode the image, or it's CMYK (Adobe CMYK
+ * JPEGs are often inverted), or the image's dictionary has a /Decode array
+ * or /DecodeParms (/ColorTransform) -- or we can't find its dictionary, or
+ * another image holds the same bytes. Then the caller should let PDFium
+ * decode it.
+ */
+static bool
+downscaleScannedJpeg(FPDF_PAGEOBJECT image, int width, int height, uint8_t* buffer, bool* gray)
+{
+  std::vector<uint8_t>& jpegBytes(renderArena().scanJpeg());
+  JpegPixels& decoded(renderArena().scanPixels());
+
+  const unsigned long nBytes = FPDFImageObj_GetImageDataRaw(image, nullptr, 0);
+  if (nBytes == 0) return false;
+  jpegBytes.resize(nBytes);
+  FPDFImageObj_GetImageDataRaw(image, &jpegBytes[0], nBytes);
+
+  // PDFium applies /Decode and /ColorTransform; libjpeg knows nothing of them.
+  std::string dictionary;
+  if (!pdfFile().findStreamDictionary(&jpegBytes[0], nBytes, &dictionary)) return false;
+  if (hasPdfName(dictionary, "/Decode") || hasPdfName(dictionary, "/DecodeParms")) return false;
+
+  if (!decodeJpegScaled(&jpegBytes[0], nBytes, width, height, &decoded)) return false;
+  if (decoded.width < static_cast<size_t>(width) || decoded.height < static_cast<size_t>(height)) return false;
+
+  downscaleBox(
+    &decoded.pixels[0],
+    decoded.width,
+    decoded.height,
+    decoded.width * decoded.nComponents,
+    decoded.nComponents,
+    buffer,
+    width,
+    height
+  );
+
+  *gray = decoded.nComponents == 1;
+  return true;
+}
+
+/**
+ * Renders the page's thumbnails, like the public function of the same name --
+ * but streams the main thumbnail as `stream` says: into its fragment, say.
+ */
+static Thumbnail
+renderPageThumbnailOrOutputErrorAndExit(FPDF_PAGE page, const Options& options, const ThumbnailStream& stream, const std::string& mimeBoundary)
+{
+  int width, height;
+  fitThumbnail(FPDF_GetPageWidth(page), FPDF_GetPageHeight(page), options.thumbnailSize, &width, &height);
+
+  const int flags = renderFlagsForTier(options.renderTier);
+
+  // Most pages are text, with few images or none: "auto" makes them PNGs
+  // without looking at their pixels.
+  ThumbnailFormat format = options.thumbnailFormat;
+  double imageCoverage = 0.0;
+  if (format == ThumbnailFormat::Auto) {
+    imageCoverage = pageImageCoverage(page);
+    if (imageCoverage < MinPhotoImageCoverage) format = ThumbnailFormat::Png;
+  }
+
+  // Separator pages in scans and office exports: skip rendering them.
+  if (pageIsBlank(page, flags)) {
+    return blankThumbnailsOrOutputErrorAndExit(width, height, format == ThumbnailFormat::Jpeg, options, mimeBoundary);
+  }
+
+  // Scanned pages: shrink the image we'd otherwise make PDFium resample.
+  FPDF_PAGEOBJECT scannedImage = pageScannedImage(page, flags);
+  if (scannedImage) {
+    uint8_t* buffer = renderArena().pixels(4 * width * height);
+    if (!buffer) {
+      outputErrorAndExit("out of memory when creating thumbnail", mimeBoundary);
+      return Thumbnail();
+    }
+
+    bool gray;
+
+    // A JPEG scan gets a JPEG thumbnail: we never decode it at full size,
+    // and a photo compresses far better as JPEG than as PNG.
+    if (imageIsJpeg(scannedImage) && downscaleScannedJpeg(scannedImage, width, height, buffer, &gray)) {
+      return encodeThumbnails(buffer, width, height, gray, ThumbnailFormat::Jpeg, options, stream, mimeBoundary);
+    }
+
+    if (downscaleScannedImage(scannedImage, width, height, buffer, &gray)) {
+      return encodeThumbnails(buffer, width, height, gray, format, options, stream, mimeBoundary);
+    }
+  }
+
+  // Most pages are black text on white. Rendering them in gray needs a
+  // third of the memory, and the PNG encoder has a third as many bytes to
+  // look at.
+  const bool gray = pageIsGrayscale(page, flags);
+
+  if ((gray ? 1u : 3u) * width * height > MaxUnbandedBitmapBytes) {
+    const bool asJpeg = format == ThumbnailFormat::Jpeg
+      || (format == ThumbnailFormat::Auto && imageCoverage >= MinBandedPhotoImageCoverage);
+    return renderBandedThumbnailsOrOutputErrorAndExit(page, width, height, gray, asJpeg, flags, options, stream, mimeBoundary);
+  }
+
+  uint8_t* buffer = renderPixelsOrOutputErrorAndExit(page, width, height, gray, flags, mimeBoundary);
+  return encodeThumbnails(buffer, width, height, gray, format, options, stream, mimeBoundary);
+}
+
+Thumbnail
+renderPageThumbnailOrOutputErrorAndExit(FPDF_PAGE page, const Options& options, const ByteSink& sink, const std::string& mimeBoundary)
+{
+  const ThumbnailStream stream = { std::string(), nullptr, &sink };
+  return renderPageThumbnailOrOutputErrorAndExit(page, options, stream, mimeBoundary);
 }
 
 std::string
@@ -123,11 +773,179 @@ getPageTextUtf8OrOutputErrorAndExit(FPDF_PAGE fPage, const std::string& mimeBoun
   return u8Text;
 }
 
+static std::string
+thumbnailFragmentPrefix(int pageIndex)
+{
+  return std::to_string(pageIndex) + "-thumbnail";
+}
+
+/**
+ * Outputs a page's thumbnail fragments -- skipping the main thumbnail if
+ * `mainIsStreamed`, because it's already out.
+ */
+static void
+outputThumbnailFragments(
+  int pageIndex,
+  const std::string& extension,
+  const std::vector<uint8_t>& bytes,
+  bool mainIsStreamed,
+  const std::vector<std::vector<uint8_t>>& extraPngs,
+  const Options& options,
+  const std::string& mimeBoundary
+)
+{
+  const std::string prefix(thumbnailFragmentPrefix(pageIndex));
+  if (!mainIsStreamed) {
+    outputFragment(prefix + "." + extension, bytes, mimeBoundary);
+  }
+
+  for (size_t i = 0; i < options.extraThumbnailSizes.size(); i++) {
+    const std::string name(prefix + "-" + std::to_string(options.extraThumbnailSizes[i]) + ".png");
+    outputFragment(name, extraPngs[i], mimeBoundary);
+  }
+}
+
 void
-outputPageThumbnailFragmentOrErrorAndExit(FPDF_PAGE fPage, int pageIndex, const std::string& mimeBoundary)
+outputPageThumbnailFragmentOrErrorAndExit(FPDF_PAGE fPage, int pageIndex, const Options& options, const std::string& mimeBoundary)
 {
-  std::vector<uint8_t> pngBytes(renderPageThumbnailPngOrOutputErrorAndExit(fPage, mimeBoundary));
-  outputFragment(std::to_string(pageIndex) + "-thumbnail.png", pngBytes, mimeBoundary);
+  // Nothing needs the thumbnail's bytes afterwards: stream them.
+  const ThumbnailStream stream = { thumbnailFragmentPrefix(pageIndex), nullptr, nullptr };
+  const Thumbnail thumbnail(renderPageThumbnailOrOutputErrorAndExit(fPage, options, stream, mimeBoundary));
+  outputThumbnailFragments(pageIndex, thumbnail.extension, *thumbnail.bytes, thumbnail.streamed, *thumbnail.extraPngs, options, mimeBoundary);
+}
+
+/**
+ * A thumbnail we keep after rendering, so we can output it again.
+ */
+struct StoredThumbnail {
+  std::string extension;
+  std::vector<uint8_t> bytes;
+  std::vector<std::vector<uint8_t>> extraPngs;
+};
+
+// Bump this when a change to rendering or text extraction changes output:
+// pages cached by older versions will then miss.
+static const char PageCacheVersion[] = "v2";
+
+static std::string
+thumbnailCacheKey(const std::string& fingerprint, const Options& options)
+{
+  std::string key(fingerprint + "-thumbnail-" + PageCacheVersion
+    + "-" + renderTierName(options.renderTier)
+    + "-z" + std::to_string(options.pngCompressionLevel)
+    + "-" + thumbnailFormatName(options.thumbnailFormat)
+    + "-" + std::to_string(options.thumbnailSize));
+  for (int size : options.extraThumbnailSizes) {
+    key += "-" + std::to_string(size);
+  }
+  return key;
+}
+
+static void
+appendCacheRecordPart(std::vector<uint8_t>* record, const uint8_t* bytes, size_t nBytes)
+{
+  for (int shift = 24; shift >= 0; shift -= 8) {
+    record->push_back(static_cast<uint8_t>(nBytes >> shift));
+  }
+  record->insert(record->end(), bytes, bytes + nBytes);
+}
+
+/**
+ * Serializes a thumbnail for the page cache: the extension, the thumbnail and
+ * each extra PNG, each prefixed by its big-endian 32-bit length.
+ */
+static std::vector<uint8_t>
+thumbnailCacheRecord(const StoredThumbnail& thumbnail)
+{
+  std::vector<uint8_t> record;
+  appendCacheRecordPart(&record, reinterpret_cast<const uint8_t*>(thumbnail.extension.data()), thumbnail.extension.size());
+  appendCacheRecordPart(&record, thumbnail.bytes.data(), thumbnail.bytes.size());
+  for (const auto& png : thumbnail.extraPngs) {
+    appendCacheRecordPart(&record, png.data(), png.size());
+  }
+  return record;
+}
+
+/**
+ * Parses thumbnailCacheRecord()'s output. Returns false if it is malformed
+ * or has the wrong number of extra PNGs.
+ */
+static bool
+parseThumbnailCacheRecord(const std::vector<uint8_t>& record, size_t nExtraPngs, StoredThumbnail* thumbnail)
+{
+  std::vector<std::vector<uint8_t>> parts;
+  size_t pos = 0;
+  while (pos < record.size()) {
+    if (record.size() - pos < 4) return false;
+    const size_t nBytes = (static_cast<size_t>(record[pos]) << 24)
+      | (static_cast<size_t>(record[pos + 1]) << 16)
+      | (static_cast<size_t>(record[pos + 2]) << 8)
+      | static_cast<size_t>(record[pos + 3]);
+    pos += 4;
+    if (record.size() - pos < nBytes) return false;
+    parts.emplace_back(record.begin() + pos, record.begin() + pos + nBytes);
+    pos += nBytes;
+  }
+  if (parts.size() != 2 + nExtraPngs) return false;
+
+  thumbnail->extension.assign(parts[0].begin(), parts[0].end());
+  if (thumbnail->extension != "png" && thumbnail->extension != "jpg") return false;
+  thumbnail->bytes.swap(parts[1]);
+  thumbnail->extraPngs.assign(std::make_move_iterator(parts.begin() + 2), std::make_move_iterator(parts.end()));
+  return true;
+}
+
+void
+outputPageThumbnailFragmentOrErrorAndExit(FPDF_PAGE fPage, int pageIndex, const std::string& fingerprint, const Options& options, const std::string& mimeBoundary)
+{
+  // Thumbnails by fingerprint. Once they add up to MaxThumbnailMemoBytes, we
+  // stop adding to it.
+  static std::unordered_map<std::string, StoredThumbnail> memo;
+  static size_t memoBytes = 0;
+
+  const auto it = memo.find(fingerprint);
+  if (it != memo.end()) {
+    const StoredThumbnail& stored(it->second);
+    outputThumbnailFragments(pageIndex, stored.extension, stored.bytes, false, stored.extraPngs, options, mimeBoundary);
+    return;
+  }
+
+  // Then the disk cache, which other documents' conversions have filled.
+  SegmentStore& pageCache(SegmentStore::fromEnvironment("PAGE_CACHE"));
+  const std::string cacheKey(pageCache.enabled() ? thumbnailCacheKey(fingerprint, options) : std::string());
+  StoredThumbnail stored;
+  std::vector<uint8_t> record;
+  bool mainIsStreamed = false;
+  if (!pageCache.get(cacheKey, &record) || !parseThumbnailCacheRecord(record, options.extraThumbnailSizes.size(), &stored)) {
+    // Stream the thumbnail as we encode it, keeping a copy for the caches.
+    const ThumbnailStream stream = { thumbnailFragmentPrefix(pageIndex), &stored.bytes, nullptr };
+    const Thumbnail thumbnail(renderPageThumbnailOrOutputErrorAndExit(fPage, options, stream, mimeBoundary));
+    stored.extension = thumbnail.extension;
+    if (!thumbnail.streamed) stored.bytes = *thumbnail.bytes;
+    stored.extraPngs = *thumbnail.extraPngs;
+    mainIsStreamed = thumbnail.streamed;
+
+    // A streamed thumbnail too big to copy: output the rest, and keep nothing.
+    if (mainIsStreamed && stored.bytes.empty()) {
+      outputThumbnailFragments(pageIndex, stored.extension, stored.bytes, true, stored.extraPngs, options, mimeBoundary);
+      return;
+    }
+
+    if (pageCache.enabled()) {
+      pageCache.put(cacheKey, thumbnailCacheRecord(stored));
+    }
+  }
+
+  outputThumbnailFragments(pageIndex, stored.extension, stored.bytes, mainIsStreamed, stored.extraPngs, options, mimeBoundary);
+
+  size_t nBytes = stored.bytes.size();
+  for (const auto& png : stored.extraPngs) {
+    nBytes += png.size();
+  }
+  if (memoBytes + nBytes <= MaxThumbnailMemoBytes) {
+    memo[fingerprint] = std::move(stored);
+    memoBytes += nBytes;
+  }
 }
 
 void
@@ -137,8 +955,34 @@ outputPageTextFragmentOrErrorAndExit(FPDF_PAGE fPage, int pageIndex, const std::
   outputFragment(std::to_string(pageIndex) + ".txt", utf8, mimeBoundary);
 }
 
+std::string
+getPageTextUtf8OrOutputErrorAndExit(FPDF_PAGE fPage, const std::string& fingerprint, const std::string& mimeBoundary)
+{
+  SegmentStore& pageCache(SegmentStore::fromEnvironment("PAGE_CACHE"));
+  if (!pageCache.enabled()) {
+    return getPageTextUtf8OrOutputErrorAndExit(fPage, mimeBoundary);
+  }
+
+  const std::string cacheKey(fingerprint + "-text-" + PageCacheVersion);
+  std::vector<uint8_t> cached;
+  if (pageCache.get(cacheKey, &cached)) {
+    return std::string(cached.begin(), cached.end());
+  }
+
+  const std::string utf8(getPageTextUtf8OrOutputErrorAndExit(fPage, mimeBoundary));
+  pageCache.put(cacheKey, std::vector<uint8_t>(utf8.begin(), utf8.end()));
+  return utf8;
+}
+
 void
-outputBytes(const uint8_t* bytes, size_t len)
+outputPageTextFragmentOrErrorAndExit(FPDF_PAGE fPage, int pageIndex, const std::string& fingerprint, const std::string& mimeBoundary)
+{
+  std::string utf8(getPageTextUtf8OrOutputErrorAndExit(fPage, fingerprint, mimeBoundary));
+  outputFragment(std::to_string(pageIndex) + ".txt", utf8, mimeBoundary);
+}
+
+static void
+writeBytes(const uint8_t* bytes, size_t len)
 {
   while (len > 0) {
     ssize_t nWritten = write(STDOUT_FILENO, bytes, len);
@@ -151,6 +995,19 @@ outputBytes(const uint8_t* bytes, size_t len)
   }
 }
 
+static void
+writeBytes(const std::string& bytes)
+{
+  writeBytes(reinterpret_cast<const uint8_t*>(bytes.data()), bytes.size());
+}
+
+void
+outputBytes(const uint8_t* bytes, size_t len)
+{
+  recordBytes(bytes, len);
+  writeBytes(bytes, len);
+}
+
 void
 outputBytes(const std::string& bytes)
 {
@@ -167,7 +1024,8 @@ void
 outputFragmentPrefix(const std::string& name, const std::string& mimeBoundary)
 {
   const std::string& prefix = std::string("\r\n--") + mimeBoundary + "\r\nContent-Disposition: form-data; name=" + name + "\r\n\r\n";
-  outputBytes(prefix);
+  writeBytes(prefix);
+  recordFragmentPrefix(name);
 }
 
 void
@@ -184,16 +1042,46 @@ outputFragment(const std::string& name, const std::vector<uint8_t>& bytes, const
   outputBytes(bytes);
 }
 
+nlohmann::json
+buildOutputJson(const nlohmann::json& jsonTemplate, const nlohmann::json& pdfMetadata, const nlohmann::json& patch)
+{
+  nlohmann::json json(jsonTemplate);
+  nlohmann::json& metadata(json["metadata"]);
+  if (pdfMetadata.is_object()) {
+    for (auto it = pdfMetadata.begin(); it != pdfMetadata.end(); ++it) {
+      // The template's metadata wins: the user may have edited it.
+      if (!metadata.contains(it.key())) metadata[it.key()] = it.value();
+    }
+  }
+  json.merge_patch(patch);
+  return json;
+}
+
+void
+outputJsonFragment(
+  const std::string& name,
+  const nlohmann::json& jsonTemplate,
+  const nlohmann::json& pdfMetadata,
+  const nlohmann::json& patch,
+  const std::string& mimeBoundary
+)
+{
+  outputFragmentPrefix(name, mimeBoundary);
+  recordJsonFragment(pdfMetadata, patch);
+  outputBytes(buildOutputJson(jsonTemplate, pdfMetadata, patch).dump());
+}
+
 static void
 outputEnd(const std::string& mimeBoundary)
 {
   const std::string closeDelimiter = std::string("\r\n--") + mimeBoundary + "--";
-  outputBytes(closeDelimiter);
+  writeBytes(closeDelimiter);
 }
 
 void
 outputDoneAndExit(const std::string& mimeBoundary)
 {
+  finishRecording();
   outputFragmentPrefix("done", mimeBoundary);
   outputEnd(mimeBoundary);
   exit(0);
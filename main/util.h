@@ -1,8 +1,13 @@
+#pragma once
+
+#include <functional>
 #include <string>
 #include <vector>
 #include "json.hpp"
 #include "public/fpdfview.h"
 
+#include "options.h"
+
 /**
  * Utility functions built for spitting MIME form-data parts that map to
  * Overview StepOutputFragment "fragments".
@@ -33,7 +38,72 @@ getPageTextUtf8OrOutputErrorAndExit(
 );
 
 /**
- * Outputs the page's thumbnail fragment to stdout.
+ * Like the function above, but reads and writes the PAGE_CACHE store (see
+ * SegmentStore::fromEnvironment()) under the page's `fingerprint`.
+ */
+std::string
+getPageTextUtf8OrOutputErrorAndExit(
+    FPDF_PAGE fPage,
+    const std::string& fingerprint,
+    const std::string& mimeBoundary
+);
+
+/**
+ * An encoded page thumbnail.
+ */
+struct Thumbnail {
+  /** "png" or "jpg": the fragment is named "N-thumbnail.<extension>". */
+  const char* extension;
+
+  /** The encoded image. Only valid until the next render: we reuse buffers. */
+  const std::vector<uint8_t>* bytes;
+
+  /**
+   * One PNG per Options.extraThumbnailSizes entry, in the same order. Also
+   * only valid until the next render.
+   */
+  const std::vector<std::vector<uint8_t>>* extraPngs;
+
+  /**
+   * True if the image went straight to stdout (into its fragment) or to the
+   * caller's sink as we encoded it. Then `bytes` may be empty.
+   */
+  bool streamed;
+};
+
+/**
+ * Where encoders hand their bytes as they go.
+ */
+typedef std::function<void(const uint8_t* bytes, size_t nBytes)> ByteSink;
+
+/**
+ * Renders the page as a thumbnail: a JPEG if Options.thumbnailFormat says so
+ * or the page is just a JPEG scan, else a PNG.
+ *
+ * Hands the main thumbnail to `sink` as it's encoded, so even a thumbnail
+ * too big to render whole never sits in memory: Thumbnail.bytes is empty,
+ * unless it's a blank page's cached image (then `streamed` is false and
+ * `sink` gets nothing).
+ *
+ * If there's no space in memory for the image buffer, or encoding fails
+ * after `sink` has some of the image, outputs an "error" fragment and exits.
+ * The bytes are empty if encoding failed.
+ */
+Thumbnail
+renderPageThumbnailOrOutputErrorAndExit(
+  FPDF_PAGE fPage,
+  const Options& options,
+  const ByteSink& sink,
+  const std::string& mimeBoundary
+);
+
+/**
+ * Outputs the page's thumbnail fragment to stdout, followed by a
+ * "N-thumbnail-SIZE.png" fragment per Options.extraThumbnailSizes entry.
+ *
+ * A rendered thumbnail streams into its fragment chunk by chunk, as it's
+ * compressed: no buffer ever holds the whole file. So if encoding fails partway, the
+ * fragment is truncated and we output an "error" fragment and exit.
  *
  * If PDF is invalid or there's no space in memory for the image buffer, outputs
  * an "error" fragment and exits.
@@ -42,6 +112,24 @@ void
 outputPageThumbnailFragmentOrErrorAndExit(
   FPDF_PAGE fPage,
   int pageIndex,
+  const Options& options,
+  const std::string& mimeBoundary
+);
+
+/**
+ * Outputs the page's thumbnail fragments, like the function above -- but if
+ * an earlier page had the same `fingerprint`, or the PAGE_CACHE store (see
+ * SegmentStore::fromEnvironment()) holds a thumbnail for it with these
+ * options, outputs those bytes instead of rendering.
+ *
+ * Pages with the same fingerprint must render identically.
+ */
+void
+outputPageThumbnailFragmentOrErrorAndExit(
+  FPDF_PAGE fPage,
+  int pageIndex,
+  const std::string& fingerprint,
+  const Options& options,
   const std::string& mimeBoundary
 );
 
@@ -57,6 +145,18 @@ outputPageTextFragmentOrErrorAndExit(
   const std::string& mimeBoundary
 );
 
+/**
+ * Outputs the page's UTF-8 text, like the function above, reading and
+ * writing the page cache under the page's `fingerprint`.
+ */
+void
+outputPageTextFragmentOrErrorAndExit(
+  FPDF_PAGE fPage,
+  int pageIndex,
+  const std::string& fingerprint,
+  const std::string& mimeBoundary
+);
+
 /**
  * Low-level: writes a buffer to stdout or crashes.
  */
@@ -113,6 +213,34 @@ outputFragment(
   const std::string& mimeBoundary
 );
 
+/**
+ * Outputs a JSON fragment: `jsonTemplate` (the JSON Overview gave us), with
+ * `pdfMetadata`'s keys added to its "metadata" where the template doesn't set
+ * them, and then with `patch` applied as a JSON Merge Patch (RFC 7396).
+ *
+ * The result cache (see result-cache.h) records `pdfMetadata` and `patch`
+ * rather than the output, so it can replay this fragment for a different
+ * template.
+ */
+void
+outputJsonFragment(
+  const std::string& name,
+  const nlohmann::json& jsonTemplate,
+  const nlohmann::json& pdfMetadata,
+  const nlohmann::json& patch,
+  const std::string& mimeBoundary
+);
+
+/**
+ * Returns what outputJsonFragment() outputs.
+ */
+nlohmann::json
+buildOutputJson(
+  const nlohmann::json& jsonTemplate,
+  const nlohmann::json& pdfMetadata,
+  const nlohmann::json& patch
+);
+
 /**
  * Outputs an empty "done" fragment and exits.
  *
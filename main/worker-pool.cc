@@ -0,0 +1,109 @@
+#include <algorithm>
+
+#include "worker-pool.h"
+
+class WorkerPool::Batch {
+public:
+  Batch(size_t nTasks, const std::function<void(size_t)>& task)
+    : task(task), nTasks(nTasks), nClaimed(0), nFinished(0) {}
+
+  const std::function<void(size_t)>& task;
+  const size_t nTasks;
+  size_t nClaimed; // guarded by the pool's mutex
+  size_t nFinished; // guarded by the pool's mutex
+};
+
+WorkerPool::WorkerPool(size_t nThreads)
+  : stopping(false)
+{
+  for (size_t i = 1; i < nThreads; i++) {
+    workers.emplace_back(&WorkerPool::work, this);
+  }
+}
+
+WorkerPool::~WorkerPool()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  taskQueued.notify_all();
+  for (auto& worker : workers) {
+    worker.join();
+  }
+}
+
+std::shared_ptr<WorkerPool::Batch>
+WorkerPool::start(size_t nTasks, const std::function<void(size_t)>& task)
+{
+  std::shared_ptr<Batch> batch(new Batch(nTasks, task));
+  if (nTasks == 0 || workers.empty()) return batch; // wait() runs it all
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    queue.push_back(batch);
+  }
+  for (size_t i = 0; i < std::min(nTasks, workers.size()); i++) {
+    taskQueued.notify_one();
+  }
+  return batch;
+}
+
+/**
+ * Claims the next task of `batch` (which must have one), runs it without the
+ * lock, and counts it finished.
+ */
+void
+WorkerPool::runTask(std::unique_lock<std::mutex>& lock, Batch& batch)
+{
+  const size_t i = batch.nClaimed++;
+  if (batch.nClaimed == batch.nTasks) {
+    const auto it = std::find_if(queue.begin(), queue.end(), [&batch](const std::shared_ptr<Batch>& b) { return b.get() == &batch; });
+    if (it != queue.end()) queue.erase(it);
+  }
+
+  lock.unlock();
+  batch.task(i);
+  lock.lock();
+
+  if (++batch.nFinished == batch.nTasks) taskFinished.notify_all();
+}
+
+void
+WorkerPool::wait(Batch& batch)
+{
+  std::unique_lock<std::mutex> lock(mutex);
+  while (batch.nClaimed < batch.nTasks) {
+    runTask(lock, batch);
+  }
+  taskFinished.wait(lock, [&batch]() { return batch.nFinished == batch.nTasks; });
+}
+
+void
+WorkerPool::run(size_t nTasks, const std::function<void(size_t)>& task)
+{
+  wait(*start(nTasks, task));
+}
+
+void
+WorkerPool::work()
+{
+  std::unique_lock<std::mutex> lock(mutex);
+  while (true) {
+    taskQueued.wait(lock, [this]() { return stopping || !queue.empty(); });
+    if (stopping) return;
+
+    // Hold a reference: the batch's waiter may return as soon as we finish.
+    const std::shared_ptr<Batch> batch(queue.front());
+    runTask(lock, *batch);
+  }
+}
+
+WorkerPool&
+workerPool()
+{
+  // Never destroyed: exit() may run while a worker is mid-task, and joining
+  // it from a static destructor would hang.
+  static WorkerPool* pool = new WorkerPool(std::max(1u, std::thread::hardware_concurrency()));
+  return *pool;
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Threads that live as long as the process and run batches of tasks: chunks
+ * of a ParallelDeflater's input, or extra thumbnail sizes.
+ *
+ * Starting threads for every batch costs more than deflating a small
+ * thumbnail, and encoders that each started one thread per core would fight
+ * over the cores. So everything shares these: one thread per core, counting
+ * the caller.
+ *
+ * A caller that waits for its batch runs the batch's unclaimed tasks itself.
+ * So a task may start and wait for a batch of its own (an extra thumbnail
+ * size deflates on the pool, too): the batch finishes even if every worker is
+ * busy.
+ *
+ * Thread-safe.
+ */
+class WorkerPool {
+public:
+  class Batch;
+
+  /**
+   * Starts `nThreads - 1` workers: the caller of wait() is the last thread.
+   */
+  explicit WorkerPool(size_t nThreads);
+  ~WorkerPool();
+  WorkerPool(const WorkerPool&) = delete;
+  WorkerPool& operator=(const WorkerPool&) = delete;
+
+  /** Workers plus the caller. */
+  size_t nThreads() const { return workers.size() + 1; }
+
+  /**
+   * Queues `task(0)` ... `task(nTasks - 1)` for the workers, and returns
+   * right away. `task` must live until wait() returns.
+   */
+  std::shared_ptr<Batch> start(size_t nTasks, const std::function<void(size_t)>& task);
+
+  /**
+   * Runs the batch's unclaimed tasks on this thread, then waits for the rest.
+   */
+  void wait(Batch& batch);
+
+  /**
+   * start() and wait().
+   */
+  void run(size_t nTasks, const std::function<void(size_t)>& task);
+
+private:
+  void work();
+  void runTask(std::unique_lock<std::mutex>& lock, Batch& batch);
+
+  std::mutex mutex;
+  std::condition_variable taskQueued;
+  std::condition_variable taskFinished;
+  std::deque<std::shared_ptr<Batch>> queue; // batches with unclaimed tasks
+  bool stopping;
+  std::vector<std::thread> workers;
+};
+
+/**
+ * Returns this process's WorkerPool: one thread per core.
+ */
+WorkerPool&
+workerPool();
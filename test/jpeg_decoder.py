@@ -0,0 +1,125 @@
+import struct
+
+
+# Decodes baseline JPEG bytes to (width, height, mcu_size, means): the mean
+# RGB color of each MCU -- each 8x8 or 16x16 square of pixels -- row by row.
+#
+# JPEG pixels depend on libjpeg's version and DCT, so tests compare average
+# colors rather than pixels. An 8x8 block's average is its DC coefficient:
+# we Huffman-decode every coefficient but skip the inverse DCT.
+def decode_jpeg_mcu_means(b):
+    if b[:2] != b"\xff\xd8":
+        raise ValueError("not a JPEG")
+
+    quant = {}
+    huffman = {}
+    components = []
+    pos = 2
+    while True:
+        (marker, length) = struct.unpack(">xBH", b[pos : pos + 4])
+        data = b[pos + 4 : pos + 2 + length]
+        pos += 2 + length
+        if marker == 0xDB:
+            i = 0
+            while i < len(data):
+                if data[i] >> 4:
+                    raise ValueError("16-bit quantization tables are not supported")
+                quant[data[i] & 15] = data[i + 1]  # we only need the DC entry
+                i += 65
+        elif marker == 0xC4:
+            i = 0
+            while i < len(data):
+                counts = data[i + 1 : i + 17]
+                values = data[i + 17 : i + 17 + sum(counts)]
+                codes = {}
+                code = 0
+                k = 0
+                for (n_bits, count) in enumerate(counts, 1):
+                    for _ in range(count):
+                        codes[(n_bits, code)] = values[k]
+                        code += 1
+                        k += 1
+                    code <<= 1
+                huffman[data[i]] = codes  # key: class << 4 | id
+                i += 17 + len(values)
+        elif marker in (0xC0, 0xC1):
+            (height, width, n_components) = struct.unpack(">HHB", data[1:6])
+            for c in range(n_components):
+                (cid, sampling, tq) = struct.unpack(">BBB", data[6 + c * 3 : 9 + c * 3])
+                components.append({"id": cid, "h": sampling >> 4, "v": sampling & 15, "tq": tq})
+        elif marker == 0xDD:
+            if struct.unpack(">H", data[:2])[0] != 0:
+                raise ValueError("restart intervals are not supported")
+        elif marker == 0xDA:
+            for c in range(data[0]):
+                (cid, tables) = struct.unpack(">BB", data[1 + c * 2 : 3 + c * 2])
+                component = next(comp for comp in components if comp["id"] == cid)
+                component["dc"] = huffman[tables >> 4]
+                component["ac"] = huffman[0x10 | (tables & 15)]
+            break
+        elif 0xC2 <= marker <= 0xCF and marker not in (0xC4, 0xC8, 0xCC):
+            raise ValueError("only baseline JPEGs are supported")
+
+    # Entropy-coded data runs to the next marker; "\xff\x00" means "\xff"
+    end = pos
+    while not (b[end] == 0xFF and b[end + 1] != 0):
+        end += 1
+    bits = "".join(format(byte, "08b") for byte in b[pos:end].replace(b"\xff\x00", b"\xff"))
+
+    bit_pos = [0]
+
+    def decode(codes):
+        code = 0
+        for n_bits in range(1, 17):
+            code = (code << 1) | (bits[bit_pos[0]] == "1")
+            bit_pos[0] += 1
+            if (n_bits, code) in codes:
+                return codes[(n_bits, code)]
+        raise ValueError("bad Huffman code")
+
+    def receive_extend(n_bits):
+        if n_bits == 0:
+            return 0
+        v = int(bits[bit_pos[0] : bit_pos[0] + n_bits], 2)
+        bit_pos[0] += n_bits
+        return v if v >= 1 << (n_bits - 1) else v - (1 << n_bits) + 1
+
+    h_max = max(c["h"] for c in components)
+    v_max = max(c["v"] for c in components)
+    mcu_size = (8 * h_max, 8 * v_max)
+    n_mcus_x = (width + mcu_size[0] - 1) // mcu_size[0]
+    n_mcus_y = (height + mcu_size[1] - 1) // mcu_size[1]
+    for c in components:
+        c["pred"] = 0
+
+    means = []
+    for _ in range(n_mcus_x * n_mcus_y):
+        averages = []
+        for c in components:
+            total = 0
+            for _ in range(c["h"] * c["v"]):
+                c["pred"] += receive_extend(decode(c["dc"]))
+                total += c["pred"]
+                k = 1
+                while k < 64:
+                    rs = decode(c["ac"])
+                    if rs & 15:
+                        k += (rs >> 4) + 1
+                        receive_extend(rs & 15)
+                    elif rs == 0xF0:
+                        k += 16
+                    else:
+                        break
+            averages.append(total / (c["h"] * c["v"]) * quant[c["tq"]] / 8 + 128)
+
+        if len(averages) == 1:
+            means.append((averages[0],) * 3)
+        else:
+            (y, cb, cr) = averages
+            means.append((
+                y + 1.402 * (cr - 128),
+                y - 0.344136 * (cb - 128) - 0.714136 * (cr - 128),
+                y + 1.772 * (cb - 128),
+            ))
+
+    return (width, height, mcu_size, means)
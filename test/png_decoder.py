@@ -0,0 +1,105 @@
+import struct
+import zlib
+
+
+# Decodes PNG bytes to (width, height, rgb_bytes).
+#
+# Thumbnails may use any non-interlaced 8-bit-or-less color type; we expand
+# them all to RGB so tests can compare pixels instead of compressed bytes.
+# (Compressed bytes depend on the deflate implementation and filter choices.)
+def decode_png_to_rgb(b):
+    if b[:8] != b"\x89PNG\r\n\x1a\n":
+        raise ValueError("not a PNG")
+
+    pos = 8
+    idat = []
+    palette = None
+    while pos < len(b):
+        (length, chunk_type) = struct.unpack(">I4s", b[pos : pos + 8])
+        data = b[pos + 8 : pos + 8 + length]
+        pos += 12 + length
+        if chunk_type == b"IHDR":
+            (width, height, bit_depth, color_type, _, _, interlace) = struct.unpack(
+                ">IIBBBBB", data
+            )
+        elif chunk_type == b"PLTE":
+            palette = data
+        elif chunk_type == b"IDAT":
+            idat.append(data)
+        elif chunk_type == b"IEND":
+            break
+
+    if interlace != 0:
+        raise ValueError("interlaced PNGs are not supported")
+    if bit_depth > 8:
+        raise ValueError("16-bit PNGs are not supported")
+
+    channels = {0: 1, 2: 3, 3: 1, 4: 2, 6: 4}[color_type]
+    bits_per_pixel = channels * bit_depth
+    bpp = max(1, bits_per_pixel // 8)  # "bytes per pixel", for filters
+    stride = (width * bits_per_pixel + 7) // 8
+
+    raw = zlib.decompress(b"".join(idat))
+    rows = []
+    prev = bytearray(stride)
+    for y in range(height):
+        filter_type = raw[y * (stride + 1)]
+        line = bytearray(raw[y * (stride + 1) + 1 : (y + 1) * (stride + 1)])
+        if filter_type == 1:
+            for i in range(bpp, stride):
+                line[i] = (line[i] + line[i - bpp]) & 0xFF
+        elif filter_type == 2:
+            for i in range(stride):
+                line[i] = (line[i] + prev[i]) & 0xFF
+        elif filter_type == 3:
+            for i in range(stride):
+                left = line[i - bpp] if i >= bpp else 0
+                line[i] = (line[i] + ((left + prev[i]) >> 1)) & 0xFF
+        elif filter_type == 4:
+            for i in range(stride):
+                a = line[i - bpp] if i >= bpp else 0
+                b_ = prev[i]
+                c = prev[i - bpp] if i >= bpp else 0
+                p = a + b_ - c
+                pa = abs(p - a)
+                pb = abs(p - b_)
+                pc = abs(p - c)
+                if pa <= pb and pa <= pc:
+                    pred = a
+                elif pb <= pc:
+                    pred = b_
+                else:
+                    pred = c
+                line[i] = (line[i] + pred) & 0xFF
+        rows.append(bytes(line))
+        prev = line
+
+    rgb = bytearray()
+    for line in rows:
+        if bit_depth < 8:
+            mask = (1 << bit_depth) - 1
+            samples = [
+                (line[(x * bit_depth) // 8] >> (8 - bit_depth - (x * bit_depth) % 8))
+                & mask
+                for x in range(width)
+            ]
+        else:
+            samples = line
+
+        if color_type == 0:
+            scale = 255 // ((1 << bit_depth) - 1)
+            for v in samples:
+                rgb += bytes((v * scale,) * 3)
+        elif color_type == 2:
+            rgb += samples
+        elif color_type == 3:
+            for v in samples:
+                rgb += palette[v * 3 : v * 3 + 3]
+        elif color_type == 4:
+            for x in range(width):
+                rgb += bytes((samples[x * 2],) * 3)
+        else:
+            for x in range(width):
+                rgb += samples[x * 4 : x * 4 + 3]
+
+    return (width, height, bytes(rgb))
@@ -6,10 +6,14 @@ import os
 import os.path
 import re
 import shutil
+import struct
 import subprocess
+import tempfile
 import unittest
 
 import multipart
+from jpeg_decoder import decode_jpeg_mcu_means
+from png_decoder import decode_png_to_rgb
 
 TestDir = "/tmp/test-split-and-extract-pdf"
 
@@ -31,22 +35,30 @@ def read_file_bytes(path):
 
 # Runs do-convert-stream-to-mime-multipart on the test case in question (named
 # after a directory such as 'test-xyz') and returns (retval, stdout, stderr).
-def run_test_case(dirname):
+#
+# `options`, if given, are added to the test case's input.json: that way, tests
+# of one option can share a test case's input.blob and expected fragments.
+# `env`, if given, adds environment variables (such as PAGE_CACHE_DIR).
+def run_test_case(dirname, options=None, env=None):
     if os.path.exists(TestDir):
         shutil.rmtree(TestDir)
     os.makedirs(TestDir)
     srcdir = "/app/test/" + dirname
+    input_json = read_file_bytes(srcdir + "/input.json").decode("utf-8")
+    if options:
+        input_json = json.dumps(dict(json.loads(input_json), **options))
     with open(srcdir + "/input.blob", "rb") as input_blob:
         completed = subprocess.run(
             [
                 "/app/do-convert-stream-to-mime-multipart",
                 "MIME-BOUNDARY",
-                read_file_bytes(srcdir + "/input.json").decode("utf-8"),
+                input_json,
             ],
             stdin=input_blob,
             stdout=subprocess.PIPE,
             stderr=subprocess.PIPE,
             cwd=TestDir,
+            env=dict(os.environ, **env) if env else None,
         )
     return (completed.returncode, completed.stdout, completed.stderr)
 
@@ -62,6 +74,78 @@ def bytes_to_fragments(b):
     return ret
 
 
+def jpeg_dimensions(b):
+    # Walk JPEG markers to the start-of-frame, which holds height and width
+    assert b[:2] == b"\xff\xd8", "not a JPEG"
+    pos = 2
+    while pos < len(b):
+        marker = b[pos + 1]
+        length = (b[pos + 2] << 8) | b[pos + 3]
+        if marker in (0xC0, 0xC1, 0xC2):
+            height = (b[pos + 5] << 8) | b[pos + 6]
+            width = (b[pos + 7] << 8) | b[pos + 8]
+            return (width, height)
+        pos += 2 + length
+    raise ValueError("JPEG has no start-of-frame")
+
+
+def png_dimensions(b):
+    # The IHDR chunk comes first and starts with width and height
+    assert b[:8] == b"\x89PNG\r\n\x1a\n", "not a PNG"
+    return struct.unpack(">II", b[16:24])
+
+
+def segment_bytes(cache_dir):
+    # How much a SegmentStore directory's segments hold: it only grows on a put
+    return sum(
+        os.path.getsize(os.path.join(cache_dir, name))
+        for name in os.listdir(cache_dir)
+        if name.startswith("segment-")
+    )
+
+
+def png_zlib_header(b):
+    # The first two bytes of the first IDAT chunk: CMF and FLG
+    pos = 8
+    while pos < len(b):
+        (length, chunk_type) = struct.unpack(">I4s", b[pos : pos + 8])
+        if chunk_type == b"IDAT":
+            return b[pos + 8 : pos + 10]
+        pos += 12 + length
+    raise ValueError("PNG has no IDAT chunk")
+
+
+def thumbnail_colors(fragment, points):
+    # The colors at (x, y) `points` of a PNG or JPEG thumbnail. For a JPEG,
+    # that's the average color of the 8x8 or 16x16 square around each point.
+    if fragment.name.endswith(".png"):
+        (width, _, rgb) = decode_png_to_rgb(fragment.bytes)
+        return [tuple(rgb[(y * width + x) * 3 : (y * width + x) * 3 + 3]) for (x, y) in points]
+    (width, _, (mcu_width, mcu_height), means) = decode_jpeg_mcu_means(fragment.bytes)
+    n_mcus_x = (width + mcu_width - 1) // mcu_width
+    return [means[(y // mcu_height) * n_mcus_x + x // mcu_width] for (x, y) in points]
+
+
+def colors_page_0_pixel(x, y, scale):
+    # The color of pixel (x, y) of a thumbnail of test-split-and-extract-colors'
+    # first page -- a red square and a blue bar on white, above a line of text
+    # -- at `scale` pixels per point. None means it depends on antialiasing.
+    px = (x + 0.5) / scale
+    py = 200 - (y + 0.5) / scale  # PDF y goes up
+    if py < 40:
+        return None  # the text
+    margin = 1.5 / scale
+    for (left, bottom, right, top, color) in (
+        (50, 50, 150, 150, (255, 0, 0)),
+        (20, 160, 60, 180, (0, 0, 255)),
+    ):
+        if left + margin < px < right - margin and bottom + margin < py < top - margin:
+            return color
+        if left - margin < px < right + margin and bottom - margin < py < top + margin:
+            return None
+    return (255, 255, 255)
+
+
 def normalize_pdf_bytes(b):
     b = re.sub(rb"/CreationDate\(D:[0-9]{14}\)", b"/CreationDate(D:XXXXXXXXXXXXXX)", b)
     b = re.sub(
@@ -104,8 +188,8 @@ class TestSplitPdfAndExtractText(unittest.TestCase):
             "Wrong contents in fragment {}".format(name),
         )
 
-    def _runAndGatherFragments(self, testDir):
-        (retval, stdout, stderr) = run_test_case(testDir)
+    def _runAndGatherFragments(self, testDir, options=None, env=None):
+        (retval, stdout, stderr) = run_test_case(testDir, options, env)
         self.assertEqual(
             b"", stderr, "Got error on stderr: {}".format(stderr.decode("utf-8"))
         )
@@ -129,15 +213,71 @@ class TestSplitPdfAndExtractText(unittest.TestCase):
                 self.assertEqual(
                     json.loads(expect_fragment.bytes), json.loads(actual_fragment.bytes)
                 )
+            elif expect_fragment.name.endswith(".png"):
+                # Compare pixels: compressed bytes depend on the encoder
+                self.assertEqual(
+                    decode_png_to_rgb(expect_fragment.bytes),
+                    decode_png_to_rgb(actual_fragment.bytes),
+                    "Wrong pixels in fragment {}".format(expect_fragment.name),
+                )
             else:
                 self.assertFragmentBytesEqual(
                     expect_fragment.name, expect_fragment.bytes, actual_fragment.bytes
                 )
 
+    def assertColorsPage0Pixels(self, png, size):
+        (width, height, rgb) = decode_png_to_rgb(png)
+        self.assertEqual((size, size), (width, height))
+        scale = size / 200
+        for y in range(height):
+            for x in range(width):
+                expect = colors_page_0_pixel(x, y, scale)
+                if expect is not None:
+                    i = (y * width + x) * 3
+                    actual = tuple(rgb[i : i + 3])
+                    if actual != expect:
+                        self.fail("Pixel ({}, {}) is {}; expected {}".format(x, y, actual, expect))
+
+    def assertJpegLooksLikePng(self, jpeg, png):
+        # JPEG bytes depend on libjpeg's version. Check the markers, then that
+        # each 8x8 or 16x16 square averages the same color as in the PNG.
+        self.assertEqual(b"\xff\xd8", jpeg[:2], "JPEG has no start-of-image")
+        self.assertEqual(b"\xff\xd9", jpeg[-2:], "JPEG has no end-of-image")
+        (width, height, rgb) = decode_png_to_rgb(png)
+        (jpeg_width, jpeg_height, (mcu_width, mcu_height), means) = decode_jpeg_mcu_means(jpeg)
+        self.assertEqual((width, height), (jpeg_width, jpeg_height))
+        n_mcus_x = (width + mcu_width - 1) // mcu_width
+        for (i, mean) in enumerate(means):
+            (x0, y0) = ((i % n_mcus_x) * mcu_width, (i // n_mcus_x) * mcu_height)
+            if x0 + mcu_width > width or y0 + mcu_height > height:
+                continue  # libjpeg pads edge squares
+            expect = [
+                sum(rgb[((y0 + y) * width + x0 + x) * 3 + c] for y in range(mcu_height) for x in range(mcu_width))
+                / (mcu_width * mcu_height)
+                for c in range(3)
+            ]
+            if max(abs(a - b) for (a, b) in zip(mean, expect)) > 4:
+                self.fail("Square at ({}, {}) averages {}; expected {}".format(x0, y0, mean, expect))
+
     def _testFragments(self, testDir, expect):
         fragments = self._runAndGatherFragments(testDir)
         self._expectFragments(testDir, expect, fragments)
 
+    def _runExtract2PagesWithOptions(self, options, expect_names):
+        # Runs test-extract-2-pages with `options`, checks the fragment names
+        # and that 0.json and 0.txt are as usual, and returns fragments by name.
+        # Thumbnails are up to the caller: they depend on the options.
+        test_dir = "test-extract-2-pages"
+        fragments = self._runAndGatherFragments(test_dir, options)
+        self.assertEqual(expect_names, [fragment.name for fragment in fragments])
+        by_name = dict((fragment.name, fragment) for fragment in fragments)
+        self._expectFragments(
+            test_dir,
+            [load_expected_fragment(test_dir, "0.json"), load_expected_fragment(test_dir, "0.txt")],
+            [by_name["0.json"], by_name["0.txt"]],
+        )
+        return by_name
+
     def test_split_and_extract_2_pages(self):
         test_dir = "test-split-and-extract-2-pages"
         self._testFragments(
@@ -184,6 +324,379 @@ class TestSplitPdfAndExtractText(unittest.TestCase):
             ]
         )
 
+    def test_extract_fast_thumbnail_quality(self):
+        fragments = self._runExtract2PagesWithOptions(
+            {"thumbnailQuality": "fast"},
+            ["0.json", "inherit-blob", "0-thumbnail.png", "progress", "0.txt", "done"],
+        )
+        # Without anti-aliasing, edges come out jagged: pixels differ from the
+        # default tier's, but only along edges. Size and text do not differ.
+        (width, height, rgb) = decode_png_to_rgb(fragments["0-thumbnail.png"].bytes)
+        (_, _, expect_rgb) = decode_png_to_rgb(load_expected_fragment("test-extract-2-pages", "0-thumbnail.png").bytes)
+        self.assertEqual((700, 700), (width, height))
+        self.assertNotEqual(expect_rgb, rgb)
+        diffs = [abs(a - b) for (a, b) in zip(rgb, expect_rgb)]
+        self.assertLessEqual(sum(diffs) / len(diffs), 8, "Mean difference from the default tier is too big")
+        self.assertGreaterEqual(sum(1 for d in diffs if d <= 16) / len(diffs), 0.9, "Too many pixels differ from the default tier's")
+
+    def test_extract_extra_thumbnail_sizes(self):
+        fragments = self._runExtract2PagesWithOptions(
+            {"extraThumbnailSizes": [100]},
+            ["0.json", "inherit-blob", "0-thumbnail.png", "0-thumbnail-100.png", "progress", "0.txt", "done"],
+        )
+        self._expectFragments(
+            "test-extract-2-pages",
+            [load_expected_fragment("test-extract-2-pages", "0-thumbnail.png")],
+            [fragments["0-thumbnail.png"]],
+        )
+        # The 100px thumbnail averages each 7x7 box of the 700px one
+        (width, height, rgb) = decode_png_to_rgb(fragments["0-thumbnail.png"].bytes)
+        (small_width, small_height, small_rgb) = decode_png_to_rgb(fragments["0-thumbnail-100.png"].bytes)
+        self.assertEqual((100, 100), (small_width, small_height))
+        expect = bytearray()
+        for y in range(100):
+            for x in range(100):
+                for c in range(3):
+                    total = sum(
+                        rgb[((y * 7 + dy) * width + x * 7 + dx) * 3 + c]
+                        for dy in range(7)
+                        for dx in range(7)
+                    )
+                    expect.append((total + 24) // 49)
+        self.assertEqual(bytes(expect), small_rgb)
+
+        # Sizes name fragments: each must be distinct and below thumbnailSize.
+        # Sizes too big for an int aren't wrapped into small ones.
+        for (options, expect_error) in (
+            ({"extraThumbnailSizes": [700]}, b"Invalid extraThumbnailSizes [700]"),
+            ({"extraThumbnailSizes": [100, 100]}, b"Invalid extraThumbnailSizes [100,100]"),
+            ({"extraThumbnailSizes": [4294967301]}, b"Invalid extraThumbnailSizes [4294967301]"),
+            ({"thumbnailSize": 140, "extraThumbnailSizes": [200]}, b"Invalid extraThumbnailSizes [200]"),
+        ):
+            fragments = self._runAndGatherFragments("test-extract-2-pages", options)
+            self.assertEqual(["error"], [fragment.name for fragment in fragments])
+            self.assertTrue(fragments[0].bytes.startswith(expect_error), fragments[0].bytes)
+        fragments = self._runAndGatherFragments("test-extract-2-pages", {"thumbnailSize": 140, "extraThumbnailSizes": [139]})
+        self.assertEqual((139, 139), png_dimensions(fragments[3].bytes))
+        self.assertEqual("0-thumbnail-139.png", fragments[3].name)
+
+    def test_extract_thumbnail_size(self):
+        fragments = self._runExtract2PagesWithOptions(
+            {"thumbnailSize": 140},
+            ["0.json", "inherit-blob", "0-thumbnail.png", "progress", "0.txt", "done"],
+        )
+        # The page is square
+        (width, height, _) = decode_png_to_rgb(fragments["0-thumbnail.png"].bytes)
+        self.assertEqual((140, 140), (width, height))
+
+        # Sizes outside 16-2000 are clamped, not errors
+        for (size, expect) in ((1, 16), (16, 16), (2000, 2000), (5000, 2000)):
+            fragments = self._runExtract2PagesWithOptions(
+                {"thumbnailSize": size},
+                ["0.json", "inherit-blob", "0-thumbnail.png", "progress", "0.txt", "done"],
+            )
+            self.assertEqual((expect, expect), png_dimensions(fragments["0-thumbnail.png"].bytes), "thumbnailSize {}".format(size))
+
+        # A size that isn't an integer is an error
+        fragments = self._runAndGatherFragments("test-extract-2-pages", {"thumbnailSize": "big"})
+        self.assertEqual(["error"], [fragment.name for fragment in fragments])
+        self.assertEqual(b'Invalid thumbnailSize "big": expected an integer', fragments[0].bytes)
+
+    def test_extract_png_compression_level(self):
+        # Same pixels as test-extract-2-pages; only the deflate level differs.
+        # The zlib header's FLEVEL says which: 0 for level 1 (our default), 2
+        # for 6, 3 for 9.
+        for (options, flevel) in (({}, 0), ({"pngCompressionLevel": 6}, 2), ({"pngCompressionLevel": 9}, 3)):
+            fragments = self._runExtract2PagesWithOptions(
+                options,
+                ["0.json", "inherit-blob", "0-thumbnail.png", "progress", "0.txt", "done"],
+            )
+            self._expectFragments(
+                "test-extract-2-pages",
+                [load_expected_fragment("test-extract-2-pages", "0-thumbnail.png")],
+                [fragments["0-thumbnail.png"]],
+            )
+            self.assertEqual(flevel, png_zlib_header(fragments["0-thumbnail.png"].bytes)[1] >> 6, "Wrong FLEVEL for {}".format(options))
+
+    def test_extract_thumbnail_format_jpeg(self):
+        fragments = self._runExtract2PagesWithOptions(
+            {"thumbnailFormat": "jpeg"},
+            ["0.json", "inherit-blob", "0-thumbnail.jpg", "progress", "0.txt", "done"],
+        )
+        self.assertJpegLooksLikePng(
+            fragments["0-thumbnail.jpg"].bytes,
+            load_expected_fragment("test-extract-2-pages", "0-thumbnail.png").bytes,
+        )
+
+        # And in color: a red square and a blue bar
+        test_dir = "test-split-and-extract-colors"
+        png = self._runAndGatherFragments(test_dir, {"wantSplitByPage": False})[2]
+        jpeg = self._runAndGatherFragments(test_dir, {"wantSplitByPage": False, "thumbnailFormat": "jpeg"})[2]
+        self.assertEqual(("0-thumbnail.png", "0-thumbnail.jpg"), (png.name, jpeg.name))
+        self.assertJpegLooksLikePng(jpeg.bytes, png.bytes)
+
+    def test_extract_color_thumbnail(self):
+        # A red square and a blue bar: we render RGB straight into the bitmap
+        # we encode. Every pixel must keep its channels in order.
+        test_dir = "test-split-and-extract-colors"
+        fragments = self._runAndGatherFragments(test_dir, {"wantSplitByPage": False})
+        self.assertEqual(
+            ["0.json", "inherit-blob", "0-thumbnail.png", "progress", "progress", "0.txt", "done"],
+            [fragment.name for fragment in fragments],
+        )
+        self.assertColorsPage0Pixels(fragments[2].bytes, 700)
+
+    def test_split_and_extract_gray_page(self):
+        # Page 1 is a 50% gray square and black text: we render it in 8-bit
+        # gray. Page 0 has color, so it must not be.
+        test_dir = "test-split-and-extract-colors"
+        fragments = self._runAndGatherFragments(test_dir)
+        self.assertEqual(("0-thumbnail.png", "1-thumbnail.png"), (fragments[2].name, fragments[7].name))
+
+        (width, height, rgb) = decode_png_to_rgb(fragments[7].bytes)
+        self.assertEqual((700, 700), (width, height))
+        for i in range(0, len(rgb), 3):
+            if not rgb[i] == rgb[i + 1] == rgb[i + 2]:
+                self.fail("Pixel ({}, {}) is not gray".format(i // 3 % width, i // 3 // width))
+        center = rgb[(350 * width + 350) * 3]
+        self.assertLessEqual(abs(center - 128), 1)
+
+        self.assertEqual([(255, 0, 0)], thumbnail_colors(fragments[2], [(350, 350)]))
+
+    def test_split_and_extract_blank_page(self):
+        # Page 2 only paints white: we skip rendering it and output our one
+        # encoded white thumbnail.
+        test_dir = "test-split-and-extract-colors"
+        fragments = self._runAndGatherFragments(test_dir)
+        self.assertEqual("2-thumbnail.png", fragments[12].name)
+        (width, height, rgb) = decode_png_to_rgb(fragments[12].bytes)
+        self.assertEqual((700, 700), (width, height))
+        self.assertEqual(b"\xff" * (3 * width * height), rgb)
+
+    def test_extract_banded_thumbnail(self):
+        # 1200px RGB is too big to render whole: we render bands and stream each
+        # band's PNG rows into the fragment as we go. Every band must land in
+        # place.
+        test_dir = "test-split-and-extract-colors"
+        fragments = self._runAndGatherFragments(test_dir, {"wantSplitByPage": False, "thumbnailSize": 1200})
+        self.assertEqual(
+            ["0.json", "inherit-blob", "0-thumbnail.png", "progress", "progress", "0.txt", "done"],
+            [fragment.name for fragment in fragments],
+        )
+        self.assertColorsPage0Pixels(fragments[2].bytes, 1200)
+
+    def test_split_and_extract_scans(self):
+        # Each page is one image of four colored quadrants, covering the page.
+        # Page 0 draws it upright: we shrink the image instead of rendering.
+        # The rest mirror, flip or rotate it: we must render those, or the
+        # thumbnails come out as the image is stored, not as it's drawn.
+        test_dir = "test-split-and-extract-scans"
+        fragments = self._runAndGatherFragments(test_dir)
+        thumbnails = [fragment for fragment in fragments if fragment.name.endswith("-thumbnail.png")]
+        self.assertEqual(["0-thumbnail.png", "1-thumbnail.png", "2-thumbnail.png", "3-thumbnail.png"], [t.name for t in thumbnails])
+        (red, green, blue, white) = ((255, 0, 0), (0, 255, 0), (0, 0, 255), (255, 255, 255))
+        for (thumbnail, expect) in zip(
+            thumbnails,
+            [
+                [red, green, blue, white],
+                [green, red, white, blue],
+                [blue, white, red, green],
+                [green, white, red, blue],
+            ],
+        ):
+            (width, height, rgb) = decode_png_to_rgb(thumbnail.bytes)
+            self.assertEqual((700, 467), (width, height))
+            actual = []
+            for (x, y) in ((175, 117), (525, 117), (175, 350), (525, 350)):
+                i = (y * width + x) * 3
+                actual.append(tuple(rgb[i : i + 3]))
+            self.assertEqual(expect, actual, "Wrong quadrant colors in {}".format(thumbnail.name))
+
+    def test_split_and_extract_jpeg_scans(self):
+        # Each page is a JPEG of four colored quadrants, covering the page.
+        # Page 0's we shrink with libjpeg. Page 1's has a /Decode array that
+        # inverts its colors. Page 2's holds RGB that libjpeg would take for
+        # YCbCr, and /ColorTransform 0 to say it isn't. Only PDFium gets
+        # those two right. Pages 3 and 4 hold the same JPEG bytes, and page
+        # 3's image (which comes second in the file) has the /Decode array:
+        # we can't tell which image is which, so PDFium decodes both.
+        test_dir = "test-split-and-extract-jpeg-scans"
+        fragments = self._runAndGatherFragments(test_dir)
+        thumbnails = [fragment for fragment in fragments if "-thumbnail." in fragment.name]
+        self.assertEqual("0-thumbnail.jpg", thumbnails[0].name)  # libjpeg's
+        self.assertEqual(
+            ["1-thumbnail", "2-thumbnail", "3-thumbnail", "4-thumbnail"],
+            [t.name.split(".")[0] for t in thumbnails[1:]],
+        )
+        (red, green, blue, white) = ((255, 0, 0), (0, 255, 0), (0, 0, 255), (255, 255, 255))
+        (cyan, magenta, yellow, black) = ((0, 255, 255), (255, 0, 255), (255, 255, 0), (0, 0, 0))
+        for (thumbnail, expect) in zip(
+            thumbnails,
+            [
+                [red, green, blue, white],
+                [cyan, magenta, yellow, black],
+                [red, green, blue, white],
+                [cyan, magenta, yellow, black],
+                [red, green, blue, white],
+            ],
+        ):
+            actual = thumbnail_colors(thumbnail, [(175, 117), (525, 117), (175, 350), (525, 350)])
+            for (actual_color, expect_color) in zip(actual, expect):
+                if max(abs(a - b) for (a, b) in zip(actual_color, expect_color)) > 12:
+                    self.fail("Wrong quadrant colors in {}: {}; expected {}".format(thumbnail.name, actual, expect))
+
+    def test_extract_thumbnail_format_auto(self):
+        # A photo with a caption gets a JPEG; every other test's text pages
+        # get PNGs. "auto" is the default.
+        test_dir = "test-extract-thumbnail-format-auto"
+        for options in (None, {"thumbnailFormat": "auto"}):
+            fragments = self._runAndGatherFragments(test_dir, options)
+            self.assertEqual(
+                ["0.json", "inherit-blob", "0-thumbnail.jpg", "0.txt", "done"],
+                [fragment.name for fragment in fragments],
+            )
+            self.assertEqual((700, 520), jpeg_dimensions(fragments[2].bytes))
+            self._expectFragments(
+                test_dir,
+                [load_expected_fragment(test_dir, "0.json"), load_expected_fragment(test_dir, "0.txt")],
+                [fragments[0], fragments[3]],
+            )
+
+        fragments = self._runAndGatherFragments(test_dir, {"thumbnailFormat": "png"})
+        self.assertEqual("0-thumbnail.png", fragments[2].name)
+
+    def test_split_and_extract_thumbnail_format_auto_line_art(self):
+        # Pages that images cover, but not photos: a 1-bit, two-color grid
+        # and an 8-bit gray scan of strokes. Both stay PNG -- even the grid at
+        # 2000px, which renders in bands with no pixels to look at first.
+        test_dir = "test-split-and-extract-line-art"
+        fragments = self._runAndGatherFragments(test_dir)
+        self.assertEqual(
+            [
+                "progress", "0.json", "0-thumbnail.png", "0.txt", "0.blob",
+                "progress", "1.json", "1-thumbnail.png", "1.txt", "1.blob",
+                "done",
+            ],
+            [fragment.name for fragment in fragments],
+        )
+        for fragment in (fragments[2], fragments[7]):
+            self.assertEqual(700, png_dimensions(fragment.bytes)[0])
+
+        fragments = self._runAndGatherFragments(test_dir, {"wantSplitByPage": False, "thumbnailSize": 2000})
+        self.assertEqual("0-thumbnail.png", fragments[2].name)
+        self.assertEqual(2000, png_dimensions(fragments[2].bytes)[0])
+
+    def test_extract_thumbnail_sprite(self):
+        test_dir = "test-extract-2-pages"
+        fragments = self._runAndGatherFragments(test_dir, {"thumbnailSpritePages": 10})
+        self.assertEqual(
+            ["0.json", "inherit-blob", "0-thumbnail.png", "progress", "0-thumbnail-sprite.png", "0.txt", "done"],
+            [fragment.name for fragment in fragments],
+        )
+        # thumbnailSpritePages is 10, but there are only two pages to tile
+        expect_json = json.loads(load_expected_fragment(test_dir, "0.json").bytes)
+        expect_json["thumbnailSprite"] = {
+            "width": 256,
+            "height": 128,
+            "pages": [
+                {"x": 0, "y": 0, "width": 128, "height": 128},
+                {"x": 128, "y": 0, "width": 128, "height": 128},
+            ],
+        }
+        self.assertEqual(expect_json, json.loads(fragments[0].bytes))
+        self._expectFragments(
+            test_dir,
+            [load_expected_fragment(test_dir, "0-thumbnail.png"), load_expected_fragment(test_dir, "0.txt")],
+            [fragments[2], fragments[5]],
+        )
+        (width, height, _) = decode_png_to_rgb(fragments[4].bytes)
+        self.assertEqual((256, 128), (width, height))
+
+        # A count too big for an int is an error, not a wrapped-around 1
+        fragments = self._runAndGatherFragments(test_dir, {"thumbnailSpritePages": 4294967297})
+        self.assertEqual(["error"], [fragment.name for fragment in fragments])
+        self.assertEqual(b"Invalid thumbnailSpritePages 4294967297: expected an integer from 0 to 256", fragments[0].bytes)
+
+    def test_split_and_extract_repeated_pages(self):
+        # Pages 0 and 2 are the same page, so page 2 reuses page 0's
+        # thumbnail. Page 1 has the same content on a wider page: its PDF
+        # differs, so it gets its own thumbnail.
+        test_dir = "test-split-and-extract-repeated-pages"
+        fragments = self._runAndGatherFragments(test_dir)
+        self.assertEqual(
+            [
+                "progress", "0.json", "0-thumbnail.png", "0.txt", "0.blob",
+                "progress", "1.json", "1-thumbnail.png", "1.txt", "1.blob",
+                "progress", "2.json", "2-thumbnail.png", "2.txt", "2.blob",
+                "done",
+            ],
+            [fragment.name for fragment in fragments],
+        )
+        self.assertEqual(fragments[2].bytes, fragments[12].bytes)
+        self.assertEqual(fragments[3].bytes, fragments[13].bytes)
+        self.assertEqual(normalize_pdf_bytes(fragments[4].bytes), normalize_pdf_bytes(fragments[14].bytes))
+        self.assertEqual((700, 700), png_dimensions(fragments[2].bytes))
+        self.assertEqual((700, 467), png_dimensions(fragments[7].bytes))
+        self.assertNotEqual(normalize_pdf_bytes(fragments[4].bytes), normalize_pdf_bytes(fragments[9].bytes))
+
+    def test_split_and_extract_page_cache(self):
+        # The second run finds every page's thumbnail and text in the cache --
+        # it writes nothing -- and outputs what an uncached run does. A new
+        # thumbnailSize or thumbnailFormat is a new cache key: it misses.
+        test_dir = "test-split-and-extract-2-pages"
+        cache_dir = tempfile.mkdtemp()
+        try:
+            env = {"PAGE_CACHE_DIR": cache_dir}
+            uncached = self._runAndGatherFragments(test_dir)
+            self._runAndGatherFragments(test_dir, None, env)
+            n_cached_bytes = segment_bytes(cache_dir)
+            self.assertGreater(n_cached_bytes, 0)
+
+            cached = self._runAndGatherFragments(test_dir, None, env)
+            self.assertEqual(n_cached_bytes, segment_bytes(cache_dir), "Second run missed the cache")
+            self.assertEqual(
+                [(f.name, normalize_pdf_bytes(f.bytes)) for f in uncached],
+                [(f.name, normalize_pdf_bytes(f.bytes)) for f in cached],
+            )
+
+            fragments = self._runAndGatherFragments(test_dir, {"thumbnailSize": 140}, env)
+            thumbnails = [f for f in fragments if "-thumbnail." in f.name]
+            self.assertEqual([140, 140], [max(png_dimensions(f.bytes)) for f in thumbnails])
+
+            fragments = self._runAndGatherFragments(test_dir, {"thumbnailFormat": "jpeg"}, env)
+            thumbnails = [f for f in fragments if "-thumbnail." in f.name]
+            self.assertEqual(["0-thumbnail.jpg", "1-thumbnail.jpg"], [f.name for f in thumbnails])
+            self.assertGreater(segment_bytes(cache_dir), n_cached_bytes)
+        finally:
+            shutil.rmtree(cache_dir)
+
+    def test_extract_result_cache(self):
+        # The second run replays the first's output, minus "progress", without
+        # opening the PDF -- with JSON built from its own input.json. A new
+        # option value is a new cache key: it misses.
+        test_dir = "test-extract-2-pages"
+        cache_dir = tempfile.mkdtemp()
+        try:
+            env = {"RESULT_CACHE_DIR": cache_dir}
+            converted = self._runAndGatherFragments(test_dir, None, env)
+            self.assertIn("progress", [f.name for f in converted])
+
+            replayed = self._runAndGatherFragments(test_dir, {"filename": "other/name.doc"}, env)
+            self.assertEqual(
+                [(f.name, f.bytes) for f in converted if f.name not in ("progress", "0.json")],
+                [(f.name, f.bytes) for f in replayed if f.name != "0.json"],
+            )
+            expect_json = json.loads(converted[0].bytes)
+            expect_json["filename"] = "other/name.doc"
+            self.assertEqual(("0.json", expect_json), (replayed[0].name, json.loads(replayed[0].bytes)))
+
+            fragments = self._runAndGatherFragments(test_dir, {"thumbnailSize": 140}, env)
+            self.assertIn("progress", [f.name for f in fragments])
+            thumbnail = next(f for f in fragments if f.name == "0-thumbnail.png")
+            self.assertEqual((140, 140), png_dimensions(thumbnail.bytes))
+        finally:
+            shutil.rmtree(cache_dir)
+
     def test_error_encrypted(self):
         test_dir = "test-error-encrypted"
         self._testFragments(
@@ -196,6 +709,12 @@ class TestSplitPdfAndExtractText(unittest.TestCase):
             test_dir, [load_expected_fragment(test_dir, "error"),],
         )
 
+    def test_error_invalid_option(self):
+        test_dir = "test-error-invalid-option"
+        self._testFragments(
+            test_dir, [load_expected_fragment(test_dir, "error"),],
+        )
+
     def test_owner_protected_pdf(self):
         test_dir = "test-owner-protected-pdf"
         # Works like any other